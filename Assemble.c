@@ -24,6 +24,7 @@
 
 #include	"mdadm.h"
 #include	<ctype.h>
+#include	<sys/wait.h>
 
 static int name_matches(char *found, char *required, char *homehost)
 {
@@ -168,6 +169,9 @@ int Assemble(struct supertype *st, char *mddev,
 	char *name = NULL;
 	int trustworthy;
 	char chosen_name[1024];
+#ifndef MDASSEMBLE
+	struct map_ent *map = NULL;
+#endif
 
 	if (get_linux_version() < 2004000)
 		old_linux = 1;
@@ -222,7 +226,9 @@ int Assemble(struct supertype *st, char *mddev,
 	/* first walk the list of devices to find a consistent set
 	 * that match the criterea, if that is possible.
 	 * We flag the ones we like with 'used'.
+	 * Their superblocks are all read at once first.
 	 */
+	probe_prefetch(devlist);
 	for (tmpdev = devlist;
 	     tmpdev;
 	     tmpdev = tmpdev->next) {
@@ -230,6 +236,7 @@ int Assemble(struct supertype *st, char *mddev,
 		int dfd;
 		struct stat stb;
 		struct supertype *tst = dup_super(st);
+		struct sb_summary *sum;
 
 		if (tmpdev->used > 1) continue;
 
@@ -255,12 +262,22 @@ int Assemble(struct supertype *st, char *mddev,
 			fprintf(stderr, Name ": %s is not a block device.\n",
 				devname);
 			tmpdev->used = 2;
+		} else if (ident->uuid_set && !ident->container &&
+			   !ident->member &&
+			   (!update || strcmp(update, "uuid") != 0) &&
+			   (sum = super_cache_find(dfd)) != NULL &&
+			   (!tst || tst->ss == sum->ss) &&
+			   !same_uuid(sum->uuid, ident->uuid, sum->ss->swapuuid)) {
+			/* The superblock cache says this belongs to some
+			 * other array, so don't bother loading it.
+			 * "wrong uuid" is reported below.
+			 */
 		} else if (!tst && (tst = guess_super(dfd)) == NULL) {
 			if (report_missmatch)
 				fprintf(stderr, Name ": no recogniseable superblock on %s\n",
 					devname);
 			tmpdev->used = 2;
-		} else if (tst->ss->load_super(tst,dfd, NULL)) {
+		} else if (!tst->sb && tst->ss->load_super(tst,dfd, NULL)) {
 			if (report_missmatch)
 				fprintf( stderr, Name ": no RAID superblock on %s\n",
 					 devname);
@@ -397,6 +414,7 @@ int Assemble(struct supertype *st, char *mddev,
 				devname);
 			if (st)
 				st->ss->free_super(st);
+			probe_forget();
 			return 1;
 		}
 
@@ -418,6 +436,7 @@ int Assemble(struct supertype *st, char *mddev,
 				content = NULL;
 				if (auto_assem)
 					goto loop;
+				probe_forget();
 				return 1;
 			}
 			if (ident->member && ident->member[0]) {
@@ -441,6 +460,7 @@ int Assemble(struct supertype *st, char *mddev,
 					"only device given: confused and aborting\n",
 					devname);
 				st->ss->free_super(st);
+				probe_forget();
 				return 1;
 			}
 			if (verbose > 0)
@@ -490,6 +510,7 @@ int Assemble(struct supertype *st, char *mddev,
 				devname);
 			tst->ss->free_super(tst);
 			st->ss->free_super(st);
+			probe_forget();
 			return 1;
 		}
 
@@ -502,6 +523,17 @@ int Assemble(struct supertype *st, char *mddev,
 			tst->ss->free_super(tst);
 	}
 
+	/* Those we chose (or the container we stopped at) will be
+	 * written to from here on, so if the copies are being held
+	 * for another scan, theirs must go.
+	 */
+	probe_forget();
+	if (tmpdev)
+		probe_drop(tmpdev->devname);
+	for (tmpdev = devlist; tmpdev; tmpdev = tmpdev->next)
+		if (tmpdev->used == 1)
+			probe_drop(tmpdev->devname);
+
 	if (!st || !st->sb || !content)
 		return 2;
 
@@ -545,8 +577,20 @@ int Assemble(struct supertype *st, char *mddev,
 		/* Ignore 'host:' prefix of name */
 		name = strchr(name, ':')+1;
 
+#ifndef MDASSEMBLE
+	/* Several arrays may be being assembled at once (AssembleScan),
+	 * so hold the map lock while choosing a device, and until it
+	 * is open so that find_free_devnum will pass over it.
+	 */
+	map_lock(&map);
+#endif
 	mdfd = create_mddev(mddev, name, ident->autof, trustworthy,
 			    chosen_name);
+#ifndef MDASSEMBLE
+	map_unlock(&map);
+	map_free(map);
+	map = NULL;
+#endif
 	if (mdfd < 0) {
 		st->ss->free_super(st);
 		free(devices);
@@ -1384,3 +1428,227 @@ int assemble_container_content(struct supertype *st, int mdfd,
 }
 #endif
 
+
+#ifndef MDASSEMBLE
+/*
+ * Assembling everything in mdadm.conf one array at a time means
+ * walking every device once per array, and waiting for each array
+ * to start before looking at the next.  AssembleScan reads each
+ * device once, works out which devices each ARRAY line wants, and
+ * assembles arrays that have nothing in common at the same time,
+ * each in its own process so that Assemble can be used as it is.
+ * Arrays that appear once others have started (md on md) are looked
+ * for in the next wave.  Anything that it cannot place (members of
+ * containers, arrays with no devices found) is left for the caller
+ * to assemble one at a time as before, so errors are reported in
+ * the same way.
+ */
+#define ASSEMBLE_PARALLEL 16
+
+struct plan_dev {
+	char *devname;
+	struct superswitch *ss;		/* NULL if no superblock */
+	struct mdinfo info;
+	int used;			/* wave that claimed it */
+	struct plan_dev *next;
+};
+
+static void plan_probe(struct plan_dev **devs)
+{
+	/* Look at every device that we haven't seen before */
+	mddev_dev_t dv, new = NULL, n;
+	struct plan_dev *pd;
+
+	for (dv = conf_get_devs(); dv; dv = dv->next) {
+		for (pd = *devs; pd; pd = pd->next)
+			if (strcmp(pd->devname, dv->devname) == 0)
+				break;
+		if (pd)
+			continue;
+		pd = calloc(1, sizeof(*pd));
+		n = calloc(1, sizeof(*n));
+		if (!pd || !n) {
+			free(pd);
+			free(n);
+			break;
+		}
+		pd->devname = strdup(dv->devname);
+		pd->next = *devs;
+		*devs = pd;
+		n->devname = pd->devname;
+		n->next = new;
+		new = n;
+	}
+
+	probe_prefetch(new);
+	probe_hold(1);
+	for (dv = new; dv; dv = dv->next) {
+		struct supertype *st;
+		struct stat stb;
+		int fd;
+
+		for (pd = *devs; pd->devname != dv->devname; pd = pd->next)
+			;
+		fd = dev_open(dv->devname, O_RDONLY|O_EXCL);
+		if (fd < 0)
+			continue;
+		if (fstat(fd, &stb) == 0 && S_ISBLK(stb.st_mode) &&
+		    (st = guess_super(fd)) != NULL) {
+			if (st->sb || st->ss->load_super(st, fd, NULL) == 0) {
+				st->ss->getinfo_super(st, &pd->info);
+				pd->ss = st->ss;
+				st->ss->free_super(st);
+			}
+			free(st);
+		}
+		close(fd);
+	}
+	while (new) {
+		n = new;
+		new = n->next;
+		free(n);
+	}
+}
+
+static int plan_match(struct supertype *ss, mddev_ident_t a,
+		      struct plan_dev *pd, char *homehost)
+{
+	/* Would Assemble choose this device for this array? */
+	struct supertype *st = ss ? ss : a->st;
+
+	if (!pd->ss)
+		return 0;
+	if (a->devices && !match_oneof(a->devices, pd->devname))
+		return 0;
+	if (st && st->ss != pd->ss)
+		return 0;
+	if (a->uuid_set &&
+	    !same_uuid(pd->info.uuid, a->uuid, pd->ss->swapuuid))
+		return 0;
+	if (a->name[0] && !name_matches(pd->info.name, a->name, homehost))
+		return 0;
+	if (a->super_minor != UnSet &&
+	    a->super_minor != pd->info.array.md_minor)
+		return 0;
+	if (a->level != UnSet && a->level != pd->info.array.level)
+		return 0;
+	if (a->raid_disks != UnSet &&
+	    a->raid_disks != pd->info.array.raid_disks)
+		return 0;
+	return 1;
+}
+
+int AssembleScan(struct supertype *ss, mddev_ident_t array_list,
+		 int readonly, int runstop,
+		 char *homehost, int require_homehost,
+		 int verbose, int force)
+{
+	/* Returns the number of arrays assembled.  Those that were
+	 * tried and failed have what Assemble returned in 'tried'.
+	 */
+	struct plan_dev *devs = NULL, *pd;
+	mddev_ident_t a;
+	mddev_ident_t ready[ASSEMBLE_PARALLEL];
+	pid_t pids[ASSEMBLE_PARALLEL];
+	int nready, running, started, i;
+	int wave = 0;
+	int cnt = 0;
+
+	do {
+		wave++;
+		plan_probe(&devs);
+
+		/* Choose the arrays that can go now */
+		nready = 0;
+		for (a = array_list; a && nready < ASSEMBLE_PARALLEL;
+		     a = a->next) {
+			int found = 0, clash = 0;
+
+			if (a->assembled || a->tried ||
+			    a->container || a->member)
+				continue;
+			if (a->devname &&
+			    strcasecmp(a->devname, "<ignore>") == 0)
+				continue;
+			for (pd = devs; pd; pd = pd->next) {
+				if (pd->used && pd->used < wave)
+					continue;
+				if (!plan_match(ss, a, pd, homehost))
+					continue;
+				found = 1;
+				if (pd->used)
+					clash = 1;
+			}
+			if (!found || clash)
+				continue;
+			for (pd = devs; pd; pd = pd->next)
+				if (!pd->used && plan_match(ss, a, pd, homehost))
+					pd->used = wave;
+			ready[nready++] = a;
+		}
+
+		started = 0;
+		if (nready == 1) {
+			int rv = Assemble(ss, ready[0]->devname, ready[0],
+					  NULL, NULL, readonly, runstop, NULL,
+					  homehost, require_homehost,
+					  verbose, force);
+			if (rv == 0)
+				ready[0]->assembled = 1;
+			else
+				ready[0]->tried = rv;
+		} else if (nready > 1) {
+			fflush(stdout);
+			fflush(stderr);
+			running = 0;
+			for (i = 0; i < nready; i++) {
+				a = ready[i];
+				pids[i] = fork();
+				if (pids[i] == 0)
+					exit(Assemble(ss, a->devname, a,
+						      NULL, NULL,
+						      readonly, runstop, NULL,
+						      homehost, require_homehost,
+						      verbose, force));
+				if (pids[i] < 0)
+					/* leave it for the caller */
+					continue;
+				running++;
+			}
+			while (running) {
+				int status;
+				pid_t pid = waitpid(-1, &status, 0);
+
+				if (pid < 0)
+					break;
+				for (i = 0; i < nready; i++)
+					if (pids[i] == pid)
+						break;
+				if (i == nready)
+					continue;
+				running--;
+				if (!WIFEXITED(status))
+					ready[i]->tried = 1;
+				else if (WEXITSTATUS(status) == 0)
+					ready[i]->assembled = 1;
+				else
+					ready[i]->tried = WEXITSTATUS(status);
+			}
+		}
+		for (i = 0; i < nready; i++)
+			if (ready[i]->assembled)
+				started++;
+		cnt += started;
+		/* The copies are stale once arrays are running */
+		probe_hold(0);
+	} while (started);
+
+	while (devs) {
+		pd = devs;
+		devs = pd->next;
+		free(pd->devname);
+		free(pd);
+	}
+	return cnt;
+}
+#endif
@@ -177,9 +177,9 @@ int Create(struct supertype *st, char *mddev,
 					have_container = 1;
 			} else {
 				st = guess_super(fd);
-				if (st && !(rv = st->ss->
+				if (st && (st->sb || !(rv = st->ss->
 					    load_super(st, fd,
-						       devlist->devname)))
+						       devlist->devname))))
 					have_container = 1;
 				else
 					st = NULL;
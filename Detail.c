@@ -27,6 +27,56 @@
 #include	"md_u.h"
 #include	<dirent.h>
 
+static void detail_sync_rate(struct mdinfo *sra)
+{
+	/* The kernel's idea of the current speed is averaged over
+	 * the last few seconds, which is good enough to guess when
+	 * the rebuild will finish.  If it has dropped to nothing,
+	 * the rebuild isn't making progress.
+	 */
+	char buf[100];
+	unsigned long long done, max, speed;
+
+	if (sysfs_get_str(sra, NULL, "sync_completed", buf, sizeof(buf)) <= 0 ||
+	    sscanf(buf, "%llu / %llu", &done, &max) != 2 ||
+	    sysfs_get_ll(sra, NULL, "sync_speed", &speed) != 0)
+		return;
+	if (speed == 0)
+		printf("    Rebuild ETA : unknown, no progress\n");
+	else if (max > done)
+		printf("    Rebuild ETA : %llu.%llumin at %lluK/sec\n",
+		       (max - done) / 2 / speed / 60,
+		       (max - done) / 2 / speed % 60 / 6, speed);
+}
+
+static int *detail_slow(mdu_disk_info_t *disks, int max_disks)
+{
+	/* Find members that have taken much longer over each request
+	 * than the others.  We only get one look, so this uses the
+	 * counters since the devices appeared.
+	 */
+	struct disk_stat *ds;
+	int *slow;
+	int d;
+
+	ds = calloc(max_disks, sizeof(*ds));
+	slow = calloc(max_disks, sizeof(*slow));
+	if (!ds || !slow) {
+		free(ds);
+		free(slow);
+		return NULL;
+	}
+	for (d = 0; d < max_disks; d++)
+		if ((disks[d].major || disks[d].minor) &&
+		    !(disks[d].state & (1<<MD_DISK_FAULTY)) &&
+		    sysfs_disk_stat(disks[d].major, disks[d].minor,
+				    &ds[d]) != 0)
+			memset(&ds[d], 0, sizeof(ds[d]));
+	disk_stat_slow(ds, max_disks, slow);
+	free(ds);
+	return slow;
+}
+
 int Detail(char *dev, int brief, int export, int test, char *homehost)
 {
 	/*
@@ -58,6 +108,7 @@ int Detail(char *dev, int brief, int export, int test, char *homehost)
 	int rv = test ? 4 : 1;
 	int avail_disks = 0;
 	char *avail;
+	int *slow = NULL;
 
 	if (fd < 0) {
 		fprintf(stderr, Name ": cannot open %s: %s\n",
@@ -414,6 +465,8 @@ int Detail(char *dev, int brief, int export, int test, char *homehost)
 			          "shape":"build",
 			       e->percent);
 			is_rebuilding = 1;
+			if (sra)
+				detail_sync_rate(sra);
 		}
 		free_mdstat(ms);
 
@@ -465,20 +518,22 @@ This is pretty boring
 			/* This looks like a container.  Find any active arrays
 			 * That claim to be a member.
 			 */
-			DIR *dir = opendir("/sys/block");
+			char path[PATH_MAX];
+			DIR *dir;
 			struct dirent *de;
 
+			sprintf(path, "%s/sys/block", mdadm_root());
+			dir = opendir(path);
 			printf("  Member Arrays :");
 
 			while (dir && (de = readdir(dir)) != NULL) {
-				char path[200];
 				char vbuf[1024];
 				int nlen = strlen(sra->sys_name);
 				int dn;
 				if (de->d_name[0] == '.')
 					continue;
-				sprintf(path, "/sys/block/%s/md/metadata_version",
-					de->d_name);
+				sprintf(path, "%s/sys/block/%s/md/metadata_version",
+					mdadm_root(), de->d_name);
 				if (load_sys(path, vbuf) < 0)
 					continue;
 				if (strncmp(vbuf, "external:", 9) != 0 ||
@@ -501,6 +556,9 @@ This is pretty boring
 			printf("    Number   Major   Minor   RaidDevice\n");
 	}
 
+	if (!brief && array.raid_disks)
+		slow = detail_slow(disks, max_disks);
+
 	for (d= 0; d < max_disks; d++) {
 		char *dv;
 		mdu_disk_info_t disk = disks[d];
@@ -530,6 +588,7 @@ This is pretty boring
 			if (disk.state & (1<<MD_DISK_SYNC)) printf(" sync");
 			if (disk.state & (1<<MD_DISK_REMOVED)) printf(" removed");
 			if (disk.state & (1<<MD_DISK_WRITEMOSTLY)) printf(" writemostly");
+			if (slow && slow[d]) printf(" slow");
 			if ((disk.state &
 			     ((1<<MD_DISK_ACTIVE)|(1<<MD_DISK_SYNC)|(1<<MD_DISK_REMOVED)))
 			    == 0) {
@@ -579,6 +638,7 @@ This is pretty boring
 		rv = 2;
 
 	free(disks);
+	free(slow);
 out:
 	close(fd);
 	return rv;
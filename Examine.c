@@ -62,6 +62,7 @@ int Examine(mddev_dev_t devlist, int brief, int export, int scan,
 		int spares;
 	} *arrays = NULL;
 
+	probe_prefetch(devlist);
 	for (; devlist ; devlist=devlist->next) {
 		struct supertype *st;
 
@@ -79,7 +80,9 @@ int Examine(mddev_dev_t devlist, int brief, int export, int scan,
 				st = dup_super(forcest);
 			else
 				st = guess_super(fd);
-			if (st)
+			if (st && st->sb)
+				err = 0;
+			else if (st)
 				err = st->ss->load_super(st, fd,
 							 (brief||scan) ? NULL
 							   :devlist->devname);
@@ -132,6 +135,7 @@ int Examine(mddev_dev_t devlist, int brief, int export, int scan,
 			st->ss->free_super(st);
 		}
 	}
+	probe_forget();
 	if (brief) {
 		struct array *ap;
 		for (ap=arrays; ap; ap=ap->next) {
@@ -29,8 +29,14 @@
  */
 
 #include	"mdadm.h"
+#include	<sys/socket.h>
+#include	<sys/un.h>
+#include	<poll.h>
+#include	<signal.h>
 
 static int count_active(struct supertype *st, int mdfd, char **availp,
+			struct mdinfo *info, struct map_ent **map);
+static void note_member(struct map_ent **map, int devnum, struct stat *stb,
 			struct mdinfo *info);
 static void find_reject(int mdfd, struct supertype *st, struct mdinfo *sra,
 			int number, __u64 events, int verbose,
@@ -136,7 +142,7 @@ int Incremental(char *devname, int verbose, int runstop,
 		close(dfd);
 		return 1;
 	}
-	if (st->ss->load_super(st, dfd, NULL)) {
+	if (!st->sb && st->ss->load_super(st, dfd, NULL)) {
 		if (verbose >= 0)
 			fprintf(stderr, Name ": no RAID superblock on %s.\n",
 				devname);
@@ -144,6 +150,8 @@ int Incremental(char *devname, int verbose, int runstop,
 		return 1;
 	}
 	close (dfd);
+	/* Copies from --listen's prefetch are only for identifying it */
+	probe_scan(0);
 
 	memset(&info, 0, sizeof(info));
 	st->ss->getinfo_super(st, &info);
@@ -293,8 +301,9 @@ int Incremental(char *devname, int verbose, int runstop,
 		name_to_use = strchr(name_to_use, ':')+1;
 
 	/* 4/ Check if array exists.
+	 * Only others working on this array need to be kept out.
 	 */
-	if (map_lock(&map))
+	if (map_lock_array(&map, info.uuid))
 		fprintf(stderr, Name ": failed to get exclusive lock on "
 			"mapfile\n");
 	mp = map_by_uuid(&map, info.uuid);
@@ -307,12 +316,18 @@ int Incremental(char *devname, int verbose, int runstop,
 		struct mdinfo *sra;
 		struct mdinfo dinfo;
 
-		/* Couldn't find an existing array, maybe make a new one */
+		/* Couldn't find an existing array, maybe make a new one.
+		 * Nothing else may choose a name or number until it is
+		 * in the map.
+		 */
+		map_lock(&map);
 		mdfd = create_mddev(match ? match->devname : NULL,
 				    name_to_use, autof, trustworthy, chosen_name);
 
-		if (mdfd < 0)
+		if (mdfd < 0) {
+			map_unlock(&map);
 			return 1;
+		}
 
 		sysfs_init(&info, mdfd, 0);
 
@@ -347,12 +362,14 @@ int Incremental(char *devname, int verbose, int runstop,
 			sysfs_free(sra);
 			return 2;
 		}
-		info.array.working_disks = 1;
 		sysfs_free(sra);
 		/* 6/ Make sure /var/run/mdadm.map contains this array. */
 		map_update(&map, fd2devnum(mdfd),
 			   info.text_version,
 			   info.uuid, chosen_name);
+		map_unlock(&map);
+		note_member(&map, fd2devnum(mdfd), &stb, &info);
+		info.array.working_disks = 1;
 	} else {
 	/* 5b/ if it does */
 	/* - check one drive in array to make sure metadata is a reasonably */
@@ -449,6 +466,7 @@ int Incremental(char *devname, int verbose, int runstop,
 			close(mdfd);
 			return 2;
 		}
+		note_member(&map, fd2devnum(mdfd), &stb, &info);
 		info.array.working_disks = 0;
 		for (d = sra->devs; d; d=d->next)
 			info.array.working_disks ++;
@@ -459,7 +477,7 @@ int Incremental(char *devname, int verbose, int runstop,
 	/* 7a/ if not, finish with success. */
 	if (info.array.level == LEVEL_CONTAINER) {
 		/* Try to assemble within the container */
-		map_unlock(&map);
+		map_unlock_array(&map);
 		sysfs_uevent(&info, "change");
 		if (verbose >= 0)
 			fprintf(stderr, Name
@@ -477,7 +495,7 @@ int Incremental(char *devname, int verbose, int runstop,
 		return rv;
 	}
 	avail = NULL;
-	active_disks = count_active(st, mdfd, &avail, &info);
+	active_disks = count_active(st, mdfd, &avail, &info, &map);
 	if (enough(info.array.level, info.array.raid_disks,
 		   info.array.layout, info.array.state & 1,
 		   avail, active_disks) == 0) {
@@ -486,7 +504,7 @@ int Incremental(char *devname, int verbose, int runstop,
 			fprintf(stderr, Name
 			     ": %s attached to %s, not enough to start (%d).\n",
 				devname, chosen_name, active_disks);
-		map_unlock(&map);
+		map_unlock_array(&map);
 		close(mdfd);
 		return 0;
 	}
@@ -504,11 +522,11 @@ int Incremental(char *devname, int verbose, int runstop,
 			   ": %s attached to %s which is already active.\n",
 				devname, chosen_name);
 		close(mdfd);
-		map_unlock(&map);
+		map_unlock_array(&map);
 		return 0;
 	}
 
-	map_unlock(&map);
+	map_unlock_array(&map);
 	if (runstop > 0 || active_disks >= info.array.working_disks) {
 		struct mdinfo *sra;
 		/* Let's try to start it */
@@ -606,8 +624,31 @@ static void find_reject(int mdfd, struct supertype *st, struct mdinfo *sra,
 	}
 }
 
+static void note_member(struct map_ent **map, int devnum, struct stat *stb,
+			struct mdinfo *info)
+{
+	/* Record in the map what is on this new member, for count_active */
+	struct map_ent *mp = map_by_devnum(map, devnum);
+
+	if (mp)
+		map_note_member(mp, major(stb->st_rdev), minor(stb->st_rdev),
+				info);
+}
+
+static void member_info(struct map_member *mm, struct mdinfo *info)
+{
+	info->disk.raid_disk = mm->role;
+	info->events = mm->events;
+	info->disk.state = mm->state;
+	info->array.level = mm->level;
+	info->array.raid_disks = mm->raid_disks;
+	info->array.layout = mm->layout;
+	info->array.state = mm->array_state;
+	info->array.working_disks = mm->working_disks;
+}
+
 static int count_active(struct supertype *st, int mdfd, char **availp,
-			struct mdinfo *bestinfo)
+			struct mdinfo *bestinfo, struct map_ent **map)
 {
 	/* count how many devices in sra think they are active */
 	struct mdinfo *d;
@@ -615,25 +656,42 @@ static int count_active(struct supertype *st, int mdfd, char **availp,
 	__u64 max_events = 0;
 	struct mdinfo *sra = sysfs_read(mdfd, -1, GET_DEVS | GET_STATE);
 	char *avail = NULL;
+	struct map_ent *mp = NULL;
+	mdu_array_info_t ainf;
 
 	if (!sra)
 		return 0;
 
+	/* Once the array is running, md writes the superblocks, so
+	 * what the map says about them is only good until then.
+	 */
+	if (ioctl(mdfd, GET_ARRAY_INFO, &ainf) != 0)
+		mp = map_by_devnum(map, fd2devnum(mdfd));
+
 	for (d = sra->devs ; d ; d = d->next) {
 		char dn[30];
 		int dfd;
 		int ok;
+		int newbest = 0;
 		struct mdinfo info;
+		struct map_member *m = NULL;
 
-		sprintf(dn, "%d:%d", d->disk.major, d->disk.minor);
-		dfd = dev_open(dn, O_RDONLY);
-		if (dfd < 0)
-			continue;
-		ok =  st->ss->load_super(st, dfd, NULL);
-		close(dfd);
-		if (ok != 0)
-			continue;
-		st->ss->getinfo_super(st, &info);
+		if (mp)
+			m = map_find_member(mp, d->disk.major, d->disk.minor);
+		if (m) {
+			memset(&info, 0, sizeof(info));
+			member_info(m, &info);
+		} else {
+			sprintf(dn, "%d:%d", d->disk.major, d->disk.minor);
+			dfd = dev_open(dn, O_RDONLY);
+			if (dfd < 0)
+				continue;
+			ok =  st->ss->load_super(st, dfd, NULL);
+			close(dfd);
+			if (ok != 0)
+				continue;
+			st->ss->getinfo_super(st, &info);
+		}
 		if (!avail) {
 			avail = malloc(info.array.raid_disks);
 			if (!avail) {
@@ -650,7 +708,7 @@ static int count_active(struct supertype *st, int mdfd, char **availp,
 				cnt++;
 				max_events = info.events;
 				avail[info.disk.raid_disk] = 2;
-				st->ss->getinfo_super(st, bestinfo);
+				newbest = 1;
 			} else if (info.events == max_events) {
 				cnt++;
 				avail[info.disk.raid_disk] = 2;
@@ -668,16 +726,24 @@ static int count_active(struct supertype *st, int mdfd, char **availp,
 					if (avail[i])
 						avail[i]--;
 				avail[info.disk.raid_disk] = 2;
-				st->ss->getinfo_super(st, bestinfo);
+				newbest = 1;
 			} else { /* info.events much bigger */
 				cnt = 1; cnt1 = 0;
 				memset(avail, 0, info.disk.raid_disk);
 				max_events = info.events;
-				st->ss->getinfo_super(st, bestinfo);
+				newbest = 1;
 			}
 		}
-		st->ss->free_super(st);
+		if (newbest) {
+			if (m)
+				member_info(m, bestinfo);
+			else
+				st->ss->getinfo_super(st, bestinfo);
+		}
+		if (!m)
+			st->ss->free_super(st);
 	}
+	sysfs_free(sra);
 	return cnt + cnt1;
 }
 
@@ -900,6 +966,9 @@ int IncrementalRemove(char *devname, int verbose)
 	int rv;
 	struct mdstat_ent *ent;
 	struct mddev_dev_s devlist;
+	struct map_ent *mp, *map = NULL;
+	char path[PATH_MAX];
+	struct stat stb;
 
 	if (strchr(devname, '/')) {
 		fprintf(stderr, Name ": incremental removal requires a "
@@ -924,5 +993,460 @@ int IncrementalRemove(char *devname, int verbose)
 	devlist.disposition = 'r';
 	rv = Manage_subdevs(ent->dev, mdfd, &devlist, verbose, 0);
 	close(mdfd);
+
+	/* The map mustn't vouch for whatever next appears here */
+	sprintf(path, "/dev/%s", devname);
+	if (stat(path, &stb) == 0) {
+		mp = map_by_devnum(&map, ent->devnum);
+		if (mp)
+			map_forget_member(mp, major(stb.st_rdev),
+					  minor(stb.st_rdev));
+		map_free(map);
+	}
+	return rv;
+}
+
+/*
+ * When many devices appear at once, as at boot, running a new mdadm
+ * for each one means reading mdadm.conf, the map and the superblocks
+ * of the other members of the array every time.
+ * "mdadm --incremental --listen" stays running and is handed device
+ * names by each "mdadm --incremental" (IncrementalSend) instead, or
+ * reads them from stdin for "mdadm --incremental -".  Names that
+ * arrive close together are dealt with as one batch: all their
+ * superblocks are read at once first.
+ * A client sends its own options too, and its stderr so that what is
+ * said about its device is said to whoever asked.
+ * mdadm.conf is read just once; send SIGHUP to have it read again.
+ */
+#define INCR_BATCH_GAP	20	/* msecs to wait for another device */
+#define INCR_BATCH_MAX	500	/* msecs to wait for a whole batch */
+#define INCR_BATCH_SIZE	256
+#define INCR_REPLY_TMO	120	/* secs a client waits for an answer */
+
+struct incr_event {
+	char *devname;
+	int runstop;
+	int fd;			/* to answer on, or -1 */
+	int verbose;
+	char *homehost;
+	int require_homehost;
+	int autof;
+	int errfd;		/* the client's stderr, or -1 */
+};
+
+static volatile int incr_hup, incr_term;
+
+static void incr_signal(int sig)
+{
+	if (sig == SIGHUP)
+		incr_hup = 1;
+	else
+		incr_term = 1;
+}
+
+static void incr_sock_name(char *path)
+{
+	sprintf(path, "%s%s/%s", mdadm_root(), MAP_DIR, INCREMENTAL_SOCK);
+}
+
+static int incr_send_fd(int sfd, int fd)
+{
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	char c = 0;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+	return sendmsg(sfd, &mh, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+static int incr_recv_fd(int sfd)
+{
+	/* What incr_send_fd sent, which follows the message at once */
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	struct pollfd pfd;
+	char c;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	int fd = -1;
+
+	pfd.fd = sfd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 1000) != 1)
+		return -1;
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	if (recvmsg(sfd, &mh, MSG_CMSG_CLOEXEC) != 1)
+		return -1;
+	cm = CMSG_FIRSTHDR(&mh);
+	if (cm && cm->cmsg_level == SOL_SOCKET &&
+	    cm->cmsg_type == SCM_RIGHTS &&
+	    cm->cmsg_len == CMSG_LEN(sizeof(int)))
+		memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+	return fd;
+}
+
+int IncrementalSend(char *devname, int verbose, int runstop,
+		    char *homehost, int require_homehost, int autof)
+{
+	/* If "mdadm --incremental --listen" is running, hand 'devname'
+	 * to it, with our options and our stderr to report on, and
+	 * return what it made of it.
+	 * -1 if there is nobody to hand it to.  Once it has been handed
+	 * over we mustn't do it ourselves as well, so no answer is -2.
+	 */
+	char path[PATH_MAX];
+	char buf[PATH_MAX + 300];
+	struct sockaddr_un addr;
+	struct metadata_update msg;
+	int sfd;
+	int witherr;
+	int rv = -1;
+
+	if (devname[0] != '/')
+		return -1;
+	/* The options follow the name after a nul, where a listener
+	 * from before they were sent doesn't see them.
+	 */
+	msg.len = snprintf(buf, sizeof(buf), "%d %s", runstop, devname) + 1;
+	witherr = fcntl(2, F_GETFD) >= 0;
+	if (msg.len < (int)sizeof(buf))
+		msg.len += snprintf(buf + msg.len, sizeof(buf) - msg.len,
+				    "%d %d %d %d %s", verbose,
+				    require_homehost, autof, witherr,
+				    homehost ? homehost : "");
+	if (msg.len >= (int)sizeof(buf))
+		return -1;
+	incr_sock_name(path);
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	sfd = socket(PF_LOCAL, SOCK_STREAM, 0);
+	if (sfd < 0)
+		return -1;
+	addr.sun_family = PF_LOCAL;
+	strcpy(addr.sun_path, path);
+	if (connect(sfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(sfd);
+		return -1;
+	}
+	msg.buf = buf;
+	/* a listener that goes away is just a failed send */
+	signal(SIGPIPE, SIG_IGN);
+	if (send_message(sfd, &msg, 20) != 0 ||
+	    (witherr && incr_send_fd(sfd, 2) != 0)) {
+		/* the listener drops anything incomplete */
+		close(sfd);
+		return -1;
+	}
+	rv = -2;
+	if (receive_message(sfd, &msg, INCR_REPLY_TMO) == 0) {
+		if (msg.len == 1)
+			rv = msg.buf[0];
+		free(msg.buf);
+	}
+	close(sfd);
 	return rv;
 }
+
+static int incr_listen_sock(void)
+{
+	char path[PATH_MAX];
+	struct sockaddr_un addr;
+	int fd;
+
+	incr_sock_name(path);
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, Name ": socket name too long: %s\n", path);
+		return -1;
+	}
+	fd = socket(PF_LOCAL, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	addr.sun_family = PF_LOCAL;
+	strcpy(addr.sun_path, path);
+	sprintf(path, "%s%s", mdadm_root(), MAP_DIR);
+	mkdir(path, 0755);
+	unlink(addr.sun_path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 64) < 0) {
+		fprintf(stderr, Name ": cannot listen on %s: %s\n",
+			addr.sun_path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+static void incr_event_free(struct incr_event *ev)
+{
+	free(ev->devname);
+	free(ev->homehost);
+	if (ev->fd >= 0)
+		close(ev->fd);
+	if (ev->errfd >= 0)
+		close(ev->errfd);
+}
+
+static int incr_accept(int sfd, struct incr_event *ev, int n,
+		       struct incr_event *dflt)
+{
+	/* Take whatever clients are waiting.  Each sends just one
+	 * message, and its stderr if it says so, straight away.
+	 * An older client sends no options, so gets ours.
+	 */
+	struct metadata_update msg;
+	char *sp;
+	int fd, l, k, witherr;
+
+	while (n < INCR_BATCH_SIZE &&
+	       (fd = accept(sfd, NULL, NULL)) >= 0) {
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		if (receive_message(fd, &msg, 1) != 0 || msg.len <= 0) {
+			close(fd);
+			continue;
+		}
+		msg.buf = realloc(msg.buf, msg.len + 1);
+		msg.buf[msg.len] = 0;
+		sp = strchr(msg.buf, ' ');
+		if (!sp || sp[1] != '/') {
+			free(msg.buf);
+			close(fd);
+			continue;
+		}
+		ev[n] = *dflt;
+		ev[n].runstop = atoi(msg.buf);
+		ev[n].devname = strdup(sp + 1);
+		ev[n].fd = fd;
+		l = strlen(msg.buf) + 1;
+		k = witherr = 0;
+		if (l < msg.len &&
+		    (sscanf(msg.buf + l, "%d %d %d %d %n", &ev[n].verbose,
+			    &ev[n].require_homehost, &ev[n].autof,
+			    &witherr, &k) < 4 || k == 0)) {
+			ev[n].homehost = NULL;
+			incr_event_free(&ev[n]);
+			free(msg.buf);
+			continue;
+		}
+		if (l < msg.len)
+			ev[n].homehost = msg.buf[l + k] ?
+				strdup(msg.buf + l + k) : NULL;
+		else if (dflt->homehost)
+			ev[n].homehost = strdup(dflt->homehost);
+		free(msg.buf);
+		if (witherr && (ev[n].errfd = incr_recv_fd(fd)) < 0) {
+			incr_event_free(&ev[n]);
+			continue;
+		}
+		n++;
+	}
+	return n;
+}
+
+static int incr_read(char *buf, int *len, struct incr_event *ev, int n,
+		     struct incr_event *dflt, int *eof)
+{
+	/* Take whole lines from stdin, reading more if there
+	 * aren't any.
+	 */
+	char *nl;
+	int r;
+
+	if (!*eof && *len < PATH_MAX && !memchr(buf, '\n', *len)) {
+		r = read(0, buf + *len, PATH_MAX - *len);
+		if (r > 0)
+			*len += r;
+		else if (r == 0 || errno != EINTR)
+			*eof = 1;
+	}
+	while (n < INCR_BATCH_SIZE && *len &&
+	       ((nl = memchr(buf, '\n', *len)) != NULL ||
+		*eof || *len == PATH_MAX)) {
+		int l = nl ? nl - buf : *len;
+
+		if (l) {
+			ev[n] = *dflt;
+			ev[n].devname = strndup(buf, l);
+			if (dflt->homehost)
+				ev[n].homehost = strdup(dflt->homehost);
+			n++;
+		}
+		if (nl)
+			l++;
+		*len -= l;
+		memmove(buf, buf + l, *len);
+	}
+	return n;
+}
+
+static long msecs_since(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_usec - start->tv_usec) / 1000;
+}
+
+int IncrementalListen(int from_stdin, int verbose, int runstop,
+		      char *homehost, int require_homehost, int autof,
+		      char *argv[])
+{
+	struct incr_event ev[INCR_BATCH_SIZE], dflt;
+	struct mddev_dev_s devs[INCR_BATCH_SIZE];
+	struct map_ent *map = NULL;
+	struct sigaction sa;
+	struct timeval first;
+	struct pollfd pfd;
+	char buf[PATH_MAX];
+	int len = 0;
+	int eof = 0;
+	int n, i, tmo;
+	int status = 0;
+	int saved;
+	char rv;
+
+	memset(&dflt, 0, sizeof(dflt));
+	dflt.verbose = verbose;
+	dflt.runstop = runstop;
+	dflt.homehost = homehost;
+	dflt.require_homehost = require_homehost;
+	dflt.autof = autof;
+	dflt.fd = dflt.errfd = -1;
+
+	pfd.fd = from_stdin ? 0 : incr_listen_sock();
+	if (pfd.fd < 0)
+		return 1;
+	pfd.events = POLLIN;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = incr_signal;
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Read the config now, rather than when the first device comes */
+	conf_get_ident(NULL);
+
+	while (!incr_term && !incr_hup && (!eof || len)) {
+		n = 0;
+		tmo = -1;
+		while (n < INCR_BATCH_SIZE && !incr_term) {
+			int ready = from_stdin &&
+				(eof || memchr(buf, '\n', len) != NULL);
+
+			if (eof && !len)
+				break;
+			if (!ready && poll(&pfd, 1, tmo) <= 0) {
+				if (tmo >= 0 || errno != EINTR)
+					break;
+				if (incr_hup)
+					break;
+				continue;
+			}
+			if (n == 0)
+				gettimeofday(&first, NULL);
+			if (from_stdin)
+				n = incr_read(buf, &len, ev, n, &dflt, &eof);
+			else
+				n = incr_accept(pfd.fd, ev, n, &dflt);
+			if (n) {
+				tmo = INCR_BATCH_MAX - msecs_since(&first);
+				if (tmo > INCR_BATCH_GAP)
+					tmo = INCR_BATCH_GAP;
+				if (tmo < 0)
+					break;
+			}
+		}
+		if (n == 0)
+			continue;
+
+		/* Read all their superblocks at once, then add
+		 * them one at a time.
+		 */
+		memset(devs, 0, n * sizeof(devs[0]));
+		for (i = 0; i < n; i++) {
+			devs[i].devname = ev[i].devname;
+			devs[i].next = i + 1 < n ? &devs[i+1] : NULL;
+		}
+		probe_prefetch(devs);
+		probe_hold(1);
+		for (i = 0; i < n; i++) {
+			/* for the superblock of this one, but only until
+			 * Incremental has identified it.
+			 */
+			probe_scan(1);
+			saved = -2;
+			if (ev[i].errfd >= 0) {
+				saved = dup(2);
+				dup2(ev[i].errfd, 2);
+			}
+			rv = Incremental(ev[i].devname, ev[i].verbose,
+					 ev[i].runstop, NULL, ev[i].homehost,
+					 ev[i].require_homehost, ev[i].autof);
+			if (saved >= 0) {
+				dup2(saved, 2);
+				close(saved);
+			} else if (saved == -1)
+				/* we had no stderr, so mustn't keep theirs */
+				close(2);
+			status |= rv;
+			/* Incremental doesn't always unlock the map
+			 * before returning an error.
+			 */
+			map_unlock_array(&map);
+			map_unlock(&map);
+			if (ev[i].fd >= 0) {
+				struct metadata_update msg;
+
+				msg.len = 1;
+				msg.buf = &rv;
+				send_message(ev[i].fd, &msg, 1);
+			}
+			incr_event_free(&ev[i]);
+		}
+		probe_hold(0);
+		/* Others may have written superblocks by next time */
+		super_cache_reset();
+	}
+
+	if (!from_stdin) {
+		incr_sock_name(buf);
+		unlink(buf);
+		close(pfd.fd);
+	}
+	if (incr_hup && argv) {
+		/* Start again, to read mdadm.conf afresh */
+		if (verbose >= 0)
+			fprintf(stderr, Name ": reloading mdadm.conf\n");
+		execv("/proc/self/exe", argv);
+		execvp(argv[0], argv);
+		fprintf(stderr, Name ": cannot restart: %s\n",
+			strerror(errno));
+		return 1;
+	}
+	/* Only the answers to stdin are ours to give */
+	return from_stdin ? status : 0;
+}
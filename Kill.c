@@ -59,7 +59,7 @@ int Kill(char *dev, struct supertype *st, int force, int quiet, int noexcl)
 		close(fd);
 		return 2;
 	}
-	rv = st->ss->load_super(st, fd, dev);
+	rv = st->sb ? 0 : st->ss->load_super(st, fd, dev);
 	if (force && rv >= 2)
 		rv = 0; /* ignore bad data in superblock */
 	if (rv== 0 || (force && rv >= 2)) {
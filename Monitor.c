@@ -29,22 +29,220 @@
 #include	<signal.h>
 #include	<limits.h>
 #include	<syslog.h>
+#include	<sys/epoll.h>
+#include	<sys/socket.h>
+#include	<sys/un.h>
 
-static void alert(char *event, char *dev, char *disc, char *mailaddr, char *mailfrom,
-		  char *cmd, int dosyslog);
-
-/* The largest number of disks current arrays can manage is 384
- * This really should be dynamically, but that will have to wait
- * At least it isn't MD_SB_DISKS.
+/* When we have to ask the array with GET_DISK_INFO, we ask about
+ * no more than this many disks.  sysfs tells us about all of them.
  */
 #define MaxDisks 384
+
+/* Arrays are found by devnum in a hash table with this many buckets */
+#define STATE_HASH 256
+
+/* While a resync or recovery is running, its progress is sampled
+ * every SYNC_INTERVAL seconds and the last SYNC_SAMPLES samples are
+ * kept.  If it makes no progress for SYNC_STALL seconds we say so.
+ */
+#define SYNC_SAMPLES 16
+#define SYNC_INTERVAL 10
+#define SYNC_STALL 60
+
+/* The I/O done by each member is compared with the others this often
+ * (seconds), or every --delay if that is shorter.
+ */
+#define PERF_INTERVAL 30
+
+/* Where the scrub scheduler keeps track of checks */
+#ifndef SCRUB_FILE
+#define SCRUB_FILE "/var/lib/mdadm/scrub"
+#endif
+/* How often the scheduler looks for something to start (seconds) */
+#define SCRUB_TICK 60
+/* Don't restart a check that someone else stopped for this long */
+#define SCRUB_RETRY (60*60)
+
+struct state {
+	char *devname;
+	int devnum;	/* to sync with mdstat info */
+	char *mdname;	/* devnum2devname(mdnum), see state_mdname() */
+	int mdnum;
+	long utime;
+	unsigned long state_sig; /* to notice when get_array_state changes */
+	int err;
+	char *spare_group;
+	int active, working, failed, spare, raid;
+	int expected_spares;
+	int *devstate;		/* indexed by slot, spares after raid */
+	unsigned *devid;
+	int devmax;		/* size of devstate and devid */
+	int percent;
+	unsigned long mdstat_sig; /* to notice when mdstat changes */
+	struct mdstat_ent *mse;	/* our entry in the current mdstat */
+	int fired;		/* a watched attribute changed */
+	int *watch_fd;		/* attributes being watched */
+	int watch_cnt;
+
+	/* recent resync/recovery progress, see track_sync() */
+	struct sync_sample {
+		time_t when;
+		unsigned long long done;	/* sectors */
+	} sync_hist[SYNC_SAMPLES];
+	int sync_next, sync_cnt;
+	unsigned long long sync_max;	/* sectors */
+	time_t sync_moved;	/* when progress was last seen */
+	int stalled;
+
+	/* I/O done by each working member, see check_perf() */
+	struct member_perf {
+		int major, minor;
+		char name[32];
+		struct disk_stat last;	/* counters when last looked */
+		int valid;		/* these are for the last interval: */
+		unsigned long iops, kbps, await_us;
+		int slow;
+	} *perf;
+	int nperf;
+	time_t perf_time;
+
+	/* for the scrub scheduler */
+	struct scrub_record *scrub_rec;
+	int scrub;		/* we started a check */
+	int scrub_due;
+	unsigned long long scrub_start, scrub_seen; /* sectors */
+	int scrub_speed;	/* what we set sync_speed_max to */
+	time_t scrub_retry;	/* don't start another before this */
+	dev_t *disks;		/* the disks under the array */
+	int ndisks;
+
+	/* for --metrics, filled in by update_model() */
+	int model;		/* the rest is valid */
+	int level, degraded, mismatch_cnt;
+	char array_state[20];
+	char sync_action[20];
+	unsigned long long sync_done, sync_total; /* sectors */
+	unsigned long sync_speed;	/* K/sec */
+	time_t sync_time;	/* when sync_* were read */
+	struct member_model {
+		char name[32];
+		int slot;
+		char state[64];
+		int errors;
+	} *members;
+	int nmembers;
+
+	struct state *next;
+	struct state *hnext;	/* next in the same hash bucket */
+};
+
+/* No more than this many alert programs or mailers run at once */
+#define ALERT_RUNNING 4
+/* Mail about events within this many seconds goes in one message */
+#define ALERT_WINDOW 5
+
+struct alert {
+	char *event, *dev, *disc;
+	time_t when;
+	struct alert *next;
+};
+
+struct alert_info {
+	char *mailaddr;
+	char *mailfrom;
+	char *alert_cmd;
+	int dosyslog;
+	struct alert *cmd_queue;	/* waiting for alert_cmd */
+	struct alert *mail_queue;	/* waiting to be mailed */
+	struct {
+		int pid;
+		char *dev;		/* NULL for mail */
+	} running[ALERT_RUNNING];
+	int nrunning;
+};
+
+struct disc_state {
+	int state, major, minor;
+};
+
+struct scrub_record {
+	char *dev;
+	time_t last;		/* last check finished */
+	unsigned long long pos;	/* where the current one got to */
+	struct scrub_record *next;
+};
+
+struct scrub {
+	struct scrubinfo *conf;
+	struct scrub_record *recs;
+	int dirty;		/* recs need saving */
+	time_t next;		/* when to look for arrays to check */
+};
+
+/* The metrics file is rewritten at least this often (seconds) */
+#define METRICS_INTERVAL 10
+
+struct metrics_conn {
+	int fd;
+	char *text;		/* a private copy, as mt->text may change */
+	size_t len, off;
+	int waiting;		/* for room to write more */
+	struct metrics_conn *next;
+};
+
+struct metrics {
+	char *file;
+	int sock_fd;
+	char *text;		/* last rendered */
+	size_t len;
+	time_t rendered, written;
+	int dirty;		/* something changed since rendered */
+	struct metrics_conn *conns;
+};
+
+static void alert(char *event, char *dev, char *disc, struct alert_info *info);
+static void queue_alert(struct alert **queue, char *event, char *dev,
+			char *disc);
+static void run_alerts(struct alert_info *info, int wait);
+static void wake_me(int sig);
+static int alert_timeout(struct alert_info *info);
+static void check_array(struct state *st, struct mdstat_ent *mse,
+			int test, struct alert_info *info,
+			int increments, int epfd);
+static int add_new_arrays(struct mdstat_ent *mdstat, struct state **statelist,
+			  struct state **hash, int test,
+			  struct alert_info *info);
+static void try_spare_migration(struct state *statelist,
+				struct alert_info *info);
+static unsigned long mdstat_sig(struct mdstat_ent *mse);
+static struct state *find_state(struct state **hash, int devnum);
+static void find_devnum(struct state *st, struct state **hash);
+static void hash_state(struct state *st, struct state **hash);
+static void track_sync(struct state *st, struct mdstat_ent *mse,
+		       struct alert_info *ainfo);
+static int sync_rate(struct state *st, unsigned long *speed, long *eta);
+static char *sync_msg(struct state *st, char *buf);
+static int sync_timeout(struct state *st);
+static void check_perf(struct state *st, struct alert_info *ainfo);
+static void scrub_load(struct scrub *sc);
+static void scrub_arrays(struct state *statelist, struct scrub *sc);
+static int scrub_timeout(struct scrub *sc);
+static int read_attr(struct state *st, char *dev, char *attr, char *buf);
+static void update_model(struct state *st);
+static void write_metrics(struct metrics *mt, struct state *statelist);
+static int metrics_socket(char *path);
+static int metrics_event(struct metrics *mt, void *cookie, int epfd,
+			 struct state *statelist);
+static int metrics_timeout(struct metrics *mt);
+
 int Monitor(mddev_dev_t devlist,
 	    char *mailaddr, char *alert_cmd,
 	    int period, int daemonise, int scan, int oneshot,
-	    int dosyslog, int test, char* pidfile, int increments)
+	    int dosyslog, int test, char* pidfile, int increments,
+	    char *metrics_file, char *metrics_sock)
 {
 	/*
-	 * Every few seconds, scan every md device looking for changes
+	 * Watch every md device looking for changes
 	 * When a change is found, log it, possibly run the alert command,
 	 * and possibly send Email
 	 *
@@ -60,6 +258,15 @@ int Monitor(mddev_dev_t devlist,
 	 * We also read /proc/mdstat to get rebuild percent,
 	 * and to get state on all active devices incase of kernel bug.
 	 *
+	 * Rather than looking at everything every few seconds, we keep
+	 * the array_state, degraded and sync_action attributes of each
+	 * array, and the state of each member, open and wait for md to
+	 * say that one has changed.  /proc/mdstat is watched too, so new
+	 * arrays and new members are noticed.  Then only the arrays
+	 * involved are looked at.  Everything is still looked at every
+	 * 'period' seconds to catch rebuild progress, and anything the
+	 * kernel doesn't tell us about.
+	 *
 	 * Events are:
 	 *    Fail
 	 *	An active device had Faulty set or Active/Sync removed
@@ -71,6 +278,11 @@ int Monitor(mddev_dev_t devlist,
 	 *      percent went from -1 to +ve
 	 *    RebuildNN
 	 *      percent went from below to not-below NN%
+	 *    RebuildStalled
+	 *      sync_completed hasn't moved for SYNC_STALL seconds
+	 *    SlowDevice
+	 *      A member is taking much longer over each request than
+	 *      the other members are
 	 *    DeviceDisappeared
 	 *      Couldn't access a device which was previously visible
 	 *
@@ -83,32 +295,44 @@ int Monitor(mddev_dev_t devlist,
 	 * If devlist is NULL, then we can monitor everything because --scan
 	 * was given.  We get an initial list from config file and add anything
 	 * that appears in /proc/mdstat
+	 *
+	 * With a SCRUB line in the config file, we also start a "check"
+	 * on each array from time to time, taking care not to check
+	 * arrays that share a disk at the same time.
+	 *
+	 * With metrics_file or metrics_sock we also keep a note of
+	 * everything a monitoring system would want about each array
+	 * and make it available in the Prometheus text format.
 	 */
 
-	struct state {
-		char *devname;
-		int devnum;	/* to sync with mdstat info */
-		long utime;
-		int err;
-		char *spare_group;
-		int active, working, failed, spare, raid;
-		int expected_spares;
-		int devstate[MaxDisks];
-		unsigned devid[MaxDisks];
-		int percent;
-		struct state *next;
-	} *statelist = NULL;
+	struct state *statelist = NULL;
+	struct state *hash[STATE_HASH];
 	int finished = 0;
 	struct mdstat_ent *mdstat = NULL;
-	char *mailfrom = NULL;
+	struct alert_info info;
+	struct metrics mt;
+	struct scrub sc;
+	int epfd = -1;
+	int mdstat_watched = 0;
+	int full = 1;
+	time_t last_full = 0;
+	time_t last_perf = 0;
+	int perf_interval = period < PERF_INTERVAL ? period : PERF_INTERVAL;
+	sigset_t set, waitmask;
 
+	memset(&info, 0, sizeof(info));
+	memset(&mt, 0, sizeof(mt));
+	memset(&sc, 0, sizeof(sc));
+	mt.file = metrics_file;
+	mt.sock_fd = -1;
 	if (!mailaddr) {
 		mailaddr = conf_get_mailaddr();
 		if (mailaddr && ! scan)
 			fprintf(stderr, Name ": Monitor using email address \"%s\" from config file\n",
 			       mailaddr);
 	}
-	mailfrom = conf_get_mailfrom();
+	info.mailaddr = mailaddr;
+	info.mailfrom = conf_get_mailfrom();
 
 	if (!alert_cmd) {
 		alert_cmd = conf_get_program();
@@ -116,10 +340,17 @@ int Monitor(mddev_dev_t devlist,
 			fprintf(stderr, Name ": Monitor using program \"%s\" from config file\n",
 			       alert_cmd);
 	}
-	if (scan && !mailaddr && !alert_cmd) {
-		fprintf(stderr, Name ": No mail address or alert command - not monitoring.\n");
+	if (!oneshot && conf_get_scrub()->enabled) {
+		sc.conf = conf_get_scrub();
+		scrub_load(&sc);
+	}
+	if (scan && !mailaddr && !alert_cmd && !metrics_file && !metrics_sock &&
+	    !sc.conf) {
+		fprintf(stderr, Name ": No mail address, alert command, metrics or scrub - not monitoring.\n");
 		return 1;
 	}
+	info.alert_cmd = alert_cmd;
+	info.dosyslog = dosyslog;
 
 	if (daemonise) {
 		int pid = fork();
@@ -157,7 +388,7 @@ int Monitor(mddev_dev_t devlist,
 				continue;
 			if (strcasecmp(mdlist->devname, "<ignore>") == 0)
 				continue;
-			st = malloc(sizeof *st);
+			st = calloc(1, sizeof *st);
 			if (st == NULL)
 				continue;
 			if (mdlist->devname[0] == '/')
@@ -167,33 +398,26 @@ int Monitor(mddev_dev_t devlist,
 				strcpy(strcpy(st->devname, "/dev/md/"),
 				       mdlist->devname);
 			}
-			st->utime = 0;
 			st->next = statelist;
-			st->err = 0;
 			st->devnum = INT_MAX;
 			st->percent = -2;
 			st->expected_spares = mdlist->spare_disks;
 			if (mdlist->spare_group)
 				st->spare_group = strdup(mdlist->spare_group);
-			else
-				st->spare_group = NULL;
 			statelist = st;
 		}
 	} else {
 		mddev_dev_t dv;
 		for (dv=devlist ; dv; dv=dv->next) {
 			mddev_ident_t mdlist = conf_get_ident(dv->devname);
-			struct state *st = malloc(sizeof *st);
+			struct state *st = calloc(1, sizeof *st);
 			if (st == NULL)
 				continue;
 			st->devname = strdup(dv->devname);
-			st->utime = 0;
 			st->next = statelist;
-			st->err = 0;
 			st->devnum = INT_MAX;
 			st->percent = -2;
 			st->expected_spares = -1;
-			st->spare_group = NULL;
 			if (mdlist) {
 				st->expected_spares = mdlist->spare_disks;
 				if (mdlist->spare_group)
@@ -203,392 +427,1684 @@ int Monitor(mddev_dev_t devlist,
 		}
 	}
 
+	memset(hash, 0, sizeof(hash));
+	if (!oneshot) {
+		epfd = epoll_create(64);
+		if (epfd >= 0)
+			fcntl(epfd, F_SETFD, FD_CLOEXEC);
+	}
+	if (metrics_sock && epfd < 0)
+		fprintf(stderr, Name ": --metrics-socket ignored with --oneshot\n");
+	else if (metrics_sock) {
+		mt.sock_fd = metrics_socket(metrics_sock);
+		if (mt.sock_fd < 0 ||
+		    sysfs_watch_io(epfd, mt.sock_fd, 0, &mt) != 0) {
+			if (mt.sock_fd >= 0)
+				close(mt.sock_fd);
+			mt.sock_fd = -1;
+			fprintf(stderr, Name ": cannot serve metrics on %s\n",
+				metrics_sock);
+		}
+	}
+	/* SIGCHLD, from alert children, is only let in while waiting */
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &set, &waitmask);
+	sigdelset(&waitmask, SIGCHLD);
+	signal(SIGCHLD, wake_me);
 
 	while (! finished) {
 		int new_found = 0;
+		int syncing;
 		struct state *st;
+		struct mdstat_ent *mse;
 
 		if (mdstat)
 			free_mdstat(mdstat);
 		mdstat = mdstat_read(oneshot?0:1, 0);
+		if (epfd >= 0 && !mdstat_watched)
+			/* a NULL cookie means mdstat */
+			mdstat_watched = mdstat_watch(epfd, NULL) == 0;
 
 		for (st=statelist; st; st=st->next) {
-			struct { int state, major, minor; } info[MaxDisks];
-			mdu_array_info_t array;
-			struct mdstat_ent *mse = NULL, *mse2;
-			char *dev = st->devname;
-			int fd;
-			int i;
-
-			if (test)
-				alert("TestMessage", dev, NULL, mailaddr, mailfrom, alert_cmd, dosyslog);
-			fd = open(dev, O_RDONLY);
-			if (fd < 0) {
-				if (!st->err)
-					alert("DeviceDisappeared", dev, NULL,
-					      mailaddr, mailfrom, alert_cmd, dosyslog);
-/*					fprintf(stderr, Name ": cannot open %s: %s\n",
-						dev, strerror(errno));
-*/				st->err=1;
-				continue;
-			}
-			fcntl(fd, F_SETFD, FD_CLOEXEC);
-			if (ioctl(fd, GET_ARRAY_INFO, &array)<0) {
-				if (!st->err)
-					alert("DeviceDisappeared", dev, NULL,
-					      mailaddr, mailfrom, alert_cmd, dosyslog);
-/*					fprintf(stderr, Name ": cannot get array info for %s: %s\n",
-						dev, strerror(errno));
-*/				st->err=1;
-				close(fd);
-				continue;
+			st->mse = NULL;
+			if (st->devnum == INT_MAX)
+				find_devnum(st, hash);
+		}
+		for (mse = mdstat; mse; mse = mse->next) {
+			st = find_state(hash, mse->devnum);
+			if (st && !st->mse) {
+				mse->devnum = INT_MAX; /* flag it as "used" */
+				st->mse = mse;
 			}
-			/* It's much easier to list what array levels can't
-			 * have a device disappear than all of them that can
-			 */
-			if (array.level == 0 || array.level == -1) {
-				if (!st->err)
-					alert("DeviceDisappeared", dev, "Wrong-Level",
-					      mailaddr, mailfrom, alert_cmd, dosyslog);
-				st->err = 1;
-				close(fd);
+		}
+
+		for (st=statelist; st; st=st->next) {
+			unsigned long sig = mdstat_sig(st->mse);
+
+			if (!full && !test && !st->fired &&
+			    sig == st->mdstat_sig && sync_timeout(st) != 0)
+				/* nothing to see here */
 				continue;
+			st->mdstat_sig = sig;
+			st->fired = 0;
+			syncing = st->percent >= 0;
+			check_array(st, st->mse, test, &info, increments, epfd);
+			if (syncing && st->percent < 0)
+				/* disks may be free for a scrub now */
+				sc.next = 0;
+			if (metrics_file || mt.sock_fd >= 0) {
+				update_model(st);
+				mt.dirty = 1;
 			}
-			if (st->devnum == INT_MAX) {
-				struct stat stb;
-				if (fstat(fd, &stb) == 0 &&
-				    (S_IFMT&stb.st_mode)==S_IFBLK) {
-					if (major(stb.st_rdev) == MD_MAJOR)
-						st->devnum = minor(stb.st_rdev);
-					else
-						st->devnum = -1- (minor(stb.st_rdev)>>6);
+		}
+		/* now check if there are any new devices found in mdstat */
+		if (scan)
+			new_found = add_new_arrays(mdstat, &statelist, hash,
+						   test, &info);
+
+		/* If an array has active < raid && spare == 0 && spare_group != NULL
+		 * Look for another array with spare > 0 and active == raid and same spare_group
+		 *  if found, choose a device and hotremove/hotadd
+		 */
+		try_spare_migration(statelist, &info);
+
+		if (sc.conf && !new_found)
+			scrub_arrays(statelist, &sc);
+
+		if (!oneshot && time(0) >= last_perf + perf_interval) {
+			for (st = statelist; st; st = st->next)
+				if (!st->err && st->utime)
+					check_perf(st, &info);
+			last_perf = time(0);
+			mt.dirty = 1;
+		}
+
+		run_alerts(&info, 0);
+
+		if (metrics_file && !oneshot && !new_found &&
+		    metrics_timeout(&mt) == 0)
+			write_metrics(&mt, statelist);
+
+		if (full)
+			last_full = time(0);
+		full = 0;
+		if (!new_found) {
+			if (oneshot)
+				break;
+			else if (epfd < 0 || !mdstat_watched) {
+				mdstat_wait(period);
+				full = 1;
+			} else {
+				void *fired[64];
+				int n, i;
+				int timeout = period * 1000;
+				int t = alert_timeout(&info);
+
+				if (t >= 0 && t < timeout)
+					timeout = t;
+				t = metrics_timeout(&mt);
+				if (t >= 0 && t < timeout)
+					timeout = t;
+				t = scrub_timeout(&sc);
+				if (t >= 0 && t < timeout)
+					timeout = t;
+				t = (last_perf + perf_interval - time(0)) * 1000;
+				if (t < 0)
+					t = 0;
+				if (t < timeout)
+					timeout = t;
+				for (st = statelist; st; st = st->next) {
+					t = sync_timeout(st);
+					if (t >= 0 && t < timeout)
+						timeout = t;
 				}
+				n = sysfs_watch_wait(epfd, fired, 64,
+						     timeout, &waitmask);
+				if (n < 0 && errno != EINTR)
+					/* too much happened */
+					full = 1;
+				if (time(0) >= last_full + period)
+					full = 1;
+				if (n < 0 && errno != EINTR &&
+				    errno != EOVERFLOW)
+					mdstat_wait(period);
+				for (i = 0; i < n; i++)
+					if (fired[i] &&
+					    !metrics_event(&mt, fired[i], epfd,
+							   statelist))
+						((struct state *)fired[i])
+							->fired = 1;
 			}
+		}
+		test = 0;
+	}
+	run_alerts(&info, 1);
+	if (metrics_file)
+		write_metrics(&mt, statelist);
+	if (mt.sock_fd >= 0) {
+		close(mt.sock_fd);
+		unlink(metrics_sock);
+	}
+	if (pidfile)
+		unlink(pidfile);
+	if (epfd >= 0)
+		close(epfd);
+	return 0;
+}
 
-			for (mse2 = mdstat ; mse2 ; mse2=mse2->next)
-				if (mse2->devnum == st->devnum) {
-					mse2->devnum = INT_MAX; /* flag it as "used" */
-					mse = mse2;
-				}
+static struct state *find_state(struct state **hash, int devnum)
+{
+	struct state *st;
 
-			if (array.utime == 0)
-				/* external arrays don't update utime */
-				array.utime = time(0);
-
-			if (st->utime == array.utime &&
-			    st->failed == array.failed_disks &&
-			    st->working == array.working_disks &&
-			    st->spare == array.spare_disks &&
-			    (mse == NULL  || (
-				    mse->percent == st->percent
-				    ))) {
-				close(fd);
-				st->err = 0;
-				continue;
-			}
-			if (st->utime == 0 && /* new array */
-			    mse &&	/* is in /proc/mdstat */
-			    mse->pattern && strchr(mse->pattern, '_') /* degraded */
-				)
-				alert("DegradedArray", dev, NULL, mailaddr, mailfrom, alert_cmd, dosyslog);
-
-			if (st->utime == 0 && /* new array */
-			    st->expected_spares > 0 &&
-			    array.spare_disks < st->expected_spares)
-				alert("SparesMissing", dev, NULL, mailaddr, mailfrom, alert_cmd, dosyslog);
-			if (mse &&
-			    st->percent == -1 &&
-			    mse->percent >= 0)
-				alert("RebuildStarted", dev, NULL, mailaddr, mailfrom, alert_cmd, dosyslog);
-			if (mse &&
-			    st->percent >= 0 &&
-			    mse->percent >= 0 &&
-			    (mse->percent / increments) > (st->percent / increments)) {
-				char percentalert[15]; // "RebuildNN" (10 chars) or "RebuildStarted" (15 chars)
-
-				if((mse->percent / increments) == 0)
-					snprintf(percentalert, sizeof(percentalert), "RebuildStarted");
-				else
-					snprintf(percentalert, sizeof(percentalert), "Rebuild%02d", mse->percent);
+	for (st = hash[(unsigned)devnum % STATE_HASH]; st; st = st->hnext)
+		if (st->devnum == devnum)
+			return st;
+	return NULL;
+}
 
-				alert(percentalert,
-				      dev, NULL, mailaddr, mailfrom, alert_cmd, dosyslog);
-			}
+static void hash_state(struct state *st, struct state **hash)
+{
+	struct state **hp = &hash[(unsigned)st->devnum % STATE_HASH];
+
+	st->hnext = *hp;
+	*hp = st;
+}
+
+static void find_devnum(struct state *st, struct state **hash)
+{
+	/* Arrays named in the config file or on the command line
+	 * are only known by name until the device exists.
+	 */
+	struct stat stb;
+	int devnum;
+
+	if (stat(st->devname, &stb) != 0 ||
+	    (S_IFMT&stb.st_mode) != S_IFBLK)
+		return;
+	devnum = stat2devnum(&stb);
+	if (devnum == NoMdDev)
+		return;
+	st->devnum = devnum;
+	hash_state(st, hash);
+}
+
+static unsigned long mdstat_sig(struct mdstat_ent *mse)
+{
+	/* A summary of everything /proc/mdstat says about an array
+	 * so we can tell which arrays changed when it fires.
+	 */
+	unsigned long sig = 5381;
+	struct dev_member *m;
+	char *c;
+
+	if (!mse)
+		return 0;
+	sig = sig * 33 + mse->active;
+	sig = sig * 33 + mse->percent;
+	sig = sig * 33 + mse->resync;
+	sig = sig * 33 + mse->devcnt;
+	sig = sig * 33 + mse->raid_disks;
+	for (c = mse->level; c && *c; c++)
+		sig = sig * 33 + *c;
+	for (c = mse->pattern; c && *c; c++)
+		sig = sig * 33 + *c;
+	for (m = mse->members; m; m = m->next)
+		for (c = m->name; *c; c++)
+			sig = sig * 33 + *c;
+	return sig ? sig : 1;
+}
+
+static void unwatch_array(struct state *st, int epfd)
+{
+	int i;
+
+	for (i = 0; i < st->watch_cnt; i++) {
+		sysfs_unwatch_fd(epfd, st->watch_fd[i]);
+		close(st->watch_fd[i]);
+	}
+	free(st->watch_fd);
+	st->watch_fd = NULL;
+	st->watch_cnt = 0;
+}
 
-			if (mse &&
-			    mse->percent == -1 &&
-			    st->percent >= 0) {
-				/* Rebuild/sync/whatever just finished.
-				 * If there is a number in /mismatch_cnt,
-				 * we should report that.
-				 */
-				struct mdinfo *sra =
-				       sysfs_read(-1, st->devnum, GET_MISMATCH);
-				if (sra && sra->mismatch_cnt > 0) {
-					char cnt[40];
-					sprintf(cnt, " mismatches found: %d", sra->mismatch_cnt);
-					alert("RebuildFinished", dev, cnt, mailaddr, mailfrom, alert_cmd, dosyslog);
-				} else
-					alert("RebuildFinished", dev, NULL, mailaddr, mailfrom, alert_cmd, dosyslog);
-				if (sra)
-					free(sra);
+static void watch_array(struct state *st, int epfd)
+{
+	/* Watch the attributes that md changes when something we
+	 * want to know about happens: the state, degradation and
+	 * sync action of the array, and the state of each member.
+	 */
+	static char *attrs[] = { "array_state", "degraded", "sync_action",
+				 NULL };
+	struct mdinfo *sra, *d;
+	int n = 3;
+	int fd, i;
+
+	sra = sysfs_read(-1, st->devnum, GET_DEVS);
+	for (d = sra ? sra->devs : NULL; d; d = d->next)
+		n++;
+	st->watch_fd = malloc(n * sizeof(st->watch_fd[0]));
+	if (!st->watch_fd)
+		goto out;
+	for (i = 0; attrs[i]; i++) {
+		fd = sysfs_watch_attr(epfd, st->devnum, NULL, attrs[i], st);
+		if (fd >= 0)
+			st->watch_fd[st->watch_cnt++] = fd;
+	}
+	for (d = sra ? sra->devs : NULL; d; d = d->next) {
+		fd = sysfs_watch_attr(epfd, st->devnum, d->sys_name, "state",
+				      st);
+		if (fd >= 0)
+			st->watch_fd[st->watch_cnt++] = fd;
+	}
+ out:
+	if (sra)
+		sysfs_free(sra);
+}
+
+static struct disc_state *get_array_state(struct state *st,
+					  mdu_array_info_t *array, int *ndisks,
+					  unsigned long *sig)
+{
+	/* Find the state of the array and its devices.
+	 * sysfs has everything we need without opening the array,
+	 * so use that if we can.  Otherwise ask the array itself.
+	 * Devices that are in a slot are reported at that index,
+	 * others after raid_disks.
+	 * *sig changes whenever any of that does, for when there
+	 * is no utime to tell.
+	 * Returns a malloced array of *ndisks entries, or NULL if
+	 * the array doesn't seem to exist.
+	 */
+	struct disc_state *info;
+	struct mdinfo *sra, *d;
+	char path[PATH_MAX];
+	char buf[1024];
+	char *c;
+	int fd;
+	int i, n;
+
+	memset(array, 0, sizeof(*array));
+	if (st->devnum == INT_MAX)
+		return NULL;
+
+	sra = sysfs_read(-1, st->devnum,
+			 GET_LEVEL|GET_DISKS|GET_DEVS|GET_STATE);
+	if (sra) {
+		int next;
+		sprintf(path, "%s/sys/block/%s/md/array_state",
+			mdadm_root(), sra->sys_name);
+		if (load_sys(path, buf) != 0 ||
+		    strncmp(buf, "clear", 5) == 0 ||
+		    strncmp(buf, "inactive", 8) == 0 ||
+		    sra->array.level == UnSet) {
+			sysfs_free(sra);
+			return NULL;
+		}
+		*sig = 5381;
+		for (c = buf; *c; c++)
+			*sig = *sig * 33 + *c;
+		sprintf(path, "%s/sys/block/%s/md/degraded",
+			mdadm_root(), sra->sys_name);
+		if (load_sys(path, buf) == 0)
+			for (c = buf; *c; c++)
+				*sig = *sig * 33 + *c;
+		array->level = sra->array.level;
+		array->raid_disks = sra->array.raid_disks;
+		for (d = sra->devs; d; d = d->next)
+			array->nr_disks++;
+		n = array->raid_disks + array->nr_disks + 1;
+		info = calloc(n, sizeof(*info));
+		if (!info) {
+			sysfs_free(sra);
+			return NULL;
+		}
+		next = array->raid_disks;
+		for (d = sra->devs; d; d = d->next) {
+			int state = 0;
+
+			if (d->disk.state & (1<<MD_DISK_FAULTY)) {
+				state |= (1<<MD_DISK_FAULTY);
+				array->failed_disks++;
+			} else {
+				array->working_disks++;
+				if (d->disk.state & (1<<MD_DISK_SYNC))
+					array->active_disks++;
+				else
+					array->spare_disks++;
 			}
+			if (d->disk.state & (1<<MD_DISK_SYNC))
+				state |= (1<<MD_DISK_ACTIVE)|(1<<MD_DISK_SYNC);
+
+			i = d->disk.raid_disk;
+			if (i < 0 || i >= array->raid_disks ||
+			    info[i].major || info[i].minor)
+				i = next++;
+			info[i].state = state;
+			info[i].major = d->disk.major;
+			info[i].minor = d->disk.minor;
+		}
+		sysfs_free(sra);
+		for (i = 0; i < n; i++)
+			*sig = (*sig * 33 + info[i].state) * 33 +
+				makedev(info[i].major, info[i].minor);
+		*ndisks = n;
+		return info;
+	}
+
+	fd = open(st->devname, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if (ioctl(fd, GET_ARRAY_INFO, array) < 0) {
+		close(fd);
+		return NULL;
+	}
+	n = array->raid_disks + array->nr_disks + 1;
+	if (n > MaxDisks)
+		n = MaxDisks;
+	info = calloc(n, sizeof(*info));
+	if (!info) {
+		close(fd);
+		return NULL;
+	}
+	for (i=0; i < n; i++) {
+		mdu_disk_info_t disc;
+		disc.number = i;
+		if (ioctl(fd, GET_DISK_INFO, &disc) >= 0) {
+			info[i].state = disc.state;
+			info[i].major = disc.major;
+			info[i].minor = disc.minor;
+		}
+	}
+	close(fd);
+	*sig = 5381 * 33 + array->state;
+	for (i = 0; i < n; i++)
+		*sig = (*sig * 33 + info[i].state) * 33 +
+			makedev(info[i].major, info[i].minor);
+	*ndisks = n;
+	return info;
+}
+
+static int grow_devstate(struct state *st, int n)
+{
+	/* Make sure devstate and devid have room for n devices.
+	 * They are never shrunk, so an array that is stopped and
+	 * restarted gets its old ones back.
+	 */
+	int *ds;
+	unsigned *di;
+
+	if (n <= st->devmax)
+		return 0;
+	ds = realloc(st->devstate, n * sizeof(*ds));
+	if (!ds)
+		return -1;
+	st->devstate = ds;
+	di = realloc(st->devid, n * sizeof(*di));
+	if (!di)
+		return -1;
+	st->devid = di;
+	memset(ds + st->devmax, 0, (n - st->devmax) * sizeof(*ds));
+	memset(di + st->devmax, 0, (n - st->devmax) * sizeof(*di));
+	st->devmax = n;
+	return 0;
+}
+
+static void check_array(struct state *st, struct mdstat_ent *mse,
+			int test, struct alert_info *ainfo,
+			int increments, int epfd)
+{
+	struct disc_state *info;
+	mdu_array_info_t array;
+	char *dev = st->devname;
+	char rate[80];
+	int rewatch = 0;
+	int ndisks = 0;
+	unsigned long sig = 0;
+	int i;
+
+	if (test)
+		alert("TestMessage", dev, NULL, ainfo);
+	info = get_array_state(st, &array, &ndisks, &sig);
+	if (!info || grow_devstate(st, ndisks) != 0) {
+		free(info);
+		if (!st->err)
+			alert("DeviceDisappeared", dev, NULL, ainfo);
+		st->err=1;
+		unwatch_array(st, epfd);
+		return;
+	}
+	/* It's much easier to list what array levels can't
+	 * have a device disappear than all of them that can
+	 */
+	if (array.level == 0 || array.level == -1) {
+		if (!st->err)
+			alert("DeviceDisappeared", dev, "Wrong-Level", ainfo);
+		st->err = 1;
+		unwatch_array(st, epfd);
+		free(info);
+		return;
+	}
 
-			if (mse)
-				st->percent = mse->percent;
+	track_sync(st, mse, ainfo);
 
+	if (array.utime == 0) {
+		/* external arrays don't update utime, and sysfs
+		 * doesn't report it, so go by whether anything
+		 * that sysfs does report has changed.
+		 */
+		if (st->utime && sig == st->state_sig)
+			array.utime = st->utime;
+		else
+			array.utime = time(0);
+	}
 
-			for (i=0; i<MaxDisks && i <= array.raid_disks + array.nr_disks;
-			     i++) {
-				mdu_disk_info_t disc;
-				disc.number = i;
-				if (ioctl(fd, GET_DISK_INFO, &disc) >= 0) {
-					info[i].state = disc.state;
-					info[i].major = disc.major;
-					info[i].minor = disc.minor;
-				} else
-					info[i].major = info[i].minor = 0;
+	if (st->utime == array.utime &&
+	    st->failed == array.failed_disks &&
+	    st->working == array.working_disks &&
+	    st->spare == array.spare_disks &&
+	    (mse == NULL  || (
+		    mse->percent == st->percent
+		    ))) {
+		st->err = 0;
+		free(info);
+		return;
+	}
+	if (st->utime == 0 && /* new array */
+	    mse &&	/* is in /proc/mdstat */
+	    mse->pattern && strchr(mse->pattern, '_') /* degraded */
+		)
+		alert("DegradedArray", dev, NULL, ainfo);
+
+	if (st->utime == 0 && /* new array */
+	    st->expected_spares > 0 &&
+	    array.spare_disks < st->expected_spares)
+		alert("SparesMissing", dev, NULL, ainfo);
+	if (mse &&
+	    st->percent == -1 &&
+	    mse->percent >= 0)
+		alert("RebuildStarted", dev, sync_msg(st, rate), ainfo);
+	if (mse &&
+	    st->percent >= 0 &&
+	    mse->percent >= 0 &&
+	    (mse->percent / increments) > (st->percent / increments)) {
+		char percentalert[15]; // "RebuildNN" (10 chars) or "RebuildStarted" (15 chars)
+
+		if((mse->percent / increments) == 0)
+			snprintf(percentalert, sizeof(percentalert), "RebuildStarted");
+		else
+			snprintf(percentalert, sizeof(percentalert), "Rebuild%02d", mse->percent);
+
+		alert(percentalert, dev, sync_msg(st, rate), ainfo);
+	}
+
+	if (mse &&
+	    mse->percent == -1 &&
+	    st->percent >= 0) {
+		/* Rebuild/sync/whatever just finished.
+		 * If there is a number in /mismatch_cnt,
+		 * we should report that.
+		 */
+		struct mdinfo *sra =
+		       sysfs_read(-1, st->devnum, GET_MISMATCH);
+		if (sra && sra->mismatch_cnt > 0) {
+			char cnt[40];
+			sprintf(cnt, " mismatches found: %d", sra->mismatch_cnt);
+			alert("RebuildFinished", dev, cnt, ainfo);
+		} else
+			alert("RebuildFinished", dev, NULL, ainfo);
+		if (sra)
+			free(sra);
+	}
+
+	if (mse)
+		st->percent = mse->percent;
+
+	for (i=0; i < st->devmax; i++) {
+		mdu_disk_info_t disc = {0,0,0,0,0};
+		int newstate=0;
+		int change;
+		char *dv = NULL;
+		disc.number = i;
+		if (i >= ndisks) {
+			newstate = 0;
+			disc.major = disc.minor = 0;
+		} else if (info[i].major || info[i].minor) {
+			newstate = info[i].state;
+			dv = map_dev(info[i].major, info[i].minor, 1);
+			disc.state = newstate;
+			disc.major = info[i].major;
+			disc.minor = info[i].minor;
+		} else if (mse &&  mse->pattern && i < (int)strlen(mse->pattern)) {
+			switch(mse->pattern[i]) {
+			case 'U': newstate = 6 /* ACTIVE/SYNC */; break;
+			case '_': newstate = 0; break;
 			}
-			close(fd);
-
-			for (i=0; i<MaxDisks; i++) {
-				mdu_disk_info_t disc = {0,0,0,0,0};
-				int newstate=0;
-				int change;
-				char *dv = NULL;
-				disc.number = i;
-				if (i > array.raid_disks + array.nr_disks) {
-					newstate = 0;
-					disc.major = disc.minor = 0;
-				} else if (info[i].major || info[i].minor) {
-					newstate = info[i].state;
-					dv = map_dev(info[i].major, info[i].minor, 1);
-					disc.state = newstate;
-					disc.major = info[i].major;
-					disc.minor = info[i].minor;
-				} else if (mse &&  mse->pattern && i < (int)strlen(mse->pattern)) {
-					switch(mse->pattern[i]) {
-					case 'U': newstate = 6 /* ACTIVE/SYNC */; break;
-					case '_': newstate = 0; break;
-					}
-					disc.major = disc.minor = 0;
-				}
-				if (dv == NULL && st->devid[i])
-					dv = map_dev(major(st->devid[i]),
-						     minor(st->devid[i]), 1);
-				change = newstate ^ st->devstate[i];
-				if (st->utime && change && !st->err) {
-					if (i < array.raid_disks &&
-					    (((newstate&change)&(1<<MD_DISK_FAULTY)) ||
-					     ((st->devstate[i]&change)&(1<<MD_DISK_ACTIVE)) ||
-					     ((st->devstate[i]&change)&(1<<MD_DISK_SYNC)))
-						)
-						alert("Fail", dev, dv, mailaddr, mailfrom, alert_cmd, dosyslog);
-					else if (i >= array.raid_disks &&
-						 (disc.major || disc.minor) &&
-						 st->devid[i] == makedev(disc.major, disc.minor) &&
-						 ((newstate&change)&(1<<MD_DISK_FAULTY))
-						)
-						alert("FailSpare", dev, dv, mailaddr, mailfrom, alert_cmd, dosyslog);
-					else if (i < array.raid_disks &&
-						 ! (newstate & (1<<MD_DISK_REMOVED)) &&
-						 (((st->devstate[i]&change)&(1<<MD_DISK_FAULTY)) ||
-						  ((newstate&change)&(1<<MD_DISK_ACTIVE)) ||
-						  ((newstate&change)&(1<<MD_DISK_SYNC)))
-						)
-						alert("SpareActive", dev, dv, mailaddr, mailfrom, alert_cmd, dosyslog);
-				}
-				st->devstate[i] = newstate;
-				st->devid[i] = makedev(disc.major, disc.minor);
+			disc.major = disc.minor = 0;
+		}
+		if (dv == NULL && st->devid[i])
+			dv = map_dev(major(st->devid[i]),
+				     minor(st->devid[i]), 1);
+		change = newstate ^ st->devstate[i];
+		if (st->utime && change && !st->err) {
+			if (i < array.raid_disks &&
+			    (((newstate&change)&(1<<MD_DISK_FAULTY)) ||
+			     ((st->devstate[i]&change)&(1<<MD_DISK_ACTIVE)) ||
+			     ((st->devstate[i]&change)&(1<<MD_DISK_SYNC)))
+				)
+				alert("Fail", dev, dv, ainfo);
+			else if (i >= array.raid_disks &&
+				 (disc.major || disc.minor) &&
+				 st->devid[i] == makedev(disc.major, disc.minor) &&
+				 ((newstate&change)&(1<<MD_DISK_FAULTY))
+				)
+				alert("FailSpare", dev, dv, ainfo);
+			else if (i < array.raid_disks &&
+				 ! (newstate & (1<<MD_DISK_REMOVED)) &&
+				 (((st->devstate[i]&change)&(1<<MD_DISK_FAULTY)) ||
+				  ((newstate&change)&(1<<MD_DISK_ACTIVE)) ||
+				  ((newstate&change)&(1<<MD_DISK_SYNC)))
+				)
+				alert("SpareActive", dev, dv, ainfo);
+		}
+		if (st->devid[i] != makedev(disc.major, disc.minor))
+			rewatch = 1;
+		st->devstate[i] = newstate;
+		st->devid[i] = makedev(disc.major, disc.minor);
+	}
+	st->active = array.active_disks;
+	st->working = array.working_disks;
+	st->spare = array.spare_disks;
+	st->failed = array.failed_disks;
+	st->utime = array.utime;
+	st->state_sig = sig;
+	st->raid = array.raid_disks;
+	st->err = 0;
+	free(info);
+
+	if (rewatch) {
+		/* the scrub scheduler must look at the disks again */
+		free(st->disks);
+		st->disks = NULL;
+	}
+	if (epfd >= 0 && (rewatch || st->watch_cnt == 0)) {
+		unwatch_array(st, epfd);
+		watch_array(st, epfd);
+	}
+}
+
+static void track_sync(struct state *st, struct mdstat_ent *mse,
+		       struct alert_info *ainfo)
+{
+	/* Keep a short history of resync/recovery progress from
+	 * sync_completed, which is much finer than the percent in
+	 * /proc/mdstat, so that we can tell how fast it is going
+	 * and notice if it stops.
+	 * The newest sample is always replaced with the latest
+	 * reading, the others are at least SYNC_INTERVAL apart.
+	 */
+	struct sync_sample *last, *prev;
+	unsigned long long done, max;
+	char buf[1024];
+	time_t now = time(0);
+
+	if (!mse ||
+	    read_attr(st, NULL, "sync_action", buf) != 0 ||
+	    strncmp(buf, "idle", 4) == 0 ||
+	    strncmp(buf, "frozen", 6) == 0) {
+		/* nothing happening */
+		st->sync_cnt = st->sync_next = 0;
+		st->stalled = 0;
+		return;
+	}
+	if (mse->percent < 0 ||
+	    read_attr(st, NULL, "sync_completed", buf) != 0 ||
+	    sscanf(buf, "%llu / %llu", &done, &max) != 2) {
+		/* DELAYED or PENDING, which isn't stalling */
+		st->sync_moved = now;
+		return;
+	}
+	last = &st->sync_hist[(st->sync_next + SYNC_SAMPLES - 1) % SYNC_SAMPLES];
+	prev = &st->sync_hist[(st->sync_next + SYNC_SAMPLES - 2) % SYNC_SAMPLES];
+	if (st->sync_cnt && (done < last->done || max != st->sync_max)) {
+		/* a new one has started */
+		st->sync_cnt = st->sync_next = 0;
+		st->stalled = 0;
+	}
+	if (st->sync_cnt == 0 || done > last->done) {
+		st->sync_moved = now;
+		st->stalled = 0;
+	}
+	st->sync_max = max;
+
+	if (st->sync_cnt >= 2 && now < prev->when + SYNC_INTERVAL)
+		last->when = now;
+	else {
+		last = &st->sync_hist[st->sync_next];
+		last->when = now;
+		st->sync_next = (st->sync_next + 1) % SYNC_SAMPLES;
+		if (st->sync_cnt < SYNC_SAMPLES)
+			st->sync_cnt++;
+	}
+	last->done = done;
+
+	if (!st->stalled && now >= st->sync_moved + SYNC_STALL) {
+		snprintf(buf, 100, " no progress for %ld seconds at %llu of %llu sectors",
+			 (long)(now - st->sync_moved), done, max);
+		alert("RebuildStalled", st->devname, buf, ainfo);
+		st->stalled = 1;
+	}
+}
+
+static int sync_rate(struct state *st, unsigned long *speed, long *eta)
+{
+	/* Average speed (K/sec) over the samples we have, and
+	 * seconds until it should finish.
+	 * Returns -1 if we cannot tell yet.
+	 */
+	struct sync_sample *first, *last;
+
+	if (st->sync_cnt < 2)
+		return -1;
+	first = &st->sync_hist[st->sync_cnt < SYNC_SAMPLES ? 0 : st->sync_next];
+	last = &st->sync_hist[(st->sync_next + SYNC_SAMPLES - 1) % SYNC_SAMPLES];
+	if (last->when <= first->when)
+		return -1;
+	*speed = (last->done - first->done) / 2 / (last->when - first->when);
+	if (*speed == 0 || st->sync_max < last->done)
+		*eta = -1;
+	else
+		*eta = (st->sync_max - last->done) / 2 / *speed;
+	return 0;
+}
+
+static char *sync_msg(struct state *st, char *buf)
+{
+	/* Extra information for a Rebuild event */
+	unsigned long speed;
+	long eta;
+
+	if (sync_rate(st, &speed, &eta) != 0)
+		return NULL;
+	if (eta < 0)
+		sprintf(buf, " speed %luK/sec", speed);
+	else
+		sprintf(buf, " speed %luK/sec, finish in %ld.%ldmin",
+			speed, eta / 60, (eta % 60) / 6);
+	return buf;
+}
+
+static int sync_timeout(struct state *st)
+{
+	/* msecs until progress of a running sync should be sampled */
+	struct sync_sample *last;
+	time_t due;
+
+	if (!st->sync_cnt)
+		return -1;
+	last = &st->sync_hist[(st->sync_next + SYNC_SAMPLES - 1) % SYNC_SAMPLES];
+	due = last->when + SYNC_INTERVAL;
+	if (due <= time(0))
+		return 0;
+	return (due - time(0)) * 1000;
+}
+
+static void check_perf(struct state *st, struct alert_info *ainfo)
+{
+	/* See how much I/O each working member has done since last
+	 * time and how long it took, and report any member that has
+	 * become much slower than its peers.  A member stays slow until
+	 * it does enough I/O to be judged again.
+	 */
+	struct mdinfo *sra, *d;
+	struct member_perf *perf = NULL;
+	struct disk_stat *delta = NULL;
+	int *slow = NULL;
+	time_t now = time(0);
+	long dt = now - st->perf_time;
+	int n = 0, i, j;
+
+	sra = sysfs_read(-1, st->devnum, GET_DEVS|GET_STATE);
+	if (!sra)
+		return;
+	for (d = sra->devs; d; d = d->next)
+		n++;
+	perf = calloc(n+1, sizeof(*perf));
+	delta = calloc(n+1, sizeof(*delta));
+	slow = calloc(n+1, sizeof(*slow));
+	if (!perf || !delta || !slow)
+		goto out;
+
+	i = 0;
+	for (d = sra->devs; d; d = d->next) {
+		struct member_perf *p = &perf[i];
+		struct member_perf *old;
+
+		if (d->disk.state & (1<<MD_DISK_FAULTY))
+			continue;
+		p->major = d->disk.major;
+		p->minor = d->disk.minor;
+		if (sysfs_disk_stat(p->major, p->minor, &p->last) != 0)
+			continue;
+		strncpy(p->name, d->sys_name + 4, sizeof(p->name)-1);
+		i++;
+		for (j = 0; j < st->nperf; j++)
+			if (st->perf[j].major == p->major &&
+			    st->perf[j].minor == p->minor)
+				break;
+		if (j == st->nperf || dt <= 0)
+			continue;
+		old = &st->perf[j];
+		if (p->last.ios < old->last.ios ||
+		    p->last.sectors < old->last.sectors ||
+		    p->last.ticks < old->last.ticks)
+			/* counters were reset */
+			continue;
+		delta[i-1].ios = p->last.ios - old->last.ios;
+		delta[i-1].sectors = p->last.sectors - old->last.sectors;
+		delta[i-1].ticks = p->last.ticks - old->last.ticks;
+		p->valid = 1;
+		p->iops = delta[i-1].ios / dt;
+		p->kbps = delta[i-1].sectors / 2 / dt;
+		if (delta[i-1].ios)
+			p->await_us = delta[i-1].ticks * 1000 / delta[i-1].ios;
+		p->slow = old->slow;
+	}
+	n = i;
+
+	disk_stat_slow(delta, n, slow);
+	for (i = 0; i < n; i++) {
+		if (slow[i] && !perf[i].slow) {
+			char *dv = map_dev(perf[i].major, perf[i].minor, 1);
+			alert("SlowDevice", st->devname,
+			      dv ? dv : perf[i].name, ainfo);
+		}
+		if (slow[i])
+			perf[i].slow = 1;
+		else if (delta[i].ios >= SLOW_MIN_IOS)
+			perf[i].slow = 0;
+	}
+	free(st->perf);
+	st->perf = perf;
+	st->nperf = n;
+	st->perf_time = now;
+	perf = NULL;
+out:
+	free(perf);
+	free(delta);
+	free(slow);
+	sysfs_free(sra);
+}
+
+static int add_new_arrays(struct mdstat_ent *mdstat, struct state **statelist,
+			  struct state **hash, int test,
+			  struct alert_info *info)
+{
+	struct mdstat_ent *mse;
+	int new_found = 0;
+
+	for (mse=mdstat; mse; mse=mse->next)
+		if (mse->devnum != INT_MAX &&
+		    mse->level &&
+		    (strcmp(mse->level, "raid0")!=0 &&
+		     strcmp(mse->level, "linear")!=0)
+			) {
+			struct state *st = calloc(1, sizeof *st);
+			struct disc_state *dinfo;
+			mdu_array_info_t array;
+			int ndisks;
+			unsigned long sig;
+			if (st == NULL)
+				continue;
+			st->devname = strdup(get_md_name(mse->devnum));
+			st->devnum = mse->devnum;
+			dinfo = get_array_state(st, &array, &ndisks, &sig);
+			if (!dinfo) {
+				/* no such array */
+				put_md_name(st->devname);
+				free(st->devname);
+				free(st->mdname);
+				free(st);
+				continue;
 			}
-			st->active = array.active_disks;
-			st->working = array.working_disks;
-			st->spare = array.spare_disks;
-			st->failed = array.failed_disks;
-			st->utime = array.utime;
-			st->raid = array.raid_disks;
-			st->err = 0;
+			free(dinfo);
+			hash_state(st, hash);
+			st->next = *statelist;
+			st->err = 1;
+			st->percent = -2;
+			st->expected_spares = -1;
+			*statelist = st;
+			if (test)
+				alert("TestMessage", st->devname, NULL, info);
+			alert("NewArray", st->devname, NULL, info);
+			new_found = 1;
 		}
-		/* now check if there are any new devices found in mdstat */
-		if (scan) {
-			struct mdstat_ent *mse;
-			for (mse=mdstat; mse; mse=mse->next)
-				if (mse->devnum != INT_MAX &&
-				    mse->level &&
-				    (strcmp(mse->level, "raid0")!=0 &&
-				     strcmp(mse->level, "linear")!=0)
-					) {
-					struct state *st = malloc(sizeof *st);
-					mdu_array_info_t array;
-					int fd;
-					if (st == NULL)
-						continue;
-					st->devname = strdup(get_md_name(mse->devnum));
-					if ((fd = open(st->devname, O_RDONLY)) < 0 ||
-					    ioctl(fd, GET_ARRAY_INFO, &array)< 0) {
-						/* no such array */
-						if (fd >=0) close(fd);
-						put_md_name(st->devname);
-						free(st->devname);
-						free(st);
+	return new_found;
+}
+
+static void try_spare_migration(struct state *statelist,
+				struct alert_info *info)
+{
+	struct state *st;
+
+	for (st = statelist; st; st=st->next)
+		if (st->active < st->raid &&
+		    st->spare == 0 &&
+		    st->spare_group != NULL) {
+			struct state *st2;
+			for (st2=statelist ; st2 ; st2=st2->next)
+				if (st2 != st &&
+				    st2->spare > 0 &&
+				    st2->active == st2->raid &&
+				    st2->spare_group != NULL &&
+				    strcmp(st->spare_group, st2->spare_group) == 0) {
+					/* try to remove and add */
+					int fd1 = open(st->devname, O_RDONLY);
+					int fd2 = open(st2->devname, O_RDONLY);
+					int dev = -1;
+					int d;
+					if (fd1 < 0 || fd2 < 0) {
+						if (fd1>=0) close(fd1);
+						if (fd2>=0) close(fd2);
 						continue;
 					}
-					close(fd);
-					st->utime = 0;
-					st->next = statelist;
-					st->err = 1;
-					st->devnum = mse->devnum;
-					st->percent = -2;
-					st->spare_group = NULL;
-					st->expected_spares = -1;
-					statelist = st;
-					if (test)
-						alert("TestMessage", st->devname, NULL, mailaddr, mailfrom, alert_cmd, dosyslog);
-					alert("NewArray", st->devname, NULL, mailaddr, mailfrom, alert_cmd, dosyslog);
-					new_found = 1;
-				}
-		}
-		/* If an array has active < raid && spare == 0 && spare_group != NULL
-		 * Look for another array with spare > 0 and active == raid and same spare_group
-		 *  if found, choose a device and hotremove/hotadd
-		 */
-		for (st = statelist; st; st=st->next)
-			if (st->active < st->raid &&
-			    st->spare == 0 &&
-			    st->spare_group != NULL) {
-				struct state *st2;
-				for (st2=statelist ; st2 ; st2=st2->next)
-					if (st2 != st &&
-					    st2->spare > 0 &&
-					    st2->active == st2->raid &&
-					    st2->spare_group != NULL &&
-					    strcmp(st->spare_group, st2->spare_group) == 0) {
-						/* try to remove and add */
-						int fd1 = open(st->devname, O_RDONLY);
-						int fd2 = open(st2->devname, O_RDONLY);
-						int dev = -1;
-						int d;
-						if (fd1 < 0 || fd2 < 0) {
-							if (fd1>=0) close(fd1);
-							if (fd2>=0) close(fd2);
-							continue;
+					for (d=st2->raid; d < st2->devmax; d++) {
+						if (st2->devid[d] > 0 &&
+						    st2->devstate[d] == 0) {
+							dev = st2->devid[d];
+							break;
 						}
-						for (d=st2->raid; d < MaxDisks; d++) {
-							if (st2->devid[d] > 0 &&
-							    st2->devstate[d] == 0) {
-								dev = st2->devid[d];
+					}
+					if (dev > 0) {
+						struct mddev_dev_s devlist;
+						char devname[20];
+						devlist.next = NULL;
+						devlist.used = 0;
+						devlist.re_add = 0;
+						devlist.writemostly = 0;
+						devlist.devname = devname;
+						sprintf(devname, "%d:%d", major(dev), minor(dev));
+
+						devlist.disposition = 'r';
+						if (Manage_subdevs(st2->devname, fd2, &devlist, -1, 0) == 0) {
+							devlist.disposition = 'a';
+							if (Manage_subdevs(st->devname, fd1, &devlist, -1, 0) == 0) {
+								alert("MoveSpare", st->devname, st2->devname, info);
+								close(fd1);
+								close(fd2);
 								break;
 							}
+							else Manage_subdevs(st2->devname, fd2, &devlist, -1, 0);
 						}
-						if (dev > 0) {
-							struct mddev_dev_s devlist;
-							char devname[20];
-							devlist.next = NULL;
-							devlist.used = 0;
-							devlist.re_add = 0;
-							devlist.writemostly = 0;
-							devlist.devname = devname;
-							sprintf(devname, "%d:%d", major(dev), minor(dev));
-
-							devlist.disposition = 'r';
-							if (Manage_subdevs(st2->devname, fd2, &devlist, -1, 0) == 0) {
-								devlist.disposition = 'a';
-								if (Manage_subdevs(st->devname, fd1, &devlist, -1, 0) == 0) {
-									alert("MoveSpare", st->devname, st2->devname, mailaddr, mailfrom, alert_cmd, dosyslog);
-									close(fd1);
-									close(fd2);
-									break;
-								}
-								else Manage_subdevs(st2->devname, fd2, &devlist, -1, 0);
-							}
-						}
-						close(fd1);
-						close(fd2);
 					}
+					close(fd1);
+					close(fd2);
+				}
+		}
+}
+
+
+/*
+ * --metrics and --metrics-socket
+ *
+ * Whenever an array is checked we also note everything a monitoring
+ * system might want to graph, then render it all in the Prometheus
+ * text exposition format.  The text is kept and handed to anyone who
+ * asks, so a scrape costs nothing like a run of "mdadm --detail" for
+ * each array.  Progress of a resync is re-read when the text is more
+ * than a second old.
+ */
+
+static char *state_mdname(struct state *st)
+{
+	/* The kernel's name for the array, as in /sys/block.  Kept
+	 * as it is wanted for every attribute and every metric.
+	 */
+	if (!st->mdname || st->mdnum != st->devnum) {
+		free(st->mdname);
+		st->mdname = devnum2devname(st->devnum);
+		st->mdnum = st->devnum;
+	}
+	return st->mdname ? st->mdname : "";
+}
+
+static int read_attr(struct state *st, char *dev, char *attr, char *buf)
+{
+	/* read-only, unlike sysfs_get_str, so as not to look like
+	 * a change to inotify
+	 */
+	char path[PATH_MAX];
+
+	if (dev)
+		sprintf(path, "%s/sys/block/%s/md/%s/%s", mdadm_root(),
+			state_mdname(st), dev, attr);
+	else
+		sprintf(path, "%s/sys/block/%s/md/%s", mdadm_root(),
+			state_mdname(st), attr);
+	return load_sys(path, buf);
+}
+
+static void update_sync(struct state *st)
+{
+	char buf[1024];
+
+	st->sync_done = st->sync_total = 0;
+	if (read_attr(st, NULL, "sync_completed", buf) == 0)
+		sscanf(buf, "%llu / %llu", &st->sync_done, &st->sync_total);
+	st->sync_speed = 0;
+	if (read_attr(st, NULL, "sync_speed", buf) == 0)
+		st->sync_speed = strtoul(buf, NULL, 10);
+	st->sync_time = time(0);
+}
+
+static void update_model(struct state *st)
+{
+	struct mdinfo *sra, *d;
+	char buf[1024];
+	int n;
+
+	st->model = 0;
+	if (st->err || st->devnum == INT_MAX)
+		return;
+	sra = sysfs_read(-1, st->devnum, GET_LEVEL|GET_DISKS|GET_DEGRADED|
+			 GET_MISMATCH|GET_DEVS|GET_ERROR);
+	if (!sra)
+		return;
+	st->model = 1;
+	st->level = sra->array.level;
+	st->degraded = sra->array.failed_disks;
+	st->mismatch_cnt = sra->mismatch_cnt;
+	if (read_attr(st, NULL, "array_state", buf) != 0)
+		strcpy(buf, "unknown");
+	strncpy(st->array_state, buf, sizeof(st->array_state)-1);
+	if (read_attr(st, NULL, "sync_action", buf) != 0)
+		strcpy(buf, "none");
+	strncpy(st->sync_action, buf, sizeof(st->sync_action)-1);
+	update_sync(st);
+
+	for (n = 0, d = sra->devs; d; d = d->next)
+		n++;
+	free(st->members);
+	st->members = calloc(n ? n : 1, sizeof(*st->members));
+	st->nmembers = 0;
+	for (d = sra->devs; st->members && d; d = d->next) {
+		struct member_model *m = &st->members[st->nmembers++];
+
+		strncpy(m->name, d->sys_name + 4, sizeof(m->name)-1);
+		m->slot = d->disk.raid_disk;
+		m->errors = d->errors;
+		if (read_attr(st, d->sys_name, "state", buf) != 0)
+			strcpy(buf, "unknown");
+		strncpy(m->state, buf, sizeof(m->state)-1);
+	}
+	sysfs_free(sra);
+}
+
+static void render_metrics(struct metrics *mt, struct state *statelist)
+{
+	struct state *st;
+	char *text = NULL;
+	size_t len = 0;
+	FILE *f;
+	time_t now = time(0);
+	unsigned long speed;
+	long eta;
+	int i;
+
+	f = open_memstream(&text, &len);
+	if (!f)
+		return;
+
+#define HEAD(name, help) fprintf(f, "# HELP mdadm_" name " " help "\n" \
+				 "# TYPE mdadm_" name " gauge\n")
+#define EACH for (st = statelist; st; st = st->next) if (st->model)
+#define ARRAY "{array=\"%s\""
+
+	for (st = statelist; st; st = st->next)
+		if (st->model && strcmp(st->sync_action, "idle") != 0 &&
+		    st->sync_time != now)
+			update_sync(st);
+
+	HEAD("array_info", "Array names and level.");
+	EACH fprintf(f, "mdadm_array_info" ARRAY ",device=\"%s\",level=\"%s\"} 1\n",
+		     state_mdname(st), st->devname,
+		     map_num(pers, st->level) ?: "unknown");
+	HEAD("array_state", "The array_state of each array.");
+	EACH fprintf(f, "mdadm_array_state" ARRAY ",state=\"%s\"} 1\n",
+		     state_mdname(st), st->array_state);
+	HEAD("array_raid_disks", "Number of devices the array should have.");
+	EACH fprintf(f, "mdadm_array_raid_disks" ARRAY "} %d\n",
+		     state_mdname(st), st->raid);
+	HEAD("array_degraded", "Number of devices the array is missing.");
+	EACH fprintf(f, "mdadm_array_degraded" ARRAY "} %d\n",
+		     state_mdname(st), st->degraded);
+	HEAD("array_sync_action", "Current sync_action of each array.");
+	EACH fprintf(f, "mdadm_array_sync_action" ARRAY ",action=\"%s\"} 1\n",
+		     state_mdname(st), st->sync_action);
+	HEAD("array_sync_completed_sectors", "Progress of the current sync action.");
+	EACH fprintf(f, "mdadm_array_sync_completed_sectors" ARRAY "} %llu\n",
+		     state_mdname(st), st->sync_done);
+	HEAD("array_sync_total_sectors", "Size of the current sync action.");
+	EACH fprintf(f, "mdadm_array_sync_total_sectors" ARRAY "} %llu\n",
+		     state_mdname(st), st->sync_total);
+	HEAD("array_sync_speed_kbytes", "Speed of the current sync action in K/sec.");
+	EACH fprintf(f, "mdadm_array_sync_speed_kbytes" ARRAY "} %lu\n",
+		     state_mdname(st), st->sync_speed);
+	HEAD("array_sync_eta_seconds", "Expected time until the current sync action finishes.");
+	EACH if (sync_rate(st, &speed, &eta) == 0 && eta >= 0)
+		fprintf(f, "mdadm_array_sync_eta_seconds" ARRAY "} %ld\n",
+			state_mdname(st), eta);
+	HEAD("array_sync_stalled", "The current sync action has stopped making progress.");
+	EACH fprintf(f, "mdadm_array_sync_stalled" ARRAY "} %d\n",
+		     state_mdname(st), st->stalled);
+	HEAD("array_mismatch_cnt", "mismatch_cnt from the last check or repair.");
+	EACH fprintf(f, "mdadm_array_mismatch_cnt" ARRAY "} %d\n",
+		     state_mdname(st), st->mismatch_cnt);
+	HEAD("member_state", "The state of each member device.");
+	EACH for (i = 0; i < st->nmembers; i++)
+		fprintf(f, "mdadm_member_state" ARRAY ",member=\"%s\",slot=\"%d\",state=\"%s\"} 1\n",
+			state_mdname(st), st->members[i].name,
+			st->members[i].slot, st->members[i].state);
+	HEAD("member_iops", "I/O requests completed per second by each member.");
+	EACH for (i = 0; i < st->nperf; i++)
+		if (st->perf[i].valid)
+			fprintf(f, "mdadm_member_iops" ARRAY ",member=\"%s\"} %lu\n",
+				state_mdname(st), st->perf[i].name,
+				st->perf[i].iops);
+	HEAD("member_kbytes_per_second", "Data read and written per second by each member.");
+	EACH for (i = 0; i < st->nperf; i++)
+		if (st->perf[i].valid)
+			fprintf(f, "mdadm_member_kbytes_per_second" ARRAY ",member=\"%s\"} %lu\n",
+				state_mdname(st), st->perf[i].name,
+				st->perf[i].kbps);
+	HEAD("member_await_ms", "Average time each member took over a request.");
+	EACH for (i = 0; i < st->nperf; i++)
+		if (st->perf[i].valid)
+			fprintf(f, "mdadm_member_await_ms" ARRAY ",member=\"%s\"} %lu.%03lu\n",
+				state_mdname(st), st->perf[i].name,
+				st->perf[i].await_us / 1000,
+				st->perf[i].await_us % 1000);
+	HEAD("member_slow", "The member is much slower than the others in the array.");
+	EACH for (i = 0; i < st->nperf; i++)
+		fprintf(f, "mdadm_member_slow" ARRAY ",member=\"%s\"} %d\n",
+			state_mdname(st), st->perf[i].name,
+			st->perf[i].slow);
+	HEAD("member_errors", "Read errors corrected on each member device.");
+	EACH for (i = 0; i < st->nmembers; i++)
+		fprintf(f, "mdadm_member_errors" ARRAY ",member=\"%s\"} %d\n",
+			state_mdname(st), st->members[i].name,
+			st->members[i].errors);
+#undef HEAD
+#undef EACH
+#undef ARRAY
+	fclose(f);
+
+	free(mt->text);
+	mt->text = text;
+	mt->len = len;
+	mt->rendered = now;
+	mt->dirty = 0;
+}
+
+static void write_metrics(struct metrics *mt, struct state *statelist)
+{
+	/* Replace the file in one go, so readers never see half of it */
+	char tmp[PATH_MAX];
+	int fd;
+
+	render_metrics(mt, statelist);
+	mt->written = time(0);
+	if (!mt->text)
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", mt->file);
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0)
+		return;
+	if (write(fd, mt->text, mt->len) != (ssize_t)mt->len) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	close(fd);
+	if (rename(tmp, mt->file) != 0)
+		unlink(tmp);
+}
+
+static int metrics_socket(char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, Name ": metrics socket name too long: %s\n",
+			path);
+		return -1;
+	}
+	fd = socket(PF_LOCAL, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	addr.sun_family = PF_LOCAL;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 16) < 0) {
+		fprintf(stderr, Name ": cannot listen on %s: %s\n",
+			path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+static void metrics_send(struct metrics_conn *c, int epfd)
+{
+	/* send what we can.  If it doesn't all fit, wait to be
+	 * told there is room.
+	 */
+	ssize_t n = 0;
+
+	while (c->off < c->len) {
+		n = send(c->fd, c->text + c->off, c->len - c->off,
+			 MSG_NOSIGNAL);
+		if (n <= 0)
+			break;
+		c->off += n;
+	}
+	if (c->off < c->len && n < 0 && errno == EAGAIN) {
+		if (!c->waiting)
+			c->waiting = sysfs_watch_io(epfd, c->fd, 1, c) == 0;
+		if (c->waiting)
+			return;
+	}
+	/* all sent, or never will be */
+	if (c->waiting)
+		sysfs_unwatch_fd(epfd, c->fd);
+	close(c->fd);
+	c->fd = -1;
+}
+
+static int metrics_event(struct metrics *mt, void *cookie, int epfd,
+			 struct state *statelist)
+{
+	/* If 'cookie' belongs to the metrics socket or one of its
+	 * connections, deal with it and return 1.
+	 */
+	struct metrics_conn *c, **cp;
+	int fd;
+
+	if (cookie == mt) {
+		while ((fd = accept(mt->sock_fd, NULL, NULL)) >= 0) {
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+			fcntl(fd, F_SETFL, O_NONBLOCK);
+			if (mt->dirty || mt->rendered != time(0))
+				render_metrics(mt, statelist);
+			c = calloc(1, sizeof(*c));
+			if (c)
+				c->text = malloc(mt->len);
+			if (!c || !c->text) {
+				free(c);
+				close(fd);
+				continue;
 			}
-		if (!new_found) {
-			if (oneshot)
+			memcpy(c->text, mt->text, mt->len);
+			c->len = mt->len;
+			c->fd = fd;
+			c->next = mt->conns;
+			mt->conns = c;
+			metrics_send(c, epfd);
+		}
+	} else {
+		for (c = mt->conns; c; c = c->next)
+			if (c == cookie)
 				break;
-			else
-				mdstat_wait(period);
+		if (!c)
+			return 0;
+		metrics_send(c, epfd);
+	}
+	/* forget finished connections */
+	cp = &mt->conns;
+	while ((c = *cp) != NULL) {
+		if (c->fd >= 0) {
+			cp = &c->next;
+			continue;
 		}
-		test = 0;
+		*cp = c->next;
+		free(c->text);
+		free(c);
 	}
-	if (pidfile)
-		unlink(pidfile);
+	return 1;
+}
+
+static int metrics_timeout(struct metrics *mt)
+{
+	/* msecs until the metrics file should next be written */
+	time_t due;
+
+	if (!mt->file)
+		return -1;
+	due = mt->written + (mt->dirty ? 1 : METRICS_INTERVAL);
+	if (due <= time(0))
+		return 0;
+	return (due - time(0)) * 1000;
+}
+
+/*
+ * The scrub scheduler.
+ *
+ * If there is a SCRUB line in the config file, we start a "check"
+ * on each array every so many days, instead of cron starting them
+ * all at once.  Arrays that share a disk (partitions of the same
+ * drive, or volumes in the same container) are never checked at
+ * the same time, and we never run more than 'parallel' checks.
+ * Outside the time window checks are stopped, and sync_min is set
+ * so that they carry on from the same place next time.  The kernel
+ * does the same if a check is interrupted for some other reason.
+ * When each array was last checked, and where a stopped check got
+ * to, are kept in SCRUB_FILE so they survive a reboot.
+ */
+
+static struct scrub_record *scrub_record(struct scrub *sc, char *dev)
+{
+	struct scrub_record *r;
+
+	for (r = sc->recs; r; r = r->next)
+		if (strcmp(r->dev, dev) == 0)
+			return r;
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->dev = strdup(dev);
+	r->next = sc->recs;
+	sc->recs = r;
+	return r;
+}
+
+static void scrub_load(struct scrub *sc)
+{
+	char path[PATH_MAX];
+	char dev[PATH_MAX];
+	long last;
+	unsigned long long pos;
+	FILE *f;
+
+	sprintf(path, "%s%s", mdadm_root(), SCRUB_FILE);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	while (fscanf(f, "%s %ld %llu", dev, &last, &pos) == 3) {
+		struct scrub_record *r = scrub_record(sc, dev);
+		if (r) {
+			r->last = last;
+			r->pos = pos;
+		}
+	}
+	fclose(f);
+}
+
+static void scrub_save(struct scrub *sc)
+{
+	static int warned = 0;
+	char path[PATH_MAX], tmp[PATH_MAX+4];
+	struct scrub_record *r;
+	FILE *f;
+	char *cp;
+	int saved = 0;
+
+	sprintf(path, "%s%s", mdadm_root(), SCRUB_FILE);
+	cp = strrchr(path, '/');
+	*cp = 0;
+	mkdir(path, 0755);
+	*cp = '/';
+	sprintf(tmp, "%s.new", path);
+	f = fopen(tmp, "w");
+	if (f) {
+		for (r = sc->recs; r; r = r->next)
+			fprintf(f, "%s %ld %llu\n",
+				r->dev, (long)r->last, r->pos);
+		if (fclose(f) == 0 && rename(tmp, path) == 0)
+			saved = 1;
+		else
+			unlink(tmp);
+	}
+	if (!saved && !warned) {
+		/* Not fatal, checks just start again from scratch
+		 * after a restart, but someone should know.
+		 */
+		fprintf(stderr, Name ": cannot save scrub progress in %s: %s\n",
+			path, strerror(errno));
+		warned = 1;
+	}
+	sc->dirty = 0;
+}
+
+static int write_attr(struct state *st, char *attr, char *val)
+{
+	char path[PATH_MAX];
+	int fd, n;
+
+	sprintf(path, "%s/sys/block/%s/md/%s", mdadm_root(),
+		state_mdname(st), attr);
+	/* O_TRUNC like "echo >", which matters for MDADM_ROOT */
+	fd = open(path, O_WRONLY|O_TRUNC);
+	if (fd < 0)
+		return -1;
+	n = write(fd, val, strlen(val));
+	close(fd);
+	return n == (int)strlen(val) ? 0 : -1;
+}
+
+static int in_window(struct scrubinfo *conf, time_t now)
+{
+	struct tm *tm = localtime(&now);
+	int m = tm->tm_hour * 60 + tm->tm_min;
+
+	if (conf->start == conf->end)
+		return 1;
+	if (conf->start < conf->end)
+		return m >= conf->start && m < conf->end;
+	/* over midnight */
+	return m >= conf->start || m < conf->end;
+}
+
+static dev_t whole_disk(int major, int minor)
+{
+	/* The disk that a partition is on, or the device itself */
+	char path[PATH_MAX];
+	char buf[1024];
+	int ma, mi;
+
+	sprintf(path, "%s/sys/dev/block/%d:%d/partition", mdadm_root(),
+		major, minor);
+	if (access(path, F_OK) == 0) {
+		sprintf(path, "%s/sys/dev/block/%d:%d/../dev", mdadm_root(),
+			major, minor);
+		if (load_sys(path, buf) == 0 &&
+		    sscanf(buf, "%d:%d", &ma, &mi) == 2)
+			return makedev(ma, mi);
+	}
+	return makedev(major, minor);
+}
+
+static void scrub_disks(struct state *st)
+{
+	/* Find the disks under an array, if we don't know already */
+	struct mdinfo *sra, *d;
+	int n = 0;
+
+	if (st->disks)
+		return;
+	sra = sysfs_read(-1, st->devnum, GET_DEVS);
+	if (!sra)
+		return;
+	for (d = sra->devs; d; d = d->next)
+		n++;
+	st->disks = calloc(n+1, sizeof(*st->disks));
+	if (st->disks)
+		for (n = 0, d = sra->devs; d; d = d->next)
+			st->disks[n++] = whole_disk(d->disk.major,
+						    d->disk.minor);
+	st->ndisks = n;
+	sysfs_free(sra);
+}
+
+static int add_busy(dev_t **busy, int *nbusy, struct state *st)
+{
+	dev_t *b = realloc(*busy, (*nbusy + st->ndisks + 1) * sizeof(*b));
+
+	if (!b)
+		return -1;
+	memcpy(b + *nbusy, st->disks, st->ndisks * sizeof(*b));
+	*busy = b;
+	*nbusy += st->ndisks;
 	return 0;
 }
 
+static int shares_disk(struct state *st, dev_t *busy, int nbusy)
+{
+	int i, j;
+
+	for (i = 0; i < st->ndisks; i++)
+		for (j = 0; j < nbusy; j++)
+			if (st->disks[i] == busy[j])
+				return 1;
+	return 0;
+}
 
-static void alert(char *event, char *dev, char *disc, char *mailaddr, char *mailfrom, char *cmd,
-		  int dosyslog)
+static int scrub_able(struct state *st)
 {
-	int priority;
+	/* Can we check this idle array?  It must have redundancy,
+	 * and all of it.
+	 */
+	char buf[1024];
+	int level;
 
-	if (!cmd && !mailaddr) {
-		time_t now = time(0);
+	if (read_attr(st, NULL, "level", buf) != 0)
+		return 0;
+	level = map_name(pers, buf);
+	if (level != 1 && level != 4 && level != 5 && level != 6 &&
+	    level != 10)
+		return 0;
+	if (read_attr(st, NULL, "degraded", buf) != 0 || atoi(buf) != 0)
+		return 0;
+	return 1;
+}
 
-		printf("%1.15s: %s on %s %s\n", ctime(&now)+4, event, dev, disc?disc:"unknown device");
+static void scrub_stop(struct state *st, struct scrub *sc)
+{
+	/* Leaving the window: stop the check and remember where
+	 * it got to.
+	 */
+	char buf[1024];
+	unsigned long long done, max;
+
+	if (read_attr(st, NULL, "sync_completed", buf) == 0 &&
+	    sscanf(buf, "%llu / %llu", &done, &max) == 2)
+		st->scrub_seen = done;
+	write_attr(st, "sync_action", "idle");
+	sprintf(buf, "%llu", st->scrub_seen);
+	write_attr(st, "sync_min", buf);
+	write_attr(st, "sync_speed_max", "system");
+	st->scrub_rec->pos = st->scrub_seen;
+	st->scrub = 0;
+	sc->dirty = 1;
+}
+
+static void scrub_ended(struct state *st, struct scrub *sc)
+{
+	/* Our check isn't running any more.  The kernel clears
+	 * sync_min when a check finishes, and when one is interrupted
+	 * leaves the place to carry on from there, which is never
+	 * before where we started.  It may have come and gone between
+	 * two looks, so that is all we go on.  A check from the start
+	 * that was stopped before getting anywhere looks finished,
+	 * but then there is nothing to carry on from anyway.
+	 */
+	char buf[1024];
+	unsigned long long min = 0;
+
+	write_attr(st, "sync_speed_max", "system");
+	if (read_attr(st, NULL, "sync_min", buf) == 0)
+		min = strtoull(buf, NULL, 10);
+	if (min != 0 && min >= st->scrub_start) {
+		/* interrupted.  Maybe someone wanted it stopped, so
+		 * leave it for a while.
+		 */
+		st->scrub_rec->pos = min;
+		st->scrub_retry = time(0) + SCRUB_RETRY;
+	} else {
+		st->scrub_rec->last = time(0);
+		st->scrub_rec->pos = 0;
+		write_attr(st, "sync_min", "0");
 	}
-	if (cmd) {
-		int pid = fork();
-		switch(pid) {
-		default:
-			waitpid(pid, NULL, 0);
-			break;
-		case -1:
-			break;
-		case 0:
-			execl(cmd, cmd, event, dev, disc, NULL);
-			exit(2);
+	st->scrub = 0;
+	sc->dirty = 1;
+	sc->next = 0;
+}
+
+static int scrub_start(struct state *st)
+{
+	char buf[1024];
+	unsigned long long pos = st->scrub_rec->pos;
+	unsigned long chunk = 0;
+
+	/* sync_min must be a multiple of the chunk size */
+	if (read_attr(st, NULL, "chunk_size", buf) == 0)
+		chunk = strtoul(buf, NULL, 10) / 512;
+	if (chunk)
+		pos -= pos % chunk;
+	sprintf(buf, "%llu", pos);
+	if (write_attr(st, "sync_min", buf) != 0 && pos)
+		pos = 0;
+	if (write_attr(st, "sync_action", "check") != 0)
+		return -1;
+	st->scrub = 1;
+	st->scrub_start = st->scrub_seen = pos;
+	st->scrub_speed = -1;
+	return 0;
+}
+
+static void scrub_arrays(struct state *statelist, struct scrub *sc)
+{
+	struct state *st, *best;
+	dev_t *busy = NULL;
+	int nbusy = 0;
+	int running = 0;
+	time_t now = time(0);
+	char action[1024];
+	int inwin = in_window(sc->conf, now);
+
+	/* First see how our checks are getting on */
+	for (st = statelist; st; st = st->next) {
+		unsigned long long done, max;
+
+		if (!st->scrub)
+			continue;
+		if (st->err ||
+		    read_attr(st, NULL, "sync_action", action) != 0 ||
+		    strncmp(action, "check", 5) != 0) {
+			scrub_ended(st, sc);
+			continue;
 		}
+		if (!inwin) {
+			scrub_stop(st, sc);
+			continue;
+		}
+		if (read_attr(st, NULL, "sync_completed", action) == 0 &&
+		    sscanf(action, "%llu / %llu", &done, &max) == 2)
+			st->scrub_seen = done;
+		running++;
 	}
-	if (mailaddr &&
-	    (strncmp(event, "Fail", 4)==0 ||
-	     strncmp(event, "Test", 4)==0 ||
-	     strncmp(event, "Spares", 6)==0 ||
-	     strncmp(event, "Degrade", 7)==0)) {
-		FILE *mp = popen(Sendmail, "w");
-		if (mp) {
-			FILE *mdstat;
-			char hname[256];
-			gethostname(hname, sizeof(hname));
-			signal(SIGPIPE, SIG_IGN);
-			if (mailfrom)
-				fprintf(mp, "From: %s\n", mailfrom);
-			else
-				fprintf(mp, "From: " Name " monitoring <root>\n");
-			fprintf(mp, "To: %s\n", mailaddr);
-			fprintf(mp, "Subject: %s event on %s:%s\n\n", event, dev, hname);
-
-			fprintf(mp, "This is an automatically generated mail message from " Name "\n");
-			fprintf(mp, "running on %s\n\n", hname);
-
-			fprintf(mp, "A %s event had been detected on md device %s.\n\n", event, dev);
 
-			if (disc && disc[0] != ' ')
-				fprintf(mp, "It could be related to component device %s.\n\n", disc);
-			if (disc && disc[0] == ' ')
-				fprintf(mp, "Extra information:%s.\n\n", disc);
-
-			fprintf(mp, "Faithfully yours, etc.\n");
+	if (inwin && running < sc->conf->parallel && now >= sc->next) {
+		/* Note every disk that is busy with any sync action,
+		 * and which arrays are due to be checked.
+		 */
+		sc->next = now + SCRUB_TICK;
+		for (st = statelist; st; st = st->next) {
+			st->scrub_due = 0;
+			if (st->err || !st->utime || st->devnum == INT_MAX ||
+			    read_attr(st, NULL, "sync_action", action) != 0)
+				continue;
+			if (!st->scrub_rec)
+				st->scrub_rec = scrub_record(sc, st->devname);
+			if (!st->scrub_rec)
+				continue;
+			scrub_disks(st);
+			if (strncmp(action, "idle", 4) != 0 &&
+			    strncmp(action, "frozen", 6) != 0) {
+				add_busy(&busy, &nbusy, st);
+				continue;
+			}
+			if (now < st->scrub_retry)
+				continue;
+			if (st->scrub_rec->pos == 0 &&
+			    now < st->scrub_rec->last + sc->conf->every * 24*60*60)
+				continue;
+			st->scrub_due = scrub_able(st);
+		}
 
-			mdstat = fopen("/proc/mdstat", "r");
-			if (mdstat) {
-				char buf[8192];
-				int n;
-				fprintf(mp, "\nP.S. The /proc/mdstat file currently contains the following:\n\n");
-				while ( (n=fread(buf, 1, sizeof(buf), mdstat)) > 0)
-					n=fwrite(buf, 1, n, mp); /* yes, i don't care about the result */
-				fclose(mdstat);
+		/* Then start the most overdue, carrying on with
+		 * unfinished ones first.
+		 */
+		while (running < sc->conf->parallel) {
+			best = NULL;
+			for (st = statelist; st; st = st->next) {
+				if (!st->scrub_due)
+					continue;
+				if (shares_disk(st, busy, nbusy)) {
+					st->scrub_due = 0;
+					continue;
+				}
+				if (!best ||
+				    (st->scrub_rec->pos && !best->scrub_rec->pos) ||
+				    (!st->scrub_rec->pos == !best->scrub_rec->pos &&
+				     st->scrub_rec->last < best->scrub_rec->last))
+					best = st;
 			}
-			pclose(mp);
+			if (!best)
+				break;
+			best->scrub_due = 0;
+			if (scrub_start(best) != 0)
+				continue;
+			running++;
+			add_busy(&busy, &nbusy, best);
 		}
+		free(busy);
+	}
+
+	/* Share out the speed budget */
+	if (sc->conf->speed && running) {
+		int speed = sc->conf->speed / running;
 
+		if (speed < 1)
+			speed = 1;
+		for (st = statelist; st; st = st->next)
+			if (st->scrub && st->scrub_speed != speed) {
+				sprintf(action, "%d", speed);
+				write_attr(st, "sync_speed_max", action);
+				st->scrub_speed = speed;
+			}
 	}
+	if (sc->dirty)
+		scrub_save(sc);
+}
+
+static int scrub_timeout(struct scrub *sc)
+{
+	/* msecs until the scheduler should look again */
+	if (!sc->conf)
+		return -1;
+	return SCRUB_TICK * 1000;
+}
+
+static void alert(char *event, char *dev, char *disc, struct alert_info *info)
+{
+	/* Report an event.  syslog and stdout get it straight away.
+	 * The alert program and mail are slow, so the event is queued
+	 * for them and run_alerts() does the work in child processes.
+	 */
+	int priority;
+
+	if (!info->alert_cmd && !info->mailaddr) {
+		time_t now = time(0);
+
+		printf("%1.15s: %s on %s %s\n", ctime(&now)+4, event, dev, disc?disc:"unknown device");
+	}
+	if (info->alert_cmd)
+		queue_alert(&info->cmd_queue, event, dev, disc);
+	if (info->mailaddr &&
+	    (strncmp(event, "Fail", 4)==0 ||
+	     strncmp(event, "Test", 4)==0 ||
+	     strncmp(event, "Spares", 6)==0 ||
+	     strncmp(event, "Degrade", 7)==0 ||
+	     strncmp(event, "RebuildStalled", 14)==0))
+		queue_alert(&info->mail_queue, event, dev, disc);
 
 	/* log the event to syslog maybe */
-	if (dosyslog) {
+	if (info->dosyslog) {
 		/* Log at a different severity depending on the event.
 		 *
 		 * These are the critical events:  */
@@ -610,6 +2126,249 @@ static void alert(char *event, char *dev, char *disc, char *mailaddr, char *mail
 		else
 			syslog(priority, "%s event detected on md device %s", event, dev);
 	}
+	run_alerts(info, 0);
+}
+
+static void queue_alert(struct alert **queue, char *event, char *dev,
+			char *disc)
+{
+	/* Add an event to the end of a queue, unless exactly the
+	 * same event is already waiting there.
+	 */
+	struct alert *a;
+
+	for (; *queue; queue = &(*queue)->next) {
+		a = *queue;
+		if (strcmp(a->event, event) == 0 &&
+		    strcmp(a->dev, dev) == 0 &&
+		    ((!a->disc && !disc) ||
+		     (a->disc && disc && strcmp(a->disc, disc) == 0)))
+			return;
+	}
+	a = malloc(sizeof(*a));
+	if (!a)
+		return;
+	a->event = strdup(event);
+	a->dev = strdup(dev);
+	a->disc = disc ? strdup(disc) : NULL;
+	a->when = time(0);
+	a->next = NULL;
+	*queue = a;
+}
+
+static void free_alert(struct alert *a)
+{
+	free(a->event);
+	free(a->dev);
+	free(a->disc);
+	free(a);
+}
+
+static int alert_child(struct alert_info *info, char *dev)
+{
+	/* fork a child to deliver alerts for dev (NULL for mail).
+	 * Returns 0 in the child, 1 in the parent, -1 on failure.
+	 */
+	sigset_t set;
+	int i, pid;
+
+	for (i = 0; i < ALERT_RUNNING; i++)
+		if (info->running[i].pid == 0)
+			break;
+	if (i == ALERT_RUNNING)
+		return -1;
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0) {
+		sigemptyset(&set);
+		sigaddset(&set, SIGCHLD);
+		sigprocmask(SIG_UNBLOCK, &set, NULL);
+		signal(SIGCHLD, SIG_DFL);
+		return 0;
+	}
+	info->running[i].pid = pid;
+	info->running[i].dev = dev ? strdup(dev) : NULL;
+	info->nrunning++;
+	return 1;
+}
+
+static int alert_busy(struct alert_info *info, char *dev)
+{
+	int i;
+
+	for (i = 0; i < ALERT_RUNNING; i++)
+		if (info->running[i].pid &&
+		    info->running[i].dev &&
+		    strcmp(info->running[i].dev, dev) == 0)
+			return 1;
+	return 0;
+}
+
+static void send_mail(struct alert *list, struct alert_info *info)
+{
+	/* One message for each array, covering every event that
+	 * happened to it.
+	 */
+	struct alert *a, *a2;
+
+	for (a = list; a; a = a->next) {
+		FILE *mp;
+		FILE *mdstat;
+		char hname[256];
+		char path[PATH_MAX];
+		int more = 0;
+
+		if (!a->dev)
+			/* already sent */
+			continue;
+		for (a2 = a->next; a2; a2 = a2->next)
+			if (a2->dev && strcmp(a2->dev, a->dev) == 0)
+				more++;
+
+		mp = popen(Sendmail, "w");
+		if (!mp)
+			return;
+		gethostname(hname, sizeof(hname));
+		signal(SIGPIPE, SIG_IGN);
+		if (info->mailfrom)
+			fprintf(mp, "From: %s\n", info->mailfrom);
+		else
+			fprintf(mp, "From: " Name " monitoring <root>\n");
+		fprintf(mp, "To: %s\n", info->mailaddr);
+		if (more)
+			fprintf(mp, "Subject: %s event on %s:%s (and %d more)\n\n",
+				a->event, a->dev, hname, more);
+		else
+			fprintf(mp, "Subject: %s event on %s:%s\n\n",
+				a->event, a->dev, hname);
+
+		fprintf(mp, "This is an automatically generated mail message from " Name "\n");
+		fprintf(mp, "running on %s\n\n", hname);
+
+		for (a2 = a; a2; a2 = a2->next) {
+			char *disc = a2->disc;
+			if (!a2->dev || strcmp(a2->dev, a->dev) != 0)
+				continue;
+			fprintf(mp, "A %s event had been detected on md device %s.\n\n", a2->event, a2->dev);
+
+			if (disc && disc[0] != ' ')
+				fprintf(mp, "It could be related to component device %s.\n\n", disc);
+			if (disc && disc[0] == ' ')
+				fprintf(mp, "Extra information:%s.\n\n", disc);
+			if (a2 != a) {
+				free(a2->dev);
+				a2->dev = NULL;
+			}
+		}
+
+		fprintf(mp, "Faithfully yours, etc.\n");
+
+		sprintf(path, "%s/proc/mdstat", mdadm_root());
+		mdstat = fopen(path, "r");
+		if (mdstat) {
+			char buf[8192];
+			int n;
+			fprintf(mp, "\nP.S. The /proc/mdstat file currently contains the following:\n\n");
+			while ( (n=fread(buf, 1, sizeof(buf), mdstat)) > 0)
+				n=fwrite(buf, 1, n, mp); /* yes, i don't care about the result */
+			fclose(mdstat);
+		}
+		pclose(mp);
+	}
+}
+
+static void alert_reaped(struct alert_info *info, int pid)
+{
+	int i;
+
+	for (i = 0; i < ALERT_RUNNING; i++)
+		if (info->running[i].pid == pid) {
+			info->running[i].pid = 0;
+			free(info->running[i].dev);
+			info->running[i].dev = NULL;
+			info->nrunning--;
+		}
+}
+
+static void run_alerts(struct alert_info *info, int wait)
+{
+	/* Collect finished alert children and start more.
+	 * At most ALERT_RUNNING children run at once, and only one
+	 * at a time for any array so its events arrive in order.
+	 * Mail waits until the oldest event has been queued for
+	 * ALERT_WINDOW seconds so that a burst of events on an
+	 * array makes one message.
+	 * If 'wait', don't return until everything has been sent.
+	 */
+	struct alert **ap, *a;
+
+	do {
+		int pid;
+
+		while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+			alert_reaped(info, pid);
+
+		ap = &info->cmd_queue;
+		while ((a = *ap) != NULL && info->nrunning < ALERT_RUNNING) {
+			if (alert_busy(info, a->dev)) {
+				ap = &a->next;
+				continue;
+			}
+			switch (alert_child(info, a->dev)) {
+			case 0:
+				execl(info->alert_cmd, info->alert_cmd,
+				      a->event, a->dev, a->disc, NULL);
+				exit(2);
+			case -1:
+				return;
+			}
+			*ap = a->next;
+			free_alert(a);
+		}
+
+		if (info->mail_queue &&
+		    (wait || time(0) >= info->mail_queue->when + ALERT_WINDOW))
+			switch (alert_child(info, NULL)) {
+			case 0:
+				send_mail(info->mail_queue, info);
+				_exit(0);
+			case 1:
+				while ((a = info->mail_queue) != NULL) {
+					info->mail_queue = a->next;
+					free_alert(a);
+				}
+			}
+
+		if (wait && (info->nrunning || info->cmd_queue ||
+			     info->mail_queue)) {
+			/* wait for a child and go round again */
+			pid = waitpid(-1, NULL, 0);
+			if (pid > 0)
+				alert_reaped(info, pid);
+			else if (errno == ECHILD)
+				return;
+		} else
+			wait = 0;
+	} while (wait);
+}
+
+static void wake_me(int sig)
+{
+	/* just interrupt the wait */
+}
+
+static int alert_timeout(struct alert_info *info)
+{
+	/* msecs until run_alerts() has something to do, other than
+	 * when a child exits.
+	 */
+	long t;
+
+	if (!info->mail_queue)
+		return -1;
+	t = info->mail_queue->when + ALERT_WINDOW - time(0);
+	return t > 0 ? t * 1000 : 0;
 }
 
 /* Not really Monitor but ... */
@@ -82,7 +82,9 @@ int Query(char *dev)
 		       array.spare_disks, array.spare_disks==1?"":"s");
 	}
 	st = guess_super(fd);
-	if (st) {
+	if (st && st->sb)
+		superror = 0;
+	else if (st) {
 		superror = st->ss->load_super(st, fd, dev);
 		superrno = errno;
 	} else
@@ -185,12 +185,15 @@ struct option long_options[] = {
     {"oneshot",   0, 0, '1'},
     {"pid-file",  1, 0, 'i'},
     {"syslog",    0, 0, 'y'},
+    {"metrics",   1, 0, Metrics},
+    {"metrics-socket", 1, 0, MetricsSocket},
     /* For Grow */
     {"backup-file", 1,0, BackupFile},
     {"array-size", 1, 0, 'Z'},
 
     /* For Incremental */
     {"rebuild-map", 0, 0, 'r'},
+    {"listen",    0, 0, Listen},
     {0, 0, 0, 0}
 };
 
@@ -507,6 +510,9 @@ char Help_monitor[] =
 "  --pid-file=   -i   : In daemon mode write pid to specified file instead of stdout\n"
 "  --oneshot     -1   : Check for degraded arrays, then exit\n"
 "  --test        -t   : Generate a TestMessage event against each array at startup\n"
+"  --metrics=         : Keep the state of all arrays in this file, in the\n"
+"                     : Prometheus text format\n"
+"  --metrics-socket=  : Serve the same text to anyone connecting to this socket\n"
 ;
 
 char Help_grow[] =
@@ -538,11 +544,18 @@ char Help_grow[] =
 
 char Help_incr[] =
 "Usage: mdadm --incremental [-Rqrsf] device\n"
+"       mdadm --incremental [-Rq] --listen\n"
+"       mdadm --incremental [-Rq] -\n"
 "\n"
 "This usage allows for incremental assembly of md arrays.  Devices can be\n"
 "added one at a time as they are discovered.  Once an array has all expected\n"
 "devices, it will be started.\n"
 "\n"
+"With --listen, mdadm keeps running and other 'mdadm --incremental' commands\n"
+"hand their devices to it.  Given '-' as the device, mdadm reads device\n"
+"names from stdin.  Either way, devices that arrive together are added\n"
+"as one batch.\n"
+"\n"
 "Optionally, the process can be reversed by using the fail option.\n"
 "When fail mode is invoked, mdadm will see if the device belongs to an array\n"
 "and then both fail (if needed) and remove the device from that array.\n"
@@ -557,6 +570,8 @@ char Help_incr[] =
 "                   : required number of devices, but are not yet started.\n"
 "  --fail      -f  : First fail (if needed) and then remove device from\n"
 "                  : any array that it is a member of.\n"
+"  --listen         : Stay running and add devices that other\n"
+"                   : 'mdadm --incremental' commands are given.\n"
 ;
 
 char Help_config[] =
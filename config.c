@@ -75,7 +75,7 @@ char DefaultConfFile[] = CONFFILE;
 char DefaultAltConfFile[] = CONFFILE2;
 
 enum linetype { Devices, Array, Mailaddr, Mailfrom, Program, CreateDev,
-		Homehost, AutoMode, LTEnd };
+		Homehost, AutoMode, Scrub, SafeMode, LTEnd };
 char *keywords[] = {
 	[Devices]  = "devices",
 	[Array]    = "array",
@@ -85,6 +85,8 @@ char *keywords[] = {
 	[CreateDev]= "create",
 	[Homehost] = "homehost",
 	[AutoMode] = "auto",
+	[Scrub]    = "scrub",
+	[SafeMode] = "safemode",
 	[LTEnd]    = NULL
 };
 
@@ -231,9 +233,13 @@ struct conf_dev {
 
 mddev_dev_t load_partitions(void)
 {
-	FILE *f = fopen("/proc/partitions", "r");
+	FILE *f;
 	char buf[1024];
+	char path[PATH_MAX];
 	mddev_dev_t rv = NULL;
+
+	sprintf(path, "%s/proc/partitions", mdadm_root());
+	f = fopen(path, "r");
 	if (f == NULL) {
 		fprintf(stderr, Name ": cannot open /proc/partitions\n");
 		return NULL;
@@ -695,6 +701,106 @@ void autoline(char *line)
 	}
 }
 
+static struct scrubinfo scrubinfo = {
+	.every = 30,
+	.parallel = 1,
+};
+
+static int parse_time(char *str, int *minp)
+{
+	/* HH:MM to minutes after midnight */
+	int h, m;
+	char c;
+
+	if (sscanf(str, "%d:%d%c", &h, &m, &c) != 2 ||
+	    h < 0 || h > 24 || m < 0 || m > 59)
+		return -1;
+	*minp = (h * 60 + m) % (24 * 60);
+	return 0;
+}
+
+static void scrubline(char *line)
+{
+	char *w;
+	char *ep;
+
+	scrubinfo.enabled = 1;
+	for (w=dl_next(line); w!=line; w=dl_next(w)) {
+		if (strncasecmp(w, "every=", 6) == 0) {
+			scrubinfo.every = strtoul(w+6, &ep, 10);
+			if (*ep != 0 || scrubinfo.every < 1) {
+				fprintf(stderr, Name ": bad SCRUB every=%s, using 30 days\n",
+					w+6);
+				scrubinfo.every = 30;
+			}
+		} else if (strncasecmp(w, "window=", 7) == 0) {
+			char *dash = strchr(w+7, '-');
+			if (!dash) {
+				fprintf(stderr, Name ": SCRUB window must be HH:MM-HH:MM\n");
+				continue;
+			}
+			*dash = 0;
+			if (parse_time(w+7, &scrubinfo.start) != 0 ||
+			    parse_time(dash+1, &scrubinfo.end) != 0) {
+				fprintf(stderr, Name ": SCRUB window must be HH:MM-HH:MM\n");
+				scrubinfo.start = scrubinfo.end = 0;
+			}
+		} else if (strncasecmp(w, "speed=", 6) == 0) {
+			scrubinfo.speed = strtoul(w+6, &ep, 10);
+			if (*ep != 0) {
+				fprintf(stderr, Name ": bad SCRUB speed=%s, ignoring\n",
+					w+6);
+				scrubinfo.speed = 0;
+			}
+		} else if (strncasecmp(w, "parallel=", 9) == 0) {
+			scrubinfo.parallel = strtoul(w+9, &ep, 10);
+			if (*ep != 0 || scrubinfo.parallel < 1) {
+				fprintf(stderr, Name ": bad SCRUB parallel=%s, using 1\n",
+					w+9);
+				scrubinfo.parallel = 1;
+			}
+		} else
+			fprintf(stderr, Name ": unrecognised word on SCRUB line: %s\n",
+				w);
+	}
+}
+
+static struct safemodeinfo safemodeinfo = {
+	.max = 5000,
+};
+
+static void safemodeline(char *line)
+{
+	char *w;
+	char *ep;
+	unsigned long v;
+
+	safemodeinfo.enabled = 1;
+	for (w=dl_next(line); w!=line; w=dl_next(w)) {
+		if (strncasecmp(w, "min=", 4) == 0) {
+			v = strtoul(w+4, &ep, 10);
+			if (*ep != 0 || v < 1)
+				fprintf(stderr, Name ": bad SAFEMODE min=%s, ignoring\n",
+					w+4);
+			else
+				safemodeinfo.min = v;
+		} else if (strncasecmp(w, "max=", 4) == 0) {
+			v = strtoul(w+4, &ep, 10);
+			if (*ep != 0 || v < 1)
+				fprintf(stderr, Name ": bad SAFEMODE max=%s, ignoring\n",
+					w+4);
+			else
+				safemodeinfo.max = v;
+		} else
+			fprintf(stderr, Name ": unrecognised word on SAFEMODE line: %s\n",
+				w);
+	}
+	if (safemodeinfo.min > safemodeinfo.max) {
+		fprintf(stderr, Name ": SAFEMODE min= is more than max=, ignoring\n");
+		safemodeinfo.min = 0;
+	}
+}
+
 int loaded = 0;
 
 static char *conffile = NULL;
@@ -767,6 +873,12 @@ void load_conffile(void)
 		case AutoMode:
 			autoline(line);
 			break;
+		case Scrub:
+			scrubline(line);
+			break;
+		case SafeMode:
+			safemodeline(line);
+			break;
 		default:
 			fprintf(stderr, Name ": Unknown keyword %s\n", line);
 		}
@@ -804,6 +916,18 @@ char *conf_get_homehost(int *require_homehostp)
 	return home_host;
 }
 
+struct scrubinfo *conf_get_scrub(void)
+{
+	load_conffile();
+	return &scrubinfo;
+}
+
+struct safemodeinfo *conf_get_safemode(void)
+{
+	load_conffile();
+	return &safemodeinfo;
+}
+
 struct createinfo *conf_get_create_info(void)
 {
 	load_conffile();
@@ -75,7 +75,7 @@
  */
 
 /*
- * We select on /proc/mdstat and the named pipe.
+ * We poll /proc/mdstat, the control socket and its clients.
  * We create new arrays or updated version of arrays and slip
  * them into the head of the list, then signal 'monitor' via a pipe write.
  * 'monitor' will notice and place the old array on a return list.
@@ -104,8 +104,10 @@
 #endif
 #include	"mdadm.h"
 #include	"mdmon.h"
-#include	<sys/syscall.h>
 #include	<sys/socket.h>
+#include	<sys/eventfd.h>
+#include	<sys/select.h>
+#include	<poll.h>
 #include	<signal.h>
 
 static void close_aa(struct active_array *aa)
@@ -120,6 +122,8 @@ static void close_aa(struct active_array *aa)
 	close(aa->action_fd);
 	close(aa->info.state_fd);
 	close(aa->resync_start_fd);
+	if (aa->safe_mode_fd >= 0)
+		close(aa->safe_mode_fd);
 }
 
 static void free_aa(struct active_array *aa)
@@ -146,6 +150,7 @@ static struct active_array *duplicate_aa(struct active_array *aa)
 	*newa = *aa;
 	newa->next = NULL;
 	newa->replaces = NULL;
+	newa->watched = 0;
 	newa->info.next = NULL;
 
 	dp2 = &newa->info.devs;
@@ -167,9 +172,24 @@ static struct active_array *duplicate_aa(struct active_array *aa)
 
 static void wakeup_monitor(void)
 {
-	/* tgkill(getpid(), mon_tid, SIGUSR1); */
-	int pid = getpid();
-	syscall(SYS_tgkill, pid, mon_tid, SIGUSR1);
+	eventfd_write(monitor_event, 1);
+}
+
+static int missed_wakeup;
+static void wait_monitor(void)
+{
+	/* Wait for the monitor to tell us it has done something.
+	 * do_manager might have wanted to hear about it too, so
+	 * make sure it looks around before sleeping again.
+	 */
+	struct pollfd pfd;
+	eventfd_t cnt;
+
+	pfd.fd = manager_event;
+	pfd.events = POLLIN;
+	poll(&pfd, 1, -1);
+	eventfd_read(manager_event, &cnt);
+	missed_wakeup = 1;
 }
 
 static void remove_old(void)
@@ -197,7 +217,7 @@ static void replace_array(struct supertype *container,
 	remove_old();
 	while (pending_discard) {
 		while (discard_this == NULL)
-			sleep(1);
+			wait_monitor();
 		remove_old();
 	}
 	pending_discard = old;
@@ -207,9 +227,18 @@ static void replace_array(struct supertype *container,
 	wakeup_monitor();
 }
 
-struct metadata_update *update_queue = NULL;
-struct metadata_update *update_queue_handled = NULL;
+struct update_ring update_ring;
 struct metadata_update *update_queue_pending = NULL;
+volatile unsigned int ping_req, ping_ack;
+volatile int handoff;
+unsigned long takeover_usecs;
+
+static void free_update(struct metadata_update *this)
+{
+	free(this->buf);
+	free(this->space);
+	free(this);
+}
 
 static void free_updates(struct metadata_update **update)
 {
@@ -217,34 +246,75 @@ static void free_updates(struct metadata_update **update)
 		struct metadata_update *this = *update;
 
 		*update = this->next;
-		free(this->buf);
-		free(this->space);
-		free(this);
+		free_update(this);
 	}
 }
 
-void check_update_queue(struct supertype *container)
+static int updates_waiting(void)
 {
-	free_updates(&update_queue_handled);
+	/* Is the monitor yet to handle something we gave it? */
+	return update_ring.done != update_ring.head;
+}
 
-	if (update_queue == NULL &&
-	    update_queue_pending) {
-		update_queue = update_queue_pending;
-		update_queue_pending = NULL;
-		wakeup_monitor();
+void check_update_queue(void)
+{
+	/* Free what the monitor has finished with, and pass it
+	 * as much of what is pending as will fit.
+	 */
+	unsigned int tail = update_ring.tail;
+	unsigned int head = update_ring.head;
+	unsigned int done = update_ring.done;
+
+	__sync_synchronize();
+	for (; tail != done; tail++)
+		free_update(update_ring.slot[tail % UPDATE_SLOTS]);
+	update_ring.tail = tail;
+
+	if (!update_queue_pending)
+		return;
+	while (update_queue_pending && head - tail < UPDATE_SLOTS) {
+		struct metadata_update *mu = update_queue_pending;
+
+		update_queue_pending = mu->next;
+		mu->next = NULL;
+		update_ring.slot[head++ % UPDATE_SLOTS] = mu;
 	}
+	__sync_synchronize();
+	update_ring.head = head;
+	wakeup_monitor();
 }
 
-static void queue_metadata_update(struct metadata_update *mu)
+static void queue_metadata_update(struct supertype *container,
+				  struct metadata_update *mu)
 {
-	struct metadata_update **qp;
+	/* All containers share the ring, so note whose update it is */
+	struct metadata_update **qp, *m;
 
+	for (m = mu; m; m = m->next)
+		m->container = container;
 	qp = &update_queue_pending;
 	while (*qp)
 		qp = & ((*qp)->next);
 	*qp = mu;
 }
 
+void track_writes(struct supertype *container, int major, int minor)
+{
+	/* Ask the metadata handler to time writes to this device */
+	struct disk_latency *dl;
+
+	for (dl = container->write_lat; dl; dl = dl->next)
+		if (dl->major == major && dl->minor == minor)
+			return;
+	dl = calloc(1, sizeof(*dl));
+	if (!dl)
+		return;
+	dl->major = major;
+	dl->minor = minor;
+	dl->next = container->write_lat;
+	container->write_lat = dl;
+}
+
 static void add_disk_to_container(struct supertype *st, struct mdinfo *sd)
 {
 	int dfd;
@@ -265,6 +335,7 @@ static void add_disk_to_container(struct supertype *st, struct mdinfo *sd)
 
 	sd->next = st->devs;
 	st->devs = sd;
+	track_writes(st, sd->disk.major, sd->disk.minor);
 
 	sprintf(nm, "%d:%d", sd->disk.major, sd->disk.minor);
 	dfd = dev_open(nm, O_RDWR);
@@ -293,7 +364,7 @@ static void add_disk_to_container(struct supertype *st, struct mdinfo *sd)
 	st->update_tail = &update;
 	st->ss->add_to_super(st, &dk, dfd, NULL);
 	st->ss->write_init_super(st);
-	queue_metadata_update(update);
+	queue_metadata_update(st, update);
 	st->update_tail = NULL;
 }
 
@@ -322,7 +393,7 @@ static void remove_disk_from_container(struct supertype *st, struct mdinfo *sd)
 	 * but with 'remove' we don't ant to write to that device!
 	 */
 	st->ss->write_init_super(st);
-	queue_metadata_update(update);
+	queue_metadata_update(st, update);
 	st->update_tail = NULL;
 }
 
@@ -435,7 +506,7 @@ static void manage_member(struct mdstat_ent *mdstat,
 	 * could affect our decisions.
 	 */
 	if (a->check_degraded &&
-	    update_queue == NULL && update_queue_pending == NULL) {
+	    !updates_waiting() && update_queue_pending == NULL) {
 		struct metadata_update *updates = NULL;
 		struct mdinfo *newdev = NULL;
 		struct active_array *newa;
@@ -469,7 +540,7 @@ static void manage_member(struct mdstat_ent *mdstat,
 			}
 			disk_init_and_add(newd, d, newa);
 		}
-		queue_metadata_update(updates);
+		queue_metadata_update(a->container, updates);
 		updates = NULL;
 		replace_array(a->container, a, newa);
 		sysfs_set_str(&a->info, NULL, "sync_action", "recover");
@@ -526,7 +597,8 @@ static void manage_new(struct mdstat_ent *mdstat,
 
 	mdi = sysfs_read(-1, mdstat->devnum,
 			 GET_LEVEL|GET_CHUNK|GET_DISKS|GET_COMPONENT|
-			 GET_DEGRADED|GET_DEVS|GET_OFFSET|GET_SIZE|GET_STATE);
+			 GET_DEGRADED|GET_DEVS|GET_OFFSET|GET_SIZE|GET_STATE|
+			 GET_SAFEMODE);
 
 	new = malloc(sizeof(*new));
 
@@ -577,6 +649,17 @@ static void manage_new(struct mdstat_ent *mdstat,
 	new->resync_start_fd = sysfs_open(new->devnum, NULL, "resync_start");
 	new->metadata_fd = sysfs_open(new->devnum, NULL, "metadata_version");
 	new->sync_completed_fd = sysfs_open(new->devnum, NULL, "sync_completed");
+	/* If we are to adjust safe_mode_delay, start from what the array
+	 * has, and come back to that (or to SAFEMODE min=) when idle.
+	 * An array with safe mode turned off is left alone.
+	 */
+	new->safe_mode_fd = -1;
+	new->sm_delay = mdi->safe_mode_delay;
+	new->sm_min = safemode_conf->min ? safemode_conf->min : new->sm_delay;
+	if (safemode_conf->enabled && new->sm_delay && new->sm_min &&
+	    new->sm_min < safemode_conf->max && new->info.array.level > 0)
+		new->safe_mode_fd = sysfs_open(new->devnum, NULL,
+					       "safe_mode_delay");
 	dprintf("%s: inst: %d action: %d state: %d\n", __func__, atoi(inst),
 		new->action_fd, new->info.state_fd);
 
@@ -628,90 +711,732 @@ void manage(struct mdstat_ent *mdstat, struct supertype *container)
 	}
 }
 
-static void handle_message(struct supertype *container, struct metadata_update *msg)
+/* Clients of the control socket.  Each connection is read whenever
+ * it has something for us and its messages are handled in order,
+ * with the replies queued until the socket will take them.  So a
+ * client can send a stream of updates without waiting for each ack,
+ * and one that is slow or stuck doesn't hold up anyone else.
+ * A ping has to wait for the monitor to catch up; nothing more is
+ * read from that connection until it has been answered.
+ */
+enum conn_wait { CONN_READY, CONN_FLUSH, CONN_PING, CONN_UPDATE,
+		 CONN_HANDOFF };
+
+struct conn {
+	struct supertype *container;	/* whose socket it came in on */
+	int fd;
+	char *in;		/* received but not yet handled */
+	int inlen;
+	char *out;		/* replies not yet sent */
+	int outlen;
+	enum conn_wait wait;
+	int req;		/* the ping being waited on: 0 or -1 */
+	unsigned int ping;	/* ping_req to see in ping_ack */
+	struct metadata_update *update;	/* for CONN_UPDATE */
+	time_t idle;		/* when we last heard from it */
+	struct conn *next;
+};
+static struct conn *conns;
+static struct supertype *managed;	/* every container, for hand_off */
+
+#define CONN_TIMEOUT 3	/* seconds before hanging up on a quiet client */
+#define CONN_READ 65536
+
+static int queue_reply(struct conn *c, struct metadata_update *msg)
+{
+	struct metadata_update ack = { .len = 0 };
+
+	return encode_message(&c->out, &c->outlen, msg ? msg : &ack);
+}
+
+static int queue_caps(struct conn *c)
+{
+	/* Answer a ping with what we understand, see msg.h */
+	__u32 caps = MDMON_CAP_STATS | MDMON_CAP_HANDOFF;
+	struct metadata_update msg = {
+		.len = sizeof(caps),
+		.buf = (char *)&caps,
+	};
+
+	return queue_reply(c, &msg);
+}
+
+static void print_latency(FILE *f, char *what, char *name,
+			  struct latency *lat)
+{
+	fprintf(f, "%s %s count=%lu p50=%luus p99=%luus max=%luus\n",
+		what, name, lat->count,
+		latency_percentile(lat, 50), latency_percentile(lat, 99),
+		lat->max);
+}
+
+static int queue_stats(struct conn *c)
+{
+	/* Reply to a stats request with one line for each array and
+	 * each device.  The monitor may be updating these as we read
+	 * them, but they are only statistics.
+	 */
+	struct supertype *container = c->container;
+	struct metadata_update msg;
+	struct active_array *a;
+	struct disk_latency *dl;
+	char name[40];
+	size_t len = 0;
+	FILE *f;
+	int rv;
+
+	msg.buf = NULL;
+	f = open_memstream(&msg.buf, &len);
+	if (!f)
+		return queue_reply(c, NULL);
+	for (a = container->arrays; a; a = a->next)
+		if (a->container)
+			print_latency(f, "write-pending", a->info.sys_name,
+				      &a->wp_lat);
+	for (dl = container->write_lat; dl; dl = dl->next) {
+		sprintf(name, "%d:%d", dl->major, dl->minor);
+		print_latency(f, "metadata-write", name, &dl->lat);
+	}
+	fprintf(f, "metadata-writes %s %lu\n", container->devname,
+		container->metadata_writes);
+	fprintf(f, "monitor-wakeups %lu\nmonitor-reads %lu\n",
+		monitor_wakeups, monitor_reads);
+	if (takeover_usecs)
+		fprintf(f, "takeover %luus\n", takeover_usecs);
+	fclose(f);
+	msg.len = len;
+	rv = queue_reply(c, &msg);
+	free(msg.buf);
+	return rv;
+}
+
+static int handle_message(struct conn *c, struct metadata_update *msg)
 {
 	/* queue this metadata update through to the monitor */
 
 	struct metadata_update *mu;
 
-	if (msg->len <= 0)
-		while (update_queue_pending || update_queue) {
-			check_update_queue(container);
-			usleep(15*1000);
-		}
+	if (msg->len == MSG_STATS)
+		return queue_stats(c);
 
-	if (msg->len == 0) { /* ping_monitor */
-		int cnt;
-		
-		cnt = monitor_loop_cnt;
-		if (cnt & 1)
-			cnt += 2; /* wait until next pselect */
-		else
-			cnt += 3; /* wait for 2 pselects */
-		wakeup_monitor();
+	if (msg->len == MSG_HANDOFF) {
+		/* a new mdmon wants our arrays */
+		c->wait = CONN_HANDOFF;
+		return 0;
+	}
 
-		while (monitor_loop_cnt - cnt < 0)
-			usleep(10 * 1000);
-	} else if (msg->len == -1) { /* ping_manager */
-		struct mdstat_ent *mdstat = mdstat_read(1, 0);
+	if (msg->len == 0 || msg->len == -1) {
+		/* ping_monitor or ping_manager.  Either must
+		 * wait for queued updates to be handled first.
+		 */
+		c->wait = CONN_FLUSH;
+		c->req = msg->len;
+		return 0;
+	}
 
-		manage(mdstat, container);
-		free_mdstat(mdstat);
-	} else if (!sigterm) {
+	if (msg->len > 0 && !sigterm) {
 		mu = malloc(sizeof(*mu));
+		if (!mu) {
+			free(msg->buf);
+			return -1;
+		}
 		mu->len = msg->len;
 		mu->buf = msg->buf;
-		msg->buf = NULL;
 		mu->space = NULL;
 		mu->next = NULL;
-		if (container->ss->prepare_update)
-			container->ss->prepare_update(container, mu);
-		queue_metadata_update(mu);
+		/* prepare_update may replace buffers that the monitor
+		 * is using, so wait until it has nothing to do.
+		 */
+		c->update = mu;
+		c->wait = CONN_UPDATE;
+		return 0;
+	} else
+		/* not something we know about, or too late */
+		free(msg->buf);
+	return queue_reply(c, NULL);
+}
+
+static int handoff_fd(int *fds, int *nfds, int fd)
+{
+	if (fd < 0)
+		return -1;
+	fds[*nfds] = fd;
+	return (*nfds)++;
+}
+
+static void hand_off(struct conn *c)
+{
+	/* The monitor is frozen with everything written out.  Send
+	 * every array and its fds to the new mdmon on 'c', and if it
+	 * says it has them, leave without tidying anything up: the
+	 * pidfiles and sockets are already its, and the arrays must
+	 * be left just as they are.
+	 */
+	struct timeval tmo = { 5, 0 };
+	struct metadata_update msg;
+	struct supertype *container;
+	struct active_array *a;
+	struct mdinfo *d;
+	struct handoff *h;
+	struct handoff_container *hc;
+	struct handoff_array *ha;
+	struct handoff_disk *hd;
+	int *fds;
+	int nfds = 0;
+	int len = sizeof(*h);
+	char *p;
+
+	for (container = managed; container; container = container->next) {
+		if (container->stopped)
+			continue;
+		len += sizeof(*hc);
+		for (a = container->arrays; a; a = a->next) {
+			if (!a->container)
+				continue;
+			len += sizeof(*ha);
+			nfds += HO_FDS;
+			for (d = a->info.devs; d; d = d->next) {
+				len += sizeof(*hd);
+				nfds += 2;
+			}
+		}
+	}
+	msg.buf = calloc(1, len);
+	fds = calloc(nfds ? nfds : 1, sizeof(*fds));
+	if (!msg.buf || !fds)
+		goto out;
+	msg.len = len;
+
+	p = msg.buf;
+	h = (struct handoff *)p;
+	p += sizeof(*h);
+	h->magic = HANDOFF_MAGIC;
+	h->version = HANDOFF_VERSION;
+	h->info_size = sizeof(struct mdinfo);
+	nfds = 0;
+	for (container = managed; container; container = container->next) {
+		if (container->stopped)
+			continue;
+		h->containers++;
+		hc = (struct handoff_container *)p;
+		p += sizeof(*hc);
+		hc->devnum = container->devnum;
+		if (container->ss->generation) {
+			hc->has_generation = 1;
+			hc->generation = container->ss->generation(container);
+		}
+		for (a = container->arrays; a; a = a->next) {
+			if (!a->container)
+				continue;
+			hc->arrays++;
+			ha = (struct handoff_array *)p;
+			p += sizeof(*ha);
+			ha->info = a->info;
+			ha->devnum = a->devnum;
+			ha->fd[HO_STATE] = handoff_fd(fds, &nfds, a->info.state_fd);
+			ha->fd[HO_ACTION] = handoff_fd(fds, &nfds, a->action_fd);
+			ha->fd[HO_RESYNC_START] = handoff_fd(fds, &nfds,
+							     a->resync_start_fd);
+			ha->fd[HO_METADATA] = handoff_fd(fds, &nfds,
+							 a->metadata_fd);
+			ha->fd[HO_SYNC_COMPLETED] = handoff_fd(fds, &nfds,
+							       a->sync_completed_fd);
+			ha->fd[HO_SAFE_MODE] = handoff_fd(fds, &nfds,
+							  a->safe_mode_fd);
+			ha->last_checkpoint = a->last_checkpoint;
+			ha->prev_state = a->prev_state;
+			ha->prev_action = a->prev_action;
+			ha->check_degraded = a->check_degraded;
+			ha->sm_min = a->sm_min;
+			ha->sm_delay = a->sm_delay;
+			for (d = a->info.devs; d; d = d->next) {
+				ha->disks++;
+				hd = (struct handoff_disk *)p;
+				p += sizeof(*hd);
+				hd->info = *d;
+				hd->state_fd = handoff_fd(fds, &nfds, d->state_fd);
+				hd->recovery_fd = handoff_fd(fds, &nfds,
+							     d->recovery_fd);
+			}
+		}
 	}
+	h->fds = nfds;
+
+	/* Anything already queued for this client goes first, and
+	 * nothing may wait for ever while the arrays are unwatched.
+	 */
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) & ~O_NONBLOCK);
+	setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tmo, sizeof(tmo));
+	if (c->outlen && write(c->fd, c->out, c->outlen) != c->outlen)
+		goto out;
+	c->outlen = 0;
+	if (send_message(c->fd, &msg, 5) != 0 ||
+	    send_fds(c->fd, fds, nfds) != 0)
+		goto out;
+	free(msg.buf);
+	msg.buf = NULL;
+	if (receive_message(c->fd, &msg, 5) == 0) {
+		if (msg.len == 0) {
+			dprintf("mdmon: handed over, exiting\n");
+			exit(0);
+		}
+		free(msg.buf);
+	}
+	msg.buf = NULL;
+ out:
+	free(msg.buf);
+	free(fds);
+	dprintf("mdmon: handoff failed, carrying on\n");
 }
 
-void read_sock(struct supertype *container)
+static int handoff_get(int *fds, int nfds, int i)
 {
+	if (i < 0 || i >= nfds)
+		return -1;
+	return fds[i];
+}
+
+static struct active_array *adopt_array(struct supertype *container,
+					struct handoff_array *ha,
+					struct handoff_disk *hd,
+					int *fds, int nfds)
+{
+	/* Make an active_array from what the old mdmon was using */
+	struct active_array *new = calloc(1, sizeof(*new));
+	char inst[20];
+	int i;
+
+	if (!new)
+		return NULL;
+	new->info = ha->info;
+	new->info.devs = NULL;
+	new->info.next = NULL;
+	new->container = container;
+	new->devnum = ha->devnum;
+	new->info.state_fd = handoff_get(fds, nfds, ha->fd[HO_STATE]);
+	new->action_fd = handoff_get(fds, nfds, ha->fd[HO_ACTION]);
+	new->resync_start_fd = handoff_get(fds, nfds, ha->fd[HO_RESYNC_START]);
+	new->metadata_fd = handoff_get(fds, nfds, ha->fd[HO_METADATA]);
+	new->sync_completed_fd = handoff_get(fds, nfds,
+					     ha->fd[HO_SYNC_COMPLETED]);
+	new->safe_mode_fd = handoff_get(fds, nfds, ha->fd[HO_SAFE_MODE]);
+	new->last_checkpoint = ha->last_checkpoint;
+	new->prev_state = new->curr_state = new->next_state = ha->prev_state;
+	new->prev_action = new->curr_action = new->next_action =
+		ha->prev_action;
+	new->check_degraded = ha->check_degraded;
+	new->sm_min = ha->sm_min;
+	new->sm_delay = ha->sm_delay;
+
+	for (i = 0; i < ha->disks; i++) {
+		struct mdinfo *d = malloc(sizeof(*d));
+
+		if (!d)
+			goto abort;
+		*d = hd[i].info;
+		d->state_fd = handoff_get(fds, nfds, hd[i].state_fd);
+		d->recovery_fd = handoff_get(fds, nfds, hd[i].recovery_fd);
+		d->next = new->info.devs;
+		new->info.devs = d;
+	}
+
+	sprintf(inst, "%d", new->info.container_member);
+	if (!aa_ready(new) || container->ss->open_new(container, new, inst) < 0)
+		goto abort;
+	return new;
+ abort:
+	/* ->container is set, so the fds are left for our caller */
+	free_aa(new);
+	return NULL;
+}
+
+static int reload_container(struct supertype *container)
+{
+	/* The old mdmon has written the metadata since we loaded it */
+	struct supertype st = *container;
+	int fd = open_dev(container->devnum);
+
+	if (fd < 0)
+		return -1;
+	st.sb = NULL;
+	if (container->ss->load_super(&st, fd, container->devname)) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	container->ss->free_super(container);
+	container->sb = st.sb;
+	container->loaded_container = st.loaded_container;
+	return 0;
+}
+
+int take_over(struct supertype *containers, int sock)
+{
+	/* Ask the mdmon at the other end of 'sock' for its arrays
+	 * (see hand_off).  The metadata itself isn't sent: we loaded it
+	 * already and only read it again if it has changed since.
+	 * Returns 0 if we have the arrays and it is going away, or -1
+	 * if it still has them, which includes when it is too old to
+	 * understand MSG_HANDOFF.
+	 */
+	struct metadata_update msg = { .len = MSG_HANDOFF };
+	struct timespec start, end;
+	struct handoff h;
+	struct handoff_container hc;
+	struct handoff_array *ha;
+	struct handoff_disk *hd;
+	struct supertype *container;
+	struct active_array *a, *adopted = NULL;
+	int *fds = NULL;
+	char *p, *e;
+	int i, j, caps;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	caps = monitor_caps(sock);
+	if (caps <= 0 || !(caps & MDMON_CAP_HANDOFF))
+		return -1;
+	if (send_message(sock, &msg, 20) != 0 ||
+	    receive_message(sock, &msg, 20) != 0)
+		return -1;
+	if (msg.len < (int)sizeof(h)) {
+		/* not what we asked for */
+		free(msg.buf);
+		return -1;
+	}
+	memcpy(&h, msg.buf, sizeof(h));
+	if (h.magic != HANDOFF_MAGIC || h.version != HANDOFF_VERSION ||
+	    h.info_size != sizeof(struct mdinfo) ||
+	    h.fds < 0 || h.fds > msg.len / (int)sizeof(int)) {
+		free(msg.buf);
+		return -1;
+	}
+	fds = calloc(h.fds ? h.fds : 1, sizeof(*fds));
+	if (!fds || receive_fds(sock, fds, h.fds, 20) != 0) {
+		free(fds);
+		free(msg.buf);
+		return -1;
+	}
+
+	p = msg.buf + sizeof(h);
+	e = msg.buf + msg.len;
+	for (i = 0; i < h.containers; i++) {
+		if (e - p < (int)sizeof(hc))
+			goto abort;
+		memcpy(&hc, p, sizeof(hc));
+		p += sizeof(hc);
+		for (container = containers; container;
+		     container = container->next)
+			if (container->devnum == hc.devnum)
+				break;
+		if (!container) {
+			dprintf("mdmon: takeover: %s is not ours\n",
+				devnum2devname(hc.devnum));
+			goto abort;
+		}
+		if ((!hc.has_generation || !container->ss->generation ||
+		     container->ss->generation(container) != hc.generation) &&
+		    reload_container(container) != 0)
+			goto abort;
+		for (j = 0; j < hc.arrays; j++) {
+			ha = (struct handoff_array *)p;
+			hd = (struct handoff_disk *)(ha + 1);
+			if (e - p < (int)sizeof(*ha) || ha->disks < 0 ||
+			    (e - (char *)hd) / (int)sizeof(*hd) < ha->disks)
+				goto abort;
+			p = (char *)(hd + ha->disks);
+			a = adopt_array(container, ha, hd, fds, h.fds);
+			if (!a)
+				goto abort;
+			a->next = adopted;
+			adopted = a;
+		}
+	}
+	free(msg.buf);
+	msg.buf = NULL;
+	if (ack(sock, 20) != 0)
+		goto abort;
+
+	/* Nothing is watching the arrays until our monitor starts */
+	while ((a = adopted) != NULL) {
+		adopted = a->next;
+		a->next = a->container->arrays;
+		a->container->arrays = a;
+	}
+	free(fds);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	takeover_usecs = (end.tv_sec - start.tv_sec) * 1000000 +
+		(end.tv_nsec - start.tv_nsec) / 1000;
+	dprintf("mdmon: took over in %luus\n", takeover_usecs);
+	return 0;
+
+ abort:
+	while ((a = adopted) != NULL) {
+		adopted = a->next;
+		free_aa(a);
+	}
+	for (i = 0; i < h.fds; i++)
+		close(fds[i]);
+	free(fds);
+	free(msg.buf);
+	return -1;
+}
+
+static int conn_ready(struct conn *c)
+{
+	/* Has whatever 'c' is waiting for happened yet? */
+	if (c->wait == CONN_FLUSH) {
+		if (update_queue_pending || updates_waiting())
+			return 0;
+		if (c->req == -1) {
+			struct mdstat_ent *mdstat = mdstat_read(1, 0);
+
+			manage(mdstat, c->container);
+			free_mdstat(mdstat);
+			c->wait = CONN_READY;
+			return queue_reply(c, NULL) == 0;
+		}
+		c->ping = ++ping_req;
+		c->wait = CONN_PING;
+		wakeup_monitor();
+	}
+	if (c->wait == CONN_PING) {
+		if ((int)(ping_ack - c->ping) < 0)
+			return 0;
+		c->wait = CONN_READY;
+		return queue_caps(c) == 0;
+	}
+	if (c->wait == CONN_UPDATE) {
+		struct supertype *container = c->container;
+
+		if (update_queue_pending || updates_waiting())
+			return 0;
+		if (sigterm)
+			free_update(c->update);
+		else {
+			if (container->ss->prepare_update)
+				container->ss->prepare_update(container,
+							      c->update);
+			queue_metadata_update(container, c->update);
+		}
+		c->update = NULL;
+		c->wait = CONN_READY;
+		return queue_reply(c, NULL) == 0;
+	}
+	if (c->wait == CONN_HANDOFF) {
+		if (update_queue_pending || updates_waiting()) {
+			if (handoff == HANDOFF_FROZEN) {
+				/* the monitor must see to them first */
+				handoff = HANDOFF_REQ;
+				wakeup_monitor();
+			}
+			return 0;
+		}
+		if (!handoff) {
+			handoff = HANDOFF_REQ;
+			wakeup_monitor();
+		}
+		if (handoff != HANDOFF_FROZEN)
+			return 0;
+		hand_off(c);
+		/* still here, so we keep the arrays */
+		handoff = 0;
+		wakeup_monitor();
+		return -1;
+	}
+	return 1;
+}
+
+static void accept_conns(struct supertype *container)
+{
+	struct conn *c;
 	int fd;
+
+	while ((fd = accept(container->sock, NULL, NULL)) >= 0) {
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		c->container = container;
+		c->fd = fd;
+		c->idle = time(0);
+		c->next = conns;
+		conns = c;
+	}
+}
+
+static int service_conn(struct conn *c)
+{
+	/* Read what we can, handle every message we have until one
+	 * needs to wait, and send what we can.
+	 * Returns -1 when it is time to hang up.
+	 */
 	struct metadata_update msg;
-	int terminate = 0;
-	long fl;
-	int tmo = 3; /* 3 second timeout before hanging up the socket */
+	char *b;
+	int n;
 
-	fd = accept(container->sock, NULL, NULL);
-	if (fd < 0)
-		return;
+	if (c->container->stopped)
+		return -1;
 
-	fl = fcntl(fd, F_GETFL, 0);
-	fl |= O_NONBLOCK;
-	fcntl(fd, F_SETFL, fl);
+	if (c->wait == CONN_READY) {
+		b = realloc(c->in, c->inlen + CONN_READ);
+		if (!b)
+			return -1;
+		c->in = b;
+		n = read(c->fd, c->in + c->inlen, CONN_READ);
+		if (n == 0)
+			return -1;
+		if (n > 0) {
+			c->inlen += n;
+			c->idle = time(0);
+		} else if (errno != EAGAIN && errno != EINTR)
+			return -1;
+	}
 
-	do {
-		msg.buf = NULL;
+	while ((n = conn_ready(c)) > 0) {
+		n = decode_message(c->in, c->inlen, &msg);
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		c->inlen -= n;
+		memmove(c->in, c->in + n, c->inlen);
+		if (handle_message(c, &msg) < 0)
+			return -1;
+	}
+	if (n < 0)
+		return -1;
 
-		/* read and validate the message */
-		if (receive_message(fd, &msg, tmo) == 0) {
-			handle_message(container, &msg);
-			if (ack(fd, tmo) < 0)
-				terminate = 1;
-		} else
-			terminate = 1;
+	while (c->outlen) {
+		n = write(c->fd, c->out, c->outlen);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			break;
+		if (n <= 0)
+			return -1;
+		c->outlen -= n;
+		memmove(c->out, c->out + n, c->outlen);
+		c->idle = time(0);
+	}
 
-	} while (!terminate);
+	if (c->wait == CONN_READY && time(0) >= c->idle + CONN_TIMEOUT)
+		return -1;
+	return 0;
+}
 
-	close(fd);
+static void service_conns(void)
+{
+	struct conn *c, **cp = &conns;
+
+	while ((c = *cp) != NULL) {
+		if (service_conn(c) == 0) {
+			cp = &c->next;
+			continue;
+		}
+		*cp = c->next;
+		close(c->fd);
+		if (c->update)
+			free_update(c->update);
+		free(c->in);
+		free(c->out);
+		free(c);
+	}
+}
+
+static void wait_manager(struct supertype *containers, const sigset_t *set)
+{
+	/* Sleep until /proc/mdstat changes, someone connects, a client
+	 * can be read from or written to, the monitor has something for
+	 * us, or a client has been quiet for too long.
+	 * While an update is happening nothing can be done about
+	 * mdstat, so it is ignored.
+	 */
+	static struct pollfd *pfd;
+	static int npfd;
+	struct timespec ts, *tsp = NULL;
+	struct supertype *container;
+	struct conn *c;
+	time_t now = time(0);
+	long tmo = -1;
+	int n = 2;
+
+	for (container = containers; container; container = container->next)
+		n++;
+	for (c = conns; c; c = c->next)
+		n++;
+	if (n > npfd) {
+		struct pollfd *p = realloc(pfd, n * sizeof(*pfd));
+		if (p) {
+			pfd = p;
+			npfd = n;
+		}
+	}
+	if (!pfd)
+		return;
+
+	n = 0;
+	pfd[n].fd = manager_event;
+	pfd[n++].events = POLLIN;
+	for (container = containers; container; container = container->next) {
+		pfd[n].fd = container->sock;
+		pfd[n++].events = POLLIN;
+	}
+	if (!updates_waiting() && !handoff)
+		mdstat_pollfd(&pfd[n++]);
+	for (c = conns; c && n < npfd; c = c->next) {
+		pfd[n].fd = c->fd;
+		pfd[n].events = 0;
+		if (c->wait == CONN_READY) {
+			pfd[n].events |= POLLIN;
+			if (tmo < 0 || c->idle + CONN_TIMEOUT - now < tmo)
+				tmo = c->idle + CONN_TIMEOUT - now;
+		}
+		if (c->outlen)
+			pfd[n].events |= POLLOUT;
+		if (!pfd[n].events)
+			/* waiting for the monitor */
+			pfd[n].fd = -1;
+		n++;
+	}
+	if (c)
+		/* no room to watch everyone, so keep checking */
+		tmo = 0;
+	if (tmo >= 0) {
+		ts.tv_sec = tmo > 0 ? tmo : 0;
+		ts.tv_nsec = 0;
+		tsp = &ts;
+	}
+	ppoll(pfd, n, tsp, set);
+}
+
+static void stop_container(struct supertype *container)
+{
+	/* The monitor has finished with this container and removed
+	 * its pidfile and socket name.  It is left on the list as the
+	 * monitor may still be looking at it, but we stop listening.
+	 */
+	if (container->sock >= 0)
+		close(container->sock);
+	container->sock = -1;
 }
 
 int exit_now = 0;
 int manager_ready = 0;
-void do_manager(struct supertype *container)
+void do_manager(struct supertype *containers)
 {
+	/* One manager looks after every container: /proc/mdstat is
+	 * read once for all of them, and all their sockets are served
+	 * from the same loop.
+	 */
+	struct supertype *container;
 	struct mdstat_ent *mdstat;
 	sigset_t set;
+	eventfd_t cnt;
 
 	sigprocmask(SIG_UNBLOCK, NULL, &set);
-	sigdelset(&set, SIGUSR1);
 	sigdelset(&set, SIGTERM);
+	managed = containers;
 
 	do {
 
@@ -720,30 +1445,46 @@ void do_manager(struct supertype *container)
 
 		/* Can only 'manage' things if 'monitor' is not making
 		 * structural changes to metadata, so need to check
-		 * update_queue
+		 * update_ring.  Nor while handing over, as the monitor
+		 * won't answer.
 		 */
-		if (update_queue == NULL) {
+		if (!updates_waiting() && !handoff) {
 			mdstat = mdstat_read(1, 0);
 
-			manage(mdstat, container);
-
-			read_sock(container);
+			for (container = containers; container;
+			     container = container->next)
+				if (!container->stopped)
+					manage(mdstat, container);
 
 			free_mdstat(mdstat);
 		}
+		for (container = containers; container;
+		     container = container->next)
+			if (container->stopped)
+				stop_container(container);
+			else
+				accept_conns(container);
+		/* Clients are read even while the monitor is busy, but
+		 * an update any of them sends waits in CONN_UPDATE until
+		 * the ring is empty, as prepare_update can't share the
+		 * metadata with process_update.
+		 */
+		service_conns();
+
 		remove_old();
 
-		check_update_queue(container);
+		check_update_queue();
 
 		manager_ready = 1;
 
 		if (sigterm)
 			wakeup_monitor();
 
-		if (update_queue == NULL)
-			mdstat_wait_fd(container->sock, &set);
+		if (missed_wakeup)
+			/* the monitor may want something; look again */
+			missed_wakeup = 0;
 		else
-			/* If an update is happening, just wait for signal */
-			pselect(0, NULL, NULL, NULL, NULL, &set);
+			wait_manager(containers, &set);
+		eventfd_read(manager_event, &cnt);
 	} while(1);
 }
@@ -38,6 +38,15 @@
  *  UUID       -  uuid of the array
  *  path       -  path where device created: /dev/md/home
  *
+ * An array being assembled by --incremental may be followed by a line
+ * for each device added to it so far, starting '+', giving what was
+ * found in its superblock: device number, role, events, disk state,
+ * and the level, raid-disks, layout, array state and working-disks
+ * that it records.  While the array isn't running nothing can write
+ * to these devices, so count_active can use these lines rather than
+ * loading every superblock each time another device arrives.
+ * Older mdadm ignores such lines.
+ *
  * The best place for the mapfile wold be /var/run/mdadm/map.  However
  * it is needed during initramfs early-boot, and /var/run doesn't exist there
  * and certainly doesn't persist through to normal boot.
@@ -58,21 +67,42 @@
 #define MAP_NEW 1
 #define MAP_LOCK 2
 #define MAP_DIRNAME 3
+#define MAP_DB 4
+#define MAP_DB_NEW 5
+#define MAP_LOG 6
+#define MAP_LOG_NEW 7
 #define mapnames(dir, base) { \
 
-char *mapname[4] = {
-	MAP_DIR "/" MAP_FILE,
-	MAP_DIR "/" MAP_FILE ".new",
-	MAP_DIR "/" MAP_FILE ".lock",
-	MAP_DIR
-};
+char mapname[8][PATH_MAX];
 
 int mapmode[3] = { O_RDONLY, O_RDWR|O_CREAT, O_RDWR|O_CREAT|O_TRUNC };
 char *mapsmode[3] = { "r", "w", "w"};
 
+static void set_mapnames(void)
+{
+	/* The names are fixed at compile time, apart from
+	 * the root they are found under (see mdadm_root()).
+	 */
+	char *root = mdadm_root();
+
+	if (mapname[MAP_READ][0])
+		return;
+	sprintf(mapname[MAP_READ], "%s%s/%s", root, MAP_DIR, MAP_FILE);
+	sprintf(mapname[MAP_NEW], "%s%s/%s.new", root, MAP_DIR, MAP_FILE);
+	sprintf(mapname[MAP_LOCK], "%s%s/%s.lock", root, MAP_DIR, MAP_FILE);
+	sprintf(mapname[MAP_DIRNAME], "%s%s", root, MAP_DIR);
+	sprintf(mapname[MAP_DB], "%s%s/%s.db", root, MAP_DIR, MAP_FILE);
+	sprintf(mapname[MAP_DB_NEW], "%s%s/%s.db.new", root, MAP_DIR, MAP_FILE);
+	sprintf(mapname[MAP_LOG], "%s%s/%s.log", root, MAP_DIR, MAP_FILE);
+	sprintf(mapname[MAP_LOG_NEW], "%s%s/%s.log.new", root, MAP_DIR,
+		MAP_FILE);
+}
+
 FILE *open_map(int modenum)
 {
 	int fd;
+
+	set_mapnames();
 	if ((mapmode[modenum] & O_CREAT))
 		/* Attempt to create directory, don't worry about
 		 * failure.
@@ -84,15 +114,93 @@ FILE *open_map(int modenum)
 	return NULL;
 }
 
-int map_write(struct map_ent *mel)
+/* Text has to be parsed, and rewriting all of it means that only one
+ * process can change the map at a time.  So the map is also kept as
+ * fixed size binary records in two more files:
+ *  map.db   -  the map as it was when "map" was last written,
+ *  map.log  -  changes since then, one record appended for each.
+ * Each starts with a header giving a generation number.
+ * Any number of processes may append to the log at once, each holding
+ * a shared flock on it.  Whoever can then get an exclusive flock
+ * without waiting folds the log into a new map.db and "map", and
+ * starts an empty log with the next generation (map_fold), so "map"
+ * is up to date whenever nothing is changing it.
+ * Readers take no lock.  They read map.db and then map.log, and start
+ * again if the generations differ as the log was folded in between.
+ * If "map" isn't the file that was written with map.db, something
+ * else - an older mdadm - wrote it, and it is believed instead.
+ * These files never leave the machine, so are in host byte order.
+ */
+#define MAP_MAGIC	0x6d617062
+#define MAP_READ_TRIES	10
+#define MAP_LOG_MAX	256	/* records, before appenders wait to fold */
+
+struct map_hdr {
+	__u32	magic;
+	__u32	recsize;	/* sizeof(struct map_rec) */
+	__u64	gen;
+	__u64	text_ino;	/* of the "map" written with this generation */
+};
+
+enum map_op { MAP_ARRAY = 1, MAP_DELETE, MAP_MEMBER, MAP_FORGET };
+
+struct map_rec {
+	__u32	op;
+	__s32	devnum;
+	/* MAP_ARRAY */
+	__s32	uuid[4];
+	char	metadata[20];
+	char	path[200];
+	/* MAP_MEMBER and MAP_FORGET */
+	__s32	major, minor;
+	__s32	role, state;
+	__u64	events;
+	__s32	level, raid_disks, layout;
+	__s32	array_state, working_disks;
+};
+
+static void map_rec_init(struct map_rec *r, int op, int devnum)
+{
+	memset(r, 0, sizeof(*r));
+	r->op = op;
+	r->devnum = devnum;
+}
+
+static void map_rec_array(struct map_rec *r, int devnum, char *metadata,
+			  int uuid[4], char *path)
+{
+	map_rec_init(r, MAP_ARRAY, devnum);
+	strncpy(r->metadata, metadata, sizeof(r->metadata) - 1);
+	memcpy(r->uuid, uuid, 16);
+	if (path)
+		strncpy(r->path, path, sizeof(r->path) - 1);
+}
+
+static void map_rec_member(struct map_rec *r, struct map_member *mm)
 {
+	r->major = mm->major;
+	r->minor = mm->minor;
+	r->role = mm->role;
+	r->state = mm->state;
+	r->events = mm->events;
+	r->level = mm->level;
+	r->raid_disks = mm->raid_disks;
+	r->layout = mm->layout;
+	r->array_state = mm->array_state;
+	r->working_disks = mm->working_disks;
+}
+
+static int write_text(struct map_ent *mel, struct stat *stb)
+{
+	/* Write "map" as map.new, for the caller to rename */
+	struct map_member *mm;
 	FILE *f;
 	int err;
 
 	f = open_map(MAP_NEW);
 
 	if (!f)
-		return 0;
+		return -1;
 	for (; mel; mel = mel->next) {
 		if (mel->bad)
 			continue;
@@ -104,41 +212,301 @@ int map_write(struct map_ent *mel)
 		fprintf(f, "%08x:%08x:%08x:%08x ", mel->uuid[0],
 			mel->uuid[1], mel->uuid[2], mel->uuid[3]);
 		fprintf(f, "%s\n", mel->path?:"");
+		for (mm = mel->members; mm; mm = mm->next)
+			fprintf(f, "+ %d:%d %d %llu %x %d %d %d %x %d\n",
+				mm->major, mm->minor, mm->role, mm->events,
+				mm->state, mm->level, mm->raid_disks,
+				mm->layout, mm->array_state,
+				mm->working_disks);
+	}
+	fflush(f);
+	err = ferror(f) || fstat(fileno(f), stb) != 0;
+	fclose(f);
+	if (err) {
+		unlink(mapname[MAP_NEW]);
+		return -1;
+	}
+	return 0;
+}
+
+static int write_db(struct map_ent *mel, struct map_hdr *hdr)
+{
+	struct map_member *mm;
+	struct map_rec r;
+	FILE *f;
+	int fd, err;
+
+	fd = open(mapname[MAP_DB_NEW], O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0)
+		return -1;
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(mapname[MAP_DB_NEW]);
+		return -1;
+	}
+	fwrite(hdr, sizeof(*hdr), 1, f);
+	for (; mel; mel = mel->next) {
+		if (mel->bad)
+			continue;
+		map_rec_array(&r, mel->devnum, mel->metadata, mel->uuid,
+			      mel->path);
+		fwrite(&r, sizeof(r), 1, f);
+		for (mm = mel->members; mm; mm = mm->next) {
+			map_rec_init(&r, MAP_MEMBER, mel->devnum);
+			map_rec_member(&r, mm);
+			fwrite(&r, sizeof(r), 1, f);
+		}
 	}
 	fflush(f);
 	err = ferror(f);
 	fclose(f);
 	if (err) {
-		unlink(mapname[1]);
-		return 0;
+		unlink(mapname[MAP_DB_NEW]);
+		return -1;
 	}
-	return rename(mapname[1],
-		      mapname[0]) == 0;
+	return 0;
 }
 
+static int map_save(struct map_ent *mel, __u64 gen)
+{
+	/* Write generation 'gen' of the map with an empty log.
+	 * The caller holds map.log exclusively.  The order of the
+	 * renames means readers see the generations differ until
+	 * all three are in place.
+	 */
+	struct map_hdr hdr;
+	struct stat stb;
+	int fd;
 
-static FILE *lf = NULL;
-int map_lock(struct map_ent **melp)
+	if (write_text(mel, &stb) != 0)
+		return -1;
+	hdr.magic = MAP_MAGIC;
+	hdr.recsize = sizeof(struct map_rec);
+	hdr.gen = gen;
+	hdr.text_ino = stb.st_ino;
+	if (write_db(mel, &hdr) != 0) {
+		unlink(mapname[MAP_NEW]);
+		return -1;
+	}
+	fd = open(mapname[MAP_LOG_NEW], O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0 || write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		if (fd >= 0)
+			close(fd);
+		unlink(mapname[MAP_LOG_NEW]);
+		unlink(mapname[MAP_DB_NEW]);
+		unlink(mapname[MAP_NEW]);
+		return -1;
+	}
+	close(fd);
+	if (rename(mapname[MAP_DB_NEW], mapname[MAP_DB]) != 0 ||
+	    rename(mapname[MAP_NEW], mapname[MAP_READ]) != 0 ||
+	    rename(mapname[MAP_LOG_NEW], mapname[MAP_LOG]) != 0)
+		return -1;
+	return 0;
+}
+
+static int map_open_log(int lock)
 {
-	while (lf == NULL) {
-		struct stat buf;
-		lf = open_map(MAP_LOCK);
-		if (lf == NULL)
+	/* Open map.log and flock it, making sure it is still
+	 * the log and not one that was folded while we waited.
+	 */
+	struct stat stb;
+	int fd;
+
+	set_mapnames();
+	while (1) {
+		(void)mkdir(mapname[MAP_DIRNAME], 0755);
+		fd = open(mapname[MAP_LOG], O_RDWR|O_APPEND|O_CREAT, 0600);
+		if (fd < 0)
+			return -1;
+		if (flock(fd, lock) != 0) {
+			close(fd);
+			return -1;
+		}
+		if (fstat(fd, &stb) == 0 && stb.st_nlink > 0)
+			return fd;
+		close(fd);
+	}
+}
+
+static int map_hdr_ok(int fd, struct map_hdr *hdr)
+{
+	return pread(fd, hdr, sizeof(*hdr), 0) == sizeof(*hdr) &&
+		hdr->magic == MAP_MAGIC &&
+		hdr->recsize == sizeof(struct map_rec);
+}
+
+static int map_log_ok(int fd, struct map_hdr *hdr)
+{
+	/* Does this log go with the "map" that is there now? */
+	struct stat stb;
+
+	return map_hdr_ok(fd, hdr) &&
+		stat(mapname[MAP_READ], &stb) == 0 &&
+		stb.st_ino == hdr->text_ino;
+}
+
+static __u64 map_next_gen(struct map_hdr *hdr, int ok)
+{
+	/* Generations only need to differ, but count up where we can */
+	if (ok)
+		return hdr->gen + 1;
+	return (__u64)time(0) << 20;
+}
+
+static void map_apply(struct map_ent **melp, struct map_rec *r, int db);
+
+static int map_load(int fd, struct map_hdr *hdr, struct map_ent **melp,
+		    int db)
+{
+	/* Apply the records in map.db or map.log to *melp.  One that
+	 * is still being appended is left out.
+	 */
+	struct map_rec r[32];
+	off_t off = sizeof(*hdr);
+	int n, i;
+
+	if (!map_hdr_ok(fd, hdr))
+		return -1;
+	while ((n = pread(fd, r, sizeof(r), off)) >= (int)sizeof(r[0])) {
+		n /= sizeof(r[0]);
+		for (i = 0; i < n; i++)
+			map_apply(melp, &r[i], db);
+		off += n * sizeof(r[0]);
+	}
+	return 0;
+}
+
+static void map_read_text(struct map_ent **melp, int rebuild);
+
+static int map_fold(int fd)
+{
+	/* We hold map.log exclusively.  Make the next generation from
+	 * map.db (or "map") and the log.  If the log doesn't go with
+	 * "map", start again from "map".
+	 */
+	struct map_ent *map = NULL;
+	struct map_hdr hdr, dbh;
+	int ok = map_log_ok(fd, &hdr);
+	int dfd;
+	int rv;
+
+	if (ok) {
+		dfd = open(mapname[MAP_DB], O_RDONLY);
+		if (dfd < 0 || map_load(dfd, &dbh, &map, 1) != 0 ||
+		    dbh.gen != hdr.gen) {
+			map_free(map);
+			map = NULL;
+			map_read_text(&map, 0);
+		}
+		if (dfd >= 0)
+			close(dfd);
+		map_load(fd, &hdr, &map, 0);
+	} else
+		map_read_text(&map, 0);
+	rv = map_save(map, map_next_gen(&hdr, ok));
+	map_free(map);
+	return rv;
+}
+
+static int map_append(struct map_rec *r)
+{
+	struct map_hdr hdr;
+	struct stat stb;
+	int fd, rv;
+
+	while (1) {
+		fd = map_open_log(LOCK_SH);
+		if (fd < 0)
 			return -1;
-		if (flock(fileno(lf), LOCK_EX) != 0) {
-			fclose(lf);
-			lf = NULL;
+		if (map_log_ok(fd, &hdr))
+			break;
+		/* No log yet, or "map" has been rewritten since */
+		close(fd);
+		if (access(mapname[MAP_READ], F_OK) != 0)
+			RebuildMap();
+		fd = map_open_log(LOCK_EX);
+		if (fd < 0)
 			return -1;
+		if (!map_log_ok(fd, &hdr) && map_fold(fd) != 0) {
+			close(fd);
+			return -1;
+		}
+		close(fd);
+	}
+	rv = write(fd, r, sizeof(*r)) == sizeof(*r) ? 0 : -1;
+
+	/* Fold the log now if no-one else is appending to it, or if
+	 * it has got long enough that we should wait for them.
+	 * If someone else folds it first, that includes our record.
+	 */
+	if (rv == 0 && fstat(fd, &stb) == 0 &&
+	    flock(fd, stb.st_size < MAP_LOG_MAX * (off_t)sizeof(*r)
+		  ? LOCK_EX|LOCK_NB : LOCK_EX) == 0 &&
+	    fstat(fd, &stb) == 0 && stb.st_nlink > 0)
+		map_fold(fd);
+	close(fd);
+	return rv;
+}
+
+int map_write(struct map_ent *mel)
+{
+	/* Replace the whole map with 'mel' */
+	struct map_hdr hdr;
+	int fd, rv;
+
+	fd = map_open_log(LOCK_EX);
+	if (fd < 0)
+		return 0;
+	rv = map_save(mel, map_next_gen(&hdr, map_hdr_ok(fd, &hdr)));
+	close(fd);
+	return rv == 0;
+}
+
+
+static FILE *lf = NULL;
+static FILE *alf = NULL;
+static char alf_name[PATH_MAX+40];
+
+static FILE *lock_file(char *name)
+{
+	while (1) {
+		struct stat buf;
+		FILE *f;
+		int fd;
+
+		(void)mkdir(mapname[MAP_DIRNAME], 0755);
+		fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0600);
+		if (fd < 0)
+			return NULL;
+		f = fdopen(fd, "w");
+		if (f == NULL) {
+			close(fd);
+			return NULL;
 		}
-		if (fstat(fileno(lf), &buf) != 0 ||
-		    buf.st_nlink == 0) {
-			/* The owner of the lock unlinked it,
-			 * so we have a lock on a stale file,
-			 * try again
-			 */
-			fclose(lf);
-			lf = NULL;
+		if (flock(fileno(f), LOCK_EX) != 0) {
+			fclose(f);
+			return NULL;
 		}
+		if (fstat(fileno(f), &buf) == 0 &&
+		    buf.st_nlink > 0)
+			return f;
+		/* The owner of the lock unlinked it,
+		 * so we have a lock on a stale file,
+		 * try again
+		 */
+		fclose(f);
+	}
+}
+
+int map_lock(struct map_ent **melp)
+{
+	set_mapnames();
+	if (lf == NULL) {
+		lf = lock_file(mapname[MAP_LOCK]);
+		if (lf == NULL)
+			return -1;
 	}
 	if (*melp)
 		map_free(*melp);
@@ -159,6 +527,78 @@ void map_unlock(struct map_ent **melp)
 	lf = NULL;
 }
 
+int map_lock_array(struct map_ent **melp, int uuid[4])
+{
+	/* Like map_lock, but only keeps out others who are working
+	 * on the array with this uuid.  Changes to the map don't
+	 * need map_lock, just choosing names and numbers for arrays.
+	 */
+	set_mapnames();
+	if (alf == NULL) {
+		snprintf(alf_name, sizeof(alf_name), "%s-%08x%08x%08x%08x",
+			 mapname[MAP_LOCK], uuid[0], uuid[1], uuid[2], uuid[3]);
+		alf = lock_file(alf_name);
+		if (alf == NULL)
+			return -1;
+	}
+	if (*melp)
+		map_free(*melp);
+	map_read(melp);
+	return 0;
+}
+
+void map_unlock_array(struct map_ent **melp)
+{
+	if (alf) {
+		unlink(alf_name);
+		fclose(alf);
+	}
+	alf = NULL;
+}
+
+/* map_by_uuid and map_by_devnum use hash chains through the list,
+ * made when first needed and forgotten whenever the list changes.
+ */
+#define MAP_HASH 64
+static struct map_ent *hashed;
+static struct map_ent *uuid_hash[MAP_HASH], *devnum_hash[MAP_HASH];
+
+static int hash_uuid(int uuid[4])
+{
+	return (unsigned)(uuid[0] ^ uuid[1] ^ uuid[2] ^ uuid[3]) % MAP_HASH;
+}
+
+static int hash_devnum(int devnum)
+{
+	return (unsigned)devnum % MAP_HASH;
+}
+
+static void map_index(struct map_ent *map)
+{
+	/* Keep the list order along each chain, so the same entry
+	 * is found as by walking the list.
+	 */
+	struct map_ent *me, **mep;
+
+	if (map && map == hashed)
+		return;
+	memset(uuid_hash, 0, sizeof(uuid_hash));
+	memset(devnum_hash, 0, sizeof(devnum_hash));
+	for (me = map; me; me = me->next) {
+		for (mep = &uuid_hash[hash_uuid(me->uuid)]; *mep;
+		     mep = &(*mep)->unext)
+			;
+		*mep = me;
+		me->unext = NULL;
+		for (mep = &devnum_hash[hash_devnum(me->devnum)]; *mep;
+		     mep = &(*mep)->dnext)
+			;
+		*mep = me;
+		me->dnext = NULL;
+	}
+	hashed = map;
+}
+
 void map_add(struct map_ent **melp,
 	    int devnum, char *metadata, int uuid[4], char *path)
 {
@@ -170,10 +610,153 @@ void map_add(struct map_ent **melp,
 	me->path = path ? strdup(path) : NULL;
 	me->next = *melp;
 	me->bad = 0;
+	me->members = NULL;
 	*melp = me;
+	hashed = NULL;
 }
 
-void map_read(struct map_ent **melp)
+static void map_free_members(struct map_ent *me)
+{
+	while (me->members) {
+		struct map_member *mm = me->members;
+		me->members = mm->next;
+		free(mm);
+	}
+}
+
+static int map_set_member(struct map_ent *me, struct map_rec *r)
+{
+	struct map_member *mm;
+
+	for (mm = me->members; mm; mm = mm->next)
+		if (mm->major == r->major && mm->minor == r->minor)
+			break;
+	if (!mm) {
+		mm = malloc(sizeof(*mm));
+		if (!mm)
+			return -1;
+		mm->major = r->major;
+		mm->minor = r->minor;
+		mm->next = me->members;
+		me->members = mm;
+	}
+	mm->role = r->role;
+	mm->events = r->events;
+	mm->state = r->state;
+	mm->level = r->level;
+	mm->raid_disks = r->raid_disks;
+	mm->layout = r->layout;
+	mm->array_state = r->array_state;
+	mm->working_disks = r->working_disks;
+	return 0;
+}
+
+static int map_drop_member(struct map_ent *me, int major, int minor)
+{
+	struct map_member *mm, **mmp;
+
+	for (mmp = &me->members; (mm = *mmp) != NULL; mmp = &mm->next)
+		if (mm->major == major && mm->minor == minor) {
+			*mmp = mm->next;
+			free(mm);
+			return 1;
+		}
+	return 0;
+}
+
+static void map_apply(struct map_ent **melp, struct map_rec *r, int db)
+{
+	/* map.db has each array once, followed by its members, so
+	 * there is no need to look for what a record refers to.
+	 */
+	struct map_ent *me = *melp;
+
+	if (db && r->op == MAP_ARRAY)
+		me = NULL;
+	else if (!db || (me && me->devnum != r->devnum))
+		for (me = *melp; me; me = me->next)
+			if (me->devnum == r->devnum)
+				break;
+	switch (r->op) {
+	case MAP_ARRAY:
+		r->metadata[sizeof(r->metadata)-1] = 0;
+		r->path[sizeof(r->path)-1] = 0;
+		if (!me) {
+			map_add(melp, r->devnum, r->metadata, r->uuid,
+				r->path[0] ? r->path : NULL);
+			break;
+		}
+		strcpy(me->metadata, r->metadata);
+		memcpy(me->uuid, r->uuid, 16);
+		free(me->path);
+		me->path = r->path[0] ? strdup(r->path) : NULL;
+		/* may be a different array now */
+		map_free_members(me);
+		hashed = NULL;
+		break;
+	case MAP_DELETE:
+		if (me)
+			map_delete(melp, r->devnum);
+		break;
+	case MAP_MEMBER:
+		if (me)
+			map_set_member(me, r);
+		break;
+	case MAP_FORGET:
+		if (me)
+			map_drop_member(me, r->major, r->minor);
+		break;
+	}
+}
+
+int map_note_member(struct map_ent *me, int major, int minor,
+		    struct mdinfo *info)
+{
+	/* Remember what is in the superblock of a device that
+	 * has just been added to the array.
+	 */
+	struct map_rec r;
+
+	map_rec_init(&r, MAP_MEMBER, me->devnum);
+	r.major = major;
+	r.minor = minor;
+	r.role = info->disk.raid_disk;
+	r.events = info->events;
+	r.state = info->disk.state;
+	r.level = info->array.level;
+	r.raid_disks = info->array.raid_disks;
+	r.layout = info->array.layout;
+	r.array_state = info->array.state;
+	r.working_disks = info->array.working_disks;
+	if (map_set_member(me, &r) != 0)
+		return -1;
+	return map_append(&r);
+}
+
+int map_forget_member(struct map_ent *me, int major, int minor)
+{
+	struct map_rec r;
+
+	if (!map_drop_member(me, major, minor))
+		return 0;
+	map_rec_init(&r, MAP_FORGET, me->devnum);
+	r.major = major;
+	r.minor = minor;
+	map_append(&r);
+	return 1;
+}
+
+struct map_member *map_find_member(struct map_ent *me, int major, int minor)
+{
+	struct map_member *mm;
+
+	for (mm = me->members; mm; mm = mm->next)
+		if (mm->major == major && mm->minor == minor)
+			return mm;
+	return NULL;
+}
+
+static void map_read_text(struct map_ent **melp, int rebuild)
 {
 	FILE *f;
 	char buf[8192];
@@ -185,7 +768,7 @@ void map_read(struct map_ent **melp)
 	*melp = NULL;
 
 	f = open_map(MAP_READ);
-	if (!f) {
+	if (!f && rebuild) {
 		RebuildMap();
 		f = open_map(MAP_READ);
 	}
@@ -193,7 +776,26 @@ void map_read(struct map_ent **melp)
 		return;
 
 	while (fgets(buf, sizeof(buf), f)) {
+		struct map_member mm;
+
 		path[0] = 0;
+		if (buf[0] == '+') {
+			/* belongs to the array just read */
+			if (*melp &&
+			    sscanf(buf, "+ %d:%d %d %llu %x %d %d %d %x %d",
+				   &mm.major, &mm.minor, &mm.role, &mm.events,
+				   &mm.state, &mm.level, &mm.raid_disks,
+				   &mm.layout, &mm.array_state,
+				   &mm.working_disks) == 10) {
+				struct map_member *m = malloc(sizeof(*m));
+				if (m) {
+					*m = mm;
+					m->next = (*melp)->members;
+					(*melp)->members = m;
+				}
+			}
+			continue;
+		}
 		if (sscanf(buf, " %3[mdp]%d %s %x:%x:%x:%x %200s",
 			   nam, &devnum, metadata, uuid, uuid+1,
 			   uuid+2, uuid+3, path) >= 7) {
@@ -207,11 +809,64 @@ void map_read(struct map_ent **melp)
 	fclose(f);
 }
 
+static int map_read_db(struct map_ent **melp)
+{
+	/* 0 if *melp has been read from map.db and map.log, 1 if they
+	 * changed while we read, -1 if "map" must be read instead.
+	 */
+	struct map_hdr dbh, logh;
+	struct stat stb;
+	int dfd, lfd;
+	int rv = -1;
+
+	*melp = NULL;
+	dfd = open(mapname[MAP_DB], O_RDONLY);
+	if (dfd < 0)
+		return -1;
+	lfd = open(mapname[MAP_LOG], O_RDONLY);
+	if (lfd >= 0 &&
+	    map_load(dfd, &dbh, melp, 1) == 0 &&
+	    map_load(lfd, &logh, melp, 0) == 0) {
+		if (dbh.gen == logh.gen &&
+		    stat(mapname[MAP_READ], &stb) == 0 &&
+		    stb.st_ino == dbh.text_ino)
+			rv = 0;
+		else
+			rv = 1;
+	}
+	if (lfd >= 0)
+		close(lfd);
+	close(dfd);
+	if (rv) {
+		map_free(*melp);
+		*melp = NULL;
+	}
+	return rv;
+}
+
+void map_read(struct map_ent **melp)
+{
+	int tries;
+	int rv = -1;
+
+	set_mapnames();
+	for (tries = 0; tries < MAP_READ_TRIES; tries++) {
+		rv = map_read_db(melp);
+		if (rv <= 0)
+			break;
+		usleep(1000);
+	}
+	if (rv != 0)
+		map_read_text(melp, 1);
+}
+
 void map_free(struct map_ent *map)
 {
+	hashed = NULL;
 	while (map) {
 		struct map_ent *mp = map;
 		map = mp->next;
+		map_free_members(mp);
 		free(mp->path);
 		free(mp);
 	}
@@ -220,29 +875,17 @@ void map_free(struct map_ent *map)
 int map_update(struct map_ent **mpp, int devnum, char *metadata,
 	       int *uuid, char *path)
 {
-	struct map_ent *map, *mp;
-	int rv;
-
-	if (mpp && *mpp)
-		map = *mpp;
-	else
-		map_read(&map);
+	/* Record that 'devnum' is now this array.  Any list the
+	 * caller has is freed, as it is out of date.
+	 */
+	struct map_rec r;
 
-	for (mp = map ; mp ; mp=mp->next)
-		if (mp->devnum == devnum) {
-			strcpy(mp->metadata, metadata);
-			memcpy(mp->uuid, uuid, 16);
-			free(mp->path);
-			mp->path = path ? strdup(path) : NULL;
-			break;
-		}
-	if (!mp)
-		map_add(&map, devnum, metadata, uuid, path);
-	if (mpp)
+	map_rec_array(&r, devnum, metadata, uuid, path);
+	if (mpp) {
+		map_free(*mpp);
 		*mpp = NULL;
-	rv = map_write(map);
-	map_free(map);
-	return rv;
+	}
+	return map_append(&r) == 0;
 }
 
 void map_delete(struct map_ent **mapp, int devnum)
@@ -252,9 +895,11 @@ void map_delete(struct map_ent **mapp, int devnum)
 	if (*mapp == NULL)
 		map_read(mapp);
 
+	hashed = NULL;
 	for (mp = *mapp; mp; mp = *mapp) {
 		if (mp->devnum == devnum) {
 			*mapp = mp->next;
+			map_free_members(mp);
 			free(mp->path);
 			free(mp);
 		} else
@@ -264,11 +909,14 @@ void map_delete(struct map_ent **mapp, int devnum)
 
 void map_remove(struct map_ent **mapp, int devnum)
 {
+	struct map_rec r;
+
 	if (devnum == NoMdDev)
 		return;
 
 	map_delete(mapp, devnum);
-	map_write(*mapp);
+	map_rec_init(&r, MAP_DELETE, devnum);
+	map_append(&r);
 	map_free(*mapp);
 }
 
@@ -278,7 +926,8 @@ struct map_ent *map_by_uuid(struct map_ent **map, int uuid[4])
 	if (!*map)
 		map_read(map);
 
-	for (mp = *map ; mp ; mp = mp->next) {
+	map_index(*map);
+	for (mp = uuid_hash[hash_uuid(uuid)] ; mp ; mp = mp->unext) {
 		if (memcmp(uuid, mp->uuid, 16) != 0)
 			continue;
 		if (!mddev_busy(mp->devnum)) {
@@ -296,7 +945,8 @@ struct map_ent *map_by_devnum(struct map_ent **map, int devnum)
 	if (!*map)
 		map_read(map);
 
-	for (mp = *map ; mp ; mp = mp->next) {
+	map_index(*map);
+	for (mp = devnum_hash[hash_devnum(devnum)] ; mp ; mp = mp->dnext) {
 		if (mp->devnum != devnum)
 			continue;
 		if (!mddev_busy(mp->devnum)) {
@@ -403,7 +1053,10 @@ void RebuildMap(void)
 				ok = -1;
 			else {
 				set_member_info(st, md);
-				ok = st->ss->load_super(st, dfd, NULL);
+				/* a member needs reloading for its subarray */
+				ok = 0;
+				if (!st->sb || st->subarray[0])
+					ok = st->ss->load_super(st, dfd, NULL);
 			}
 			close(dfd);
 			if (ok != 0)
@@ -94,6 +94,8 @@ int main(int argc, char *argv[])
 	int delay = 0;
 	int daemonise = 0;
 	char *pidfile = NULL;
+	char *metrics_file = NULL;
+	char *metrics_sock = NULL;
 	int oneshot = 0;
 	struct supertype *ss = NULL;
 	int writemostly = 0;
@@ -101,6 +103,7 @@ int main(int argc, char *argv[])
 	char *shortopt = short_options;
 	int dosyslog = 0;
 	int rebuild_map = 0;
+	int incr_listen = 0;
 	int auto_update_home = 0;
 	char *subarray = NULL;
 
@@ -769,6 +772,20 @@ int main(int argc, char *argv[])
 			else
 				pidfile = optarg;
 			continue;
+		case O(MONITOR,Metrics):
+			if (metrics_file)
+				fprintf(stderr, Name ": only specify one metrics file. %s ignored.\n",
+					optarg);
+			else
+				metrics_file = optarg;
+			continue;
+		case O(MONITOR,MetricsSocket):
+			if (metrics_sock)
+				fprintf(stderr, Name ": only specify one metrics socket. %s ignored.\n",
+					optarg);
+			else
+				metrics_sock = optarg;
+			continue;
 		case O(MONITOR,'1'): /* oneshot */
 			oneshot = 1;
 			continue;
@@ -946,6 +963,9 @@ int main(int argc, char *argv[])
 		case O(INCREMENTAL, 'r'):
 			rebuild_map = 1;
 			continue;
+		case O(INCREMENTAL, Listen):
+			incr_listen = 1;
+			continue;
 		}
 		/* We have now processed all the valid options. Anything else is
 		 * an error
@@ -1150,7 +1170,7 @@ int main(int argc, char *argv[])
 			mddev_ident_t a, array_list =  conf_get_ident(NULL);
 			mddev_dev_t devlist = conf_get_devs();
 			int cnt = 0;
-			int failures, successes;
+			int failures, successes, planned;
 			if (devlist == NULL) {
 				fprintf(stderr, Name ": No devices listed in conf file were found.\n");
 				exit(1);
@@ -1165,12 +1185,19 @@ int main(int argc, char *argv[])
 			}
 			for (a = array_list; a ; a = a->next) {
 				a->assembled = 0;
+				a->tried = 0;
 				if (a->autof == 0)
 					a->autof = autof;
 			}
+			planned = AssembleScan(ss, array_list,
+					       readonly, runstop,
+					       homehost, require_homehost,
+					       verbose-quiet, force);
+			cnt = planned;
 			do {
 				failures = 0;
-				successes = 0;
+				successes = planned;
+				planned = 0;
 				rv = 0;
 				for (a = array_list; a ; a = a->next) {
 					int r;
@@ -1180,12 +1207,20 @@ int main(int argc, char *argv[])
 					    strcasecmp(a->devname, "<ignore>") == 0)
 						continue;
 				
-					r = Assemble(ss, a->devname,
-						     a,
-						     NULL, NULL,
-						     readonly, runstop, NULL,
-						     homehost, require_homehost,
-						     verbose-quiet, force);
+					if (a->tried) {
+						/* AssembleScan has tried this
+						 * already.  Only try again if
+						 * something else started.
+						 */
+						r = a->tried;
+						a->tried = 0;
+					} else
+						r = Assemble(ss, a->devname,
+							     a,
+							     NULL, NULL,
+							     readonly, runstop, NULL,
+							     homehost, require_homehost,
+							     verbose-quiet, force);
 					if (r == 0) {
 						a->assembled = 1;
 						successes++;
@@ -1206,6 +1241,11 @@ int main(int argc, char *argv[])
 				do {
 					mddev_dev_t devlist = conf_get_devs();
 					acnt = 0;
+					/* Each Assemble walks the whole list,
+					 * so read it just once.
+					 */
+					probe_prefetch(devlist);
+					probe_hold(1);
 					do {
 						rv2 = Assemble(ss, NULL,
 							       &ident,
@@ -1223,6 +1263,7 @@ int main(int argc, char *argv[])
 							 */
 							auto_update_home = 0;
 					} while (rv2!=2);
+					probe_hold(0);
 					/* Incase there are stacked devices, we need to go around again */
 				} while (acnt);
 #if 0
@@ -1481,7 +1522,8 @@ int main(int argc, char *argv[])
 		}
 		rv= Monitor(devlist, mailaddr, program,
 			    delay?delay:60, daemonise, scan, oneshot,
-			    dosyslog, test, pidfile, increments);
+			    dosyslog, test, pidfile, increments,
+			    metrics_file, metrics_sock);
 		break;
 
 	case GROW:
@@ -1563,6 +1605,18 @@ int main(int argc, char *argv[])
 			}
 			rv = IncrementalScan(verbose);
 		}
+		if (incr_listen) {
+			if (devlist) {
+				fprintf(stderr, Name
+			 ": --incremental --listen does not take a device.\n");
+				rv = 1;
+				break;
+			}
+			rv = IncrementalListen(0, verbose-quiet, runstop,
+					       homehost, require_homehost,
+					       autof, argv);
+			break;
+		}
 		if (!devlist) {
 			if (!rebuild_map && !scan) {
 				fprintf(stderr, Name
@@ -1581,6 +1635,26 @@ int main(int argc, char *argv[])
 			rv = IncrementalRemove(devlist->devname, verbose-quiet);
 			break;
 		}
+		if (strcmp(devlist->devname, "-") == 0) {
+			rv = IncrementalListen(1, verbose-quiet, runstop,
+					       homehost, require_homehost,
+					       autof, NULL);
+			break;
+		}
+		/* A running --listen may deal with it for us */
+		if (!ss && (rv = IncrementalSend(devlist->devname,
+						 verbose-quiet, runstop,
+						 homehost, require_homehost,
+						 autof)) != -1) {
+			if (rv == -2) {
+				/* It may still be at it, so leave it be */
+				fprintf(stderr, Name ": no answer from "
+					"mdadm --incremental --listen about %s\n",
+					devlist->devname);
+				rv = 1;
+			}
+			break;
+		}
 		rv = Incremental(devlist->devname, verbose-quiet, runstop,
 				 ss, homehost, require_homehost, autof);
 		break;
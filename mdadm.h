@@ -81,6 +81,18 @@ extern __off64_t lseek64 __P ((int __fd, __off64_t __offset, int __whence));
 #ifndef MAP_FILE
 #define MAP_FILE "map"
 #endif /* MAP_FILE */
+/* SUPER_CACHE is where guess_super remembers what it found on each
+ * device, also in MAP_DIR.
+ */
+#ifndef SUPER_CACHE
+#define SUPER_CACHE "super-cache"
+#endif /* SUPER_CACHE */
+/* INCREMENTAL_SOCK is where "mdadm --incremental --listen" waits for
+ * devices to be handed to it, also in MAP_DIR.
+ */
+#ifndef INCREMENTAL_SOCK
+#define INCREMENTAL_SOCK "incremental.sock"
+#endif /* INCREMENTAL_SOCK */
 /* MDMON_DIR is where pid and socket files used for communicating
  * with mdmon normally live.  It *should* be /var/run, but when
  * mdmon is needed at early boot then it needs to write there prior
@@ -237,6 +249,20 @@ struct createinfo {
 	struct supertype *supertype;
 };
 
+/* From the SCRUB line in the config file, for --monitor */
+struct scrubinfo {
+	int	enabled;	/* there was a SCRUB line */
+	int	every;		/* days between checks of each array */
+	int	start, end;	/* window, in minutes after midnight */
+	int	speed;		/* K/sec shared by all checks, 0 = no limit */
+	int	parallel;	/* most checks we start at once */
+};
+
+struct safemodeinfo {
+	int	enabled;	/* there was a SAFEMODE line */
+	unsigned long min, max;	/* msecs, min 0 means the array's own */
+};
+
 #define Name "mdadm"
 
 enum mode {
@@ -280,6 +306,9 @@ enum special_options {
 	DetailPlatform,
 	KillSubarray,
 	UpdateSubarray, /* 16 */
+	Metrics,
+	MetricsSocket,
+	Listen,
 };
 
 /* structures read from config file */
@@ -326,6 +355,8 @@ typedef struct mddev_ident_s {
 		/* fields needed by different users of this structure */
 		int assembled;	/* set when assembly succeeds */
 	};
+	int	tried;		/* AssembleScan failed to assemble it,
+				 * and this is what Assemble returned */
 } *mddev_ident_t;
 
 /* List of device names - wildcards expanded */
@@ -369,7 +400,9 @@ struct mdstat_ent {
 extern struct mdstat_ent *mdstat_read(int hold, int start);
 extern void free_mdstat(struct mdstat_ent *ms);
 extern void mdstat_wait(int seconds);
-extern void mdstat_wait_fd(int fd, const sigset_t *sigmask);
+struct pollfd;
+extern void mdstat_pollfd(struct pollfd *pfd);
+extern int mdstat_watch(int epfd, void *cookie);
 extern int mddev_busy(int devnum);
 extern struct mdstat_ent *mdstat_by_component(char *name);
 
@@ -380,6 +413,21 @@ struct map_ent {
 	int	uuid[4];
 	int	bad;
 	char	*path;
+	struct map_member *members;
+	struct map_ent *unext, *dnext;	/* hash chains, see mapfile.c */
+};
+/* What --incremental found on a device it added to an array that
+ * isn't running yet.  See mapfile.c
+ */
+struct map_member {
+	struct map_member *next;
+	int	major, minor;
+	int	role;
+	unsigned long long events;
+	int	state;
+	int	level, raid_disks, layout;
+	int	array_state;
+	int	working_disks;
 };
 extern int map_update(struct map_ent **mpp, int devnum, char *metadata,
 		      int uuid[4], char *path);
@@ -395,6 +443,13 @@ extern void map_add(struct map_ent **melp,
 		    int devnum, char *metadata, int uuid[4], char *path);
 extern int map_lock(struct map_ent **melp);
 extern void map_unlock(struct map_ent **melp);
+extern int map_lock_array(struct map_ent **melp, int uuid[4]);
+extern void map_unlock_array(struct map_ent **melp);
+extern int map_note_member(struct map_ent *me, int major, int minor,
+			   struct mdinfo *info);
+extern int map_forget_member(struct map_ent *me, int major, int minor);
+extern struct map_member *map_find_member(struct map_ent *me,
+					  int major, int minor);
 
 /* various details can be requested */
 enum sysfs_read_flags {
@@ -443,6 +498,28 @@ extern int sysfs_add_disk(struct mdinfo *sra, struct mdinfo *sd, int resume);
 extern int sysfs_disk_to_scsi_id(int fd, __u32 *id);
 extern int sysfs_unique_holder(int devnum, long rdev);
 extern int load_sys(char *path, char *buf);
+extern int sysfs_watch_fd(int epfd, int fd, char *path, void *cookie);
+extern int sysfs_watch_read(int epfd, int fd, char *path, void *cookie);
+extern int sysfs_watch_attr(int epfd, int devnum, char *devname, char *attr,
+			    void *cookie);
+extern int sysfs_watch_io(int epfd, int fd, int out, void *cookie);
+extern void sysfs_unwatch_fd(int epfd, int fd);
+extern int sysfs_watch_wait(int epfd, void **cookies, int max, int timeout,
+			    const sigset_t *sigmask);
+
+/* I/O done by a block device, from its stat file */
+struct disk_stat {
+	unsigned long long ios;		/* reads and writes completed */
+	unsigned long long sectors;	/* read and written */
+	unsigned long long ticks;	/* msecs spent doing them */
+};
+/* disk_stat_slow() doesn't judge members with fewer I/Os than this,
+ * or call an average of less than SLOW_MIN_MS per I/O slow.
+ */
+#define SLOW_MIN_IOS 20
+#define SLOW_MIN_MS 10
+extern int sysfs_disk_stat(int major, int minor, struct disk_stat *ds);
+extern int disk_stat_slow(struct disk_stat *ds, int n, int *slow);
 
 
 extern int save_stripes(int *source, unsigned long long *offsets,
@@ -656,6 +733,11 @@ extern struct superswitch {
 	 */
 	void (*set_disk)(struct active_array *a, int n, int state);
 	void (*sync_metadata)(struct supertype *st);
+	/* A number that changes whenever the metadata on the devices
+	 * does, so a --takeover mdmon can tell whether the copy it
+	 * loaded is still current.
+	 */
+	unsigned long long (*generation)(struct supertype *st);
 	void (*process_update)(struct supertype *st,
 			       struct metadata_update *update);
 	void (*prepare_update)(struct supertype *st,
@@ -682,6 +764,7 @@ struct metadata_update {
 	int	len;
 	char	*buf;
 	void	*space; /* allocated space that monitor will use */
+	struct supertype *container; /* mdmon: which container it is for */
 	struct metadata_update *next;
 };
 
@@ -702,6 +785,21 @@ struct metadata_update {
  *   guess_super
  *   dup_super
  */
+/* mdmon keeps times as a histogram of log2(usecs) */
+#define LAT_BUCKETS 32
+struct latency {
+	unsigned long count;
+	unsigned long long total;	/* usecs */
+	unsigned long max;
+	unsigned long bucket[LAT_BUCKETS]; /* [n] counts times under 2^n usecs */
+};
+
+struct disk_latency {
+	int major, minor;
+	struct latency lat;
+	struct disk_latency *next;
+};
+
 struct supertype {
 	struct superswitch *ss;
 	int minor_version;
@@ -724,13 +822,39 @@ struct supertype {
 			*  external:/md0/12
 			*/
 	int devcnt;
+	unsigned long metadata_writes; /* devices written by sync_metadata */
+	struct disk_latency *write_lat; /* time taken by those writes */
 
 	struct mdinfo *devs;
 
+	struct supertype *next; /* other containers the same mdmon manages */
+	int stopped; /* mdmon has finished with this container */
+};
+
+/* What the superblock cache knows about a device (see guess_super) */
+struct sb_summary {
+	struct superswitch *ss;
+	int minor_version;
+	int uuid[4];
+	char name[33];
+	unsigned long long events;
+	int role;
+	dev_t dev;
+	unsigned long long size;
+	long ctime;
 };
 
 extern struct supertype *super_by_fd(int fd);
 extern struct supertype *guess_super(int fd);
+extern struct sb_summary *super_cache_find(int fd);
+extern void super_cache_forget(int fd);
+extern void super_cache_reset(void);
+extern int probe_read(int fd, void *buf, int len);
+extern void probe_prefetch(mddev_dev_t devlist);
+extern void probe_forget(void);
+extern void probe_scan(int on);
+extern void probe_drop(char *devname);
+extern void probe_hold(int hold);
 extern struct supertype *dup_super(struct supertype *st);
 extern int get_dev_size(int fd, char *dname, unsigned long long *sizep);
 extern void get_one_disk(int mdfd, mdu_array_info_t *ainf,
@@ -800,6 +924,10 @@ extern int Assemble(struct supertype *st, char *mddev,
 		    int readonly, int runstop,
 		    char *update, char *homehost, int require_homehost,
 		    int verbose, int force);
+extern int AssembleScan(struct supertype *ss, mddev_ident_t array_list,
+			int readonly, int runstop,
+			char *homehost, int require_homehost,
+			int verbose, int force);
 
 extern int Build(char *mddev, int chunk, int level, int layout,
 		 int raiddisks, mddev_dev_t devlist, int assume_clean,
@@ -822,7 +950,8 @@ extern int Examine(mddev_dev_t devlist, int brief, int export, int scan,
 extern int Monitor(mddev_dev_t devlist,
 		   char *mailaddr, char *alert_cmd,
 		   int period, int daemonise, int scan, int oneshot,
-		   int dosyslog, int test, char *pidfile, int increments);
+		   int dosyslog, int test, char *pidfile, int increments,
+		   char *metrics_file, char *metrics_sock);
 
 extern int Kill(char *dev, struct supertype *st, int force, int quiet, int noexcl);
 extern int Kill_subarray(char *dev, char *subarray, int quiet);
@@ -839,6 +968,11 @@ extern int Incremental_container(struct supertype *st, char *devname,
 extern void RebuildMap(void);
 extern int IncrementalScan(int verbose);
 extern int IncrementalRemove(char *devname, int verbose);
+extern int IncrementalSend(char *devname, int verbose, int runstop,
+			   char *homehost, int require_homehost, int autof);
+extern int IncrementalListen(int from_stdin, int verbose, int runstop,
+			     char *homehost, int require_homehost, int autof,
+			     char *argv[]);
 extern int CreateBitmap(char *filename, int force, char uuid[16],
 			unsigned long chunksize, unsigned long daemon_sleep,
 			unsigned long write_behind,
@@ -872,6 +1006,8 @@ extern mddev_dev_t conf_get_devs(void);
 extern int conf_test_dev(char *devname);
 extern int conf_test_metadata(const char *version, int is_homehost);
 extern struct createinfo *conf_get_create_info(void);
+extern struct scrubinfo *conf_get_scrub(void);
+extern struct safemodeinfo *conf_get_safemode(void);
 extern void set_conffile(char *file);
 extern char *conf_get_mailaddr(void);
 extern char *conf_get_mailfrom(void);
@@ -903,6 +1039,22 @@ extern int test_partition(int fd);
 extern unsigned long long calc_array_size(int level, int raid_disks, int layout,
 				   int chunksize, unsigned long long devsize);
 extern int flush_metadata_updates(struct supertype *st);
+extern void latency_add(struct latency *lat, struct timespec *start);
+extern unsigned long latency_percentile(struct latency *lat, int pct);
+
+/* Writing metadata to one device, for write_metadata() */
+struct metadata_write {
+	int fd;
+	int major, minor;
+	int (*write)(struct metadata_write *w); /* 0, or -1 and errno */
+	void *arg;
+	int err;		/* errno if ->write failed */
+	struct timespec start, end;
+};
+extern int write_metadata(struct supertype *st, struct metadata_write *w,
+			  int n);
+extern void run_metadata_write(struct metadata_write *w);
+extern void (*metadata_writer)(struct metadata_write *w, int n);
 extern void append_metadata_update(struct supertype *st, void *buf, int len);
 extern int assemble_container_content(struct supertype *st, int mdfd,
 				      struct mdinfo *content, int runstop,
@@ -943,6 +1095,8 @@ extern struct superswitch *version_to_superswitch(char *vers);
 extern int mdmon_running(int devnum);
 extern int mdmon_pid(int devnum);
 extern int check_env(char *name);
+extern char *mdadm_root(void);
+#define MDADM_ROOT_MAX 1024
 extern __u32 random32(void);
 extern int start_mdmon(int devnum);
 
@@ -0,0 +1,241 @@
+/*
+ * mdmon-sim - run mdmon's manager and monitor on a tree built by mdsim.
+ *
+ * Copyright (C) 2010 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * mdsim cannot make a container, and its devices have no metadata,
+ * so mdmon itself has nothing to load there.  This runs the real
+ * manager and monitor for a container anyway, with a metadata handler
+ * that agrees to everything and writes nothing, so that the time mdmon
+ * takes to answer the kernel can be measured:
+ *
+ *   mdsim -r /tmp/sim populate 4 6 raid5 external:/md127/0
+ *   MDADM_ROOT=/tmp/sim mdmon-sim md127 &
+ *   mdsim -r /tmp/sim bench -k write-pending -n 1000 -i 5
+ *   kill -INT %1
+ *
+ * On SIGINT it prints what "mdmon --stats" would say, and exits.
+ * With --takeover it first takes the arrays from another mdmon-sim
+ * for the same container, as "mdmon --takeover" would.
+ */
+
+#include	<pthread.h>
+#include	<signal.h>
+#include	<sys/socket.h>
+#include	<sys/un.h>
+#include	<sys/eventfd.h>
+
+#include	"mdadm.h"
+#include	"mdmon.h"
+
+struct active_array *discard_this;
+struct active_array *pending_discard;
+
+int mon_tid, mgr_tid;
+int monitor_event = -1, manager_event = -1;
+struct safemodeinfo *safemode_conf;
+
+int sigterm;
+
+static int dirty;
+
+void remove_pidfile(char *devname)
+{
+}
+
+static int sim_open_new(struct supertype *c, struct active_array *a,
+			char *inst)
+{
+	return 0;
+}
+
+static int sim_set_array_state(struct active_array *a, int consistent)
+{
+	dirty = 1;
+	return consistent;
+}
+
+static void sim_set_disk(struct active_array *a, int n, int state)
+{
+	dirty = 1;
+}
+
+static void sim_sync_metadata(struct supertype *st)
+{
+	if (dirty)
+		st->metadata_writes++;
+	dirty = 0;
+}
+
+static unsigned long long sim_generation(struct supertype *st)
+{
+	return 0;
+}
+
+static void sim_process_update(struct supertype *st,
+			       struct metadata_update *update)
+{
+}
+
+static struct mdinfo *sim_activate_spare(struct active_array *a,
+					 struct metadata_update **updates)
+{
+	return NULL;
+}
+
+static struct superswitch sim_super = {
+	.open_new = sim_open_new,
+	.set_array_state = sim_set_array_state,
+	.set_disk = sim_set_disk,
+	.sync_metadata = sim_sync_metadata,
+	.generation = sim_generation,
+	.process_update = sim_process_update,
+	.activate_spare = sim_activate_spare,
+	.external = 1,
+	.name = "sim",
+};
+
+/* Writing a sysfs attribute replaces its value wherever the file
+ * offset is, but mdsim's attributes are ordinary files which mdmon
+ * has just read to the end.  So every write() in the objects we are
+ * linked with (-Wl,--wrap=write) starts the file again.
+ */
+ssize_t __real_write(int fd, const void *buf, size_t count);
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count)
+{
+	struct stat stb;
+
+	if (fstat(fd, &stb) == 0 && S_ISREG(stb.st_mode)) {
+		lseek(fd, 0, SEEK_SET);
+		if (ftruncate(fd, 0) < 0)
+			return -1;
+	}
+	return __real_write(fd, buf, count);
+}
+
+static int control_sock(char *devname)
+{
+	struct sockaddr_un addr;
+	char path[PATH_MAX];
+	int sfd;
+
+	sprintf(path, "%s%s/%s.sock", mdadm_root(), MDMON_DIR, devname);
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	unlink(path);
+	sfd = socket(PF_LOCAL, SOCK_STREAM, 0);
+	if (sfd < 0)
+		return -1;
+	addr.sun_family = PF_LOCAL;
+	strcpy(addr.sun_path, path);
+	if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(sfd, 10) < 0) {
+		close(sfd);
+		return -1;
+	}
+	fcntl(sfd, F_SETFL, O_NONBLOCK);
+	return sfd;
+}
+
+static void *run_monitor(void *v)
+{
+	do_monitor(v);
+	return NULL;
+}
+
+static void *run_manager(void *v)
+{
+	do_manager(v);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct safemodeinfo safemode;
+	struct supertype container;
+	pthread_t mon, mgr;
+	sigset_t set;
+	char *stats;
+	int takeover = 0;
+	int victim = -1;
+	int sig;
+
+	if (argc == 3 && strcmp(argv[1], "--takeover") == 0) {
+		takeover = 1;
+		argv++;
+		argc--;
+	}
+	if (argc != 2 || strncmp(argv[1], "md", 2) != 0) {
+		fprintf(stderr, "Usage: MDADM_ROOT=dir mdmon-sim [--takeover] mdNNN\n");
+		exit(2);
+	}
+	if (!*mdadm_root()) {
+		fprintf(stderr, "mdmon-sim: MDADM_ROOT must be set\n");
+		exit(2);
+	}
+
+	memset(&container, 0, sizeof(container));
+	container.devname = argv[1];
+	container.devnum = devname2devnum(argv[1]);
+	container.ss = &sim_super;
+	if (takeover)
+		victim = connect_monitor(argv[1]);
+	container.sock = control_sock(argv[1]);
+	safemode_conf = &safemode;
+	monitor_event = eventfd(0, 0);
+	manager_event = eventfd(0, 0);
+	if (container.sock < 0 || monitor_event < 0 || manager_event < 0) {
+		fprintf(stderr, "mdmon-sim: cannot set up: %s\n",
+			strerror(errno));
+		exit(2);
+	}
+	fcntl(monitor_event, F_SETFL, O_NONBLOCK);
+	fcntl(manager_event, F_SETFL, O_NONBLOCK);
+	if (takeover && (victim < 0 || take_over(&container, victim) != 0)) {
+		fprintf(stderr, "mdmon-sim: cannot take over %s\n", argv[1]);
+		exit(1);
+	}
+
+	/* as in mdmon, SIGTERM is only seen where it is expected.
+	 * SIGINT is ours.
+	 */
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	if (pthread_create(&mon, NULL, run_monitor, &container) != 0 ||
+	    pthread_create(&mgr, NULL, run_manager, &container) != 0) {
+		fprintf(stderr, "mdmon-sim: cannot start threads\n");
+		exit(2);
+	}
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigwait(&set, &sig);
+
+	stats = query_stats(argv[1]);
+	if (!stats) {
+		fprintf(stderr, "mdmon-sim: no stats from %s\n", argv[1]);
+		exit(1);
+	}
+	fputs(stats, stdout);
+	exit(0);
+}
@@ -52,6 +52,7 @@
 #include	<sys/mman.h>
 #include	<sys/syscall.h>
 #include	<sys/wait.h>
+#include	<sys/eventfd.h>
 #include	<stdio.h>
 #include	<errno.h>
 #include	<string.h>
@@ -71,6 +72,8 @@ struct active_array *discard_this;
 struct active_array *pending_discard;
 
 int mon_tid, mgr_tid;
+int monitor_event = -1, manager_event = -1;
+struct safemodeinfo *safemode_conf;
 
 int sigterm;
 
@@ -140,17 +143,84 @@ static int clone_monitor(struct supertype *container)
 }
 #endif /* USE_PTHREADS */
 
+#ifdef USE_PTHREADS
+/* Metadata is written to every device of a container at once, by the
+ * monitor and a pool of helpers which grows as needed.
+ */
+#define MAX_WRITERS 32
+#define WRITER_STACK (64*1024)
+
+static pthread_mutex_t wr_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wr_more = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wr_done = PTHREAD_COND_INITIALIZER;
+static struct metadata_write *wr_list;
+static int wr_next, wr_count, wr_finished;
+static int writers;
+
+static void run_writes(void)
+{
+	/* Called holding wr_lock.  Take writes until none are left */
+	while (wr_next < wr_count) {
+		struct metadata_write *w = &wr_list[wr_next++];
+
+		pthread_mutex_unlock(&wr_lock);
+		run_metadata_write(w);
+		pthread_mutex_lock(&wr_lock);
+		if (++wr_finished == wr_count)
+			pthread_cond_signal(&wr_done);
+	}
+}
+
+static void *writer(void *v)
+{
+	pthread_mutex_lock(&wr_lock);
+	while (1) {
+		run_writes();
+		pthread_cond_wait(&wr_more, &wr_lock);
+	}
+	return NULL;
+}
+
+static void write_in_parallel(struct metadata_write *w, int n)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	/* we write one device ourselves */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, WRITER_STACK);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while (writers < n - 1 && writers < MAX_WRITERS &&
+	       pthread_create(&thread, &attr, writer, NULL) == 0)
+		writers++;
+	pthread_attr_destroy(&attr);
+
+	pthread_mutex_lock(&wr_lock);
+	wr_list = w;
+	wr_next = wr_finished = 0;
+	wr_count = n;
+	pthread_cond_broadcast(&wr_more);
+	run_writes();
+	while (wr_finished < wr_count)
+		pthread_cond_wait(&wr_done, &wr_lock);
+	wr_list = NULL;
+	wr_next = wr_count = 0;
+	pthread_mutex_unlock(&wr_lock);
+}
+#endif /* USE_PTHREADS */
+
 static int make_pidfile(char *devname)
 {
-	char path[100];
+	char path[PATH_MAX];
 	char pid[10];
 	int fd;
 	int n;
 
-	if (mkdir(MDMON_DIR, 0755) < 0 &&
+	sprintf(path, "%s%s", mdadm_root(), MDMON_DIR);
+	if (mkdir(path, 0755) < 0 &&
 	    errno != EEXIST)
 		return -errno;
-	sprintf(path, "%s/%s.pid", MDMON_DIR, devname);
+	sprintf(path, "%s%s/%s.pid", mdadm_root(), MDMON_DIR, devname);
 
 	fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0600);
 	if (fd < 0)
@@ -163,7 +233,7 @@ static int make_pidfile(char *devname)
 	return 0;
 }
 
-static void try_kill_monitor(pid_t pid, char *devname, int sock)
+static void try_kill_monitor(pid_t pid, int sock)
 {
 	char buf[100];
 	int fd;
@@ -202,17 +272,17 @@ static void try_kill_monitor(pid_t pid, char *devname, int sock)
 
 void remove_pidfile(char *devname)
 {
-	char buf[100];
+	char buf[PATH_MAX];
 
-	sprintf(buf, "%s/%s.pid", MDMON_DIR, devname);
+	sprintf(buf, "%s%s/%s.pid", mdadm_root(), MDMON_DIR, devname);
 	unlink(buf);
-	sprintf(buf, "%s/%s.sock", MDMON_DIR, devname);
+	sprintf(buf, "%s%s/%s.sock", mdadm_root(), MDMON_DIR, devname);
 	unlink(buf);
 }
 
 static int make_control_sock(char *devname)
 {
-	char path[100];
+	char path[PATH_MAX];
 	int sfd;
 	long fl;
 	struct sockaddr_un addr;
@@ -220,7 +290,9 @@ static int make_control_sock(char *devname)
 	if (sigterm)
 		return -1;
 
-	sprintf(path, "%s/%s.sock", MDMON_DIR, devname);
+	sprintf(path, "%s%s/%s.sock", mdadm_root(), MDMON_DIR, devname);
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
 	unlink(path);
 	sfd = socket(PF_LOCAL, SOCK_STREAM, 0);
 	if (sfd < 0)
@@ -244,11 +316,6 @@ static void term(int sig)
 	sigterm = 1;
 }
 
-static void wake_me(int sig)
-{
-
-}
-
 /* if we are debugging and starting mdmon by hand then don't fork */
 static int do_fork(void)
 {
@@ -262,112 +329,284 @@ static int do_fork(void)
 
 void usage(void)
 {
-	fprintf(stderr, "Usage: mdmon [--all] [--takeover] CONTAINER\n");
+	fprintf(stderr, "Usage: mdmon [--all] [--takeover] CONTAINER ...\n"
+		"       mdmon --stats CONTAINER\n");
 	exit(2);
 }
 
-static int mdmon(char *devname, int devnum, int must_fork, int takeover);
+static int mdmon(struct supertype *containers, int must_fork, int takeover);
+
+static int show_stats(char *devname)
+{
+	/* Ask the running mdmon how long things have been taking */
+	char *text = query_stats(devname);
+
+	if (!text) {
+		fprintf(stderr, "mdmon: cannot get statistics for %s\n",
+			devname);
+		return 1;
+	}
+	fputs(text, stdout);
+	free(text);
+	return 0;
+}
+
+static struct supertype *new_container(char *devname, int devnum)
+{
+	struct supertype *container = calloc(1, sizeof(*container));
+
+	if (!container) {
+		fprintf(stderr, "mdmon: out of memory\n");
+		exit(3);
+	}
+	container->devnum = devnum;
+	container->devname = devname;
+	container->sock = -1;
+	return container;
+}
+
+static int listed(struct supertype *containers, int devnum)
+{
+	for (; containers; containers = containers->next)
+		if (containers->devnum == devnum)
+			return 1;
+	return 0;
+}
+
+static void take_all(struct supertype *containers)
+{
+	/* One mdmon may be looking after several containers.  Taking
+	 * over any of them kills it, so we must take all of them or
+	 * some would be left with no-one to look after them.
+	 */
+	char path[PATH_MAX];
+	struct supertype *container, *last;
+	struct dirent *de;
+	DIR *dir;
+
+	sprintf(path, "%s%s", mdadm_root(), MDMON_DIR);
+	dir = opendir(path);
+	if (!dir)
+		return;
+	for (last = containers; last->next; last = last->next)
+		;
+	for (container = containers; container; container = container->next) {
+		int pid = mdmon_pid(container->devnum);
+
+		if (pid <= 0)
+			continue;
+		rewinddir(dir);
+		while ((de = readdir(dir)) != NULL) {
+			char *dot = strrchr(de->d_name, '.');
+			char *devname;
+			int devnum;
+
+			if (!dot || strcmp(dot, ".pid") != 0)
+				continue;
+			*dot = 0;
+			devnum = devname2devnum(de->d_name);
+			devname = devnum2devname(devnum);
+			if (strcmp(devname, de->d_name) != 0 ||
+			    listed(containers, devnum) ||
+			    mdmon_pid(devnum) != pid) {
+				free(devname);
+				continue;
+			}
+			last->next = new_container(devname, devnum);
+			last = last->next;
+		}
+	}
+	closedir(dir);
+}
 
 int main(int argc, char *argv[])
 {
-	char *container_name = NULL;
+	struct supertype *containers = NULL, **tail = &containers;
+	char *container_name;
 	int devnum;
 	char *devname;
-	int status = 0;
 	int arg;
 	int all = 0;
 	int takeover = 0;
+	int stats = 0;
+	int names = 0;
 
 	for (arg = 1; arg < argc; arg++) {
 		if (strncmp(argv[arg], "--all",5) == 0 ||
-		    strcmp(argv[arg], "/proc/mdstat") == 0) {
-			container_name = argv[arg];
+		    strcmp(argv[arg], "/proc/mdstat") == 0)
 			all = 1;
-		} else if (strcmp(argv[arg], "--takeover") == 0)
+		else if (strcmp(argv[arg], "--takeover") == 0)
 			takeover = 1;
-		else if (container_name == NULL)
-			container_name = argv[arg];
-		else
+		else if (strcmp(argv[arg], "--stats") == 0)
+			stats = 1;
+		else if (argv[arg][0] == '-')
 			usage();
+		else
+			names++;
 	}
-	if (container_name == NULL)
+	if ((!names && !all) || (all && names) ||
+	    (stats && (all || takeover || names > 1)))
 		usage();
 
 	if (all) {
 		struct mdstat_ent *mdstat, *e;
-		int container_len = strlen(container_name);
 
-		/* launch an mdmon instance for each container found */
+		/* one mdmon instance for every container found */
 		mdstat = mdstat_read(0, 0);
 		for (e = mdstat; e; e = e->next) {
 			if (strncmp(e->metadata_version, "external:", 9) == 0 &&
 			    !is_subarray(&e->metadata_version[9])) {
 				devname = devnum2devname(e->devnum);
-				/* update cmdline so this mdmon instance can be
-				 * distinguished from others in a call to ps(1)
-				 */
-				if (strlen(devname) <= (unsigned)container_len) {
-					memset(container_name, 0, container_len);
-					sprintf(container_name, "%s", devname);
-				}
-				status |= mdmon(devname, e->devnum, 1,
-						takeover);
+				*tail = new_container(devname, e->devnum);
+				tail = &(*tail)->next;
 			}
 		}
 		free_mdstat(mdstat);
+		if (!containers)
+			return 0;
+	}
 
-		return status;
-	} else if (strncmp(container_name, "md", 2) == 0) {
-		devnum = devname2devnum(container_name);
-		devname = devnum2devname(devnum);
-		if (strcmp(container_name, devname) != 0)
-			devname = NULL;
-	} else {
-		struct stat st;
-
-		devnum = NoMdDev;
-		if (stat(container_name, &st) == 0)
-			devnum = stat2devnum(&st);
-		if (devnum == NoMdDev)
-			devname = NULL;
-		else
+	for (arg = 1; arg < argc && !all; arg++) {
+		container_name = argv[arg];
+		if (container_name[0] == '-')
+			continue;
+		if (strncmp(container_name, "md", 2) == 0) {
+			devnum = devname2devnum(container_name);
 			devname = devnum2devname(devnum);
-	}
+			if (strcmp(container_name, devname) != 0)
+				devname = NULL;
+		} else {
+			struct stat st;
+
+			devnum = NoMdDev;
+			if (stat(container_name, &st) == 0)
+				devnum = stat2devnum(&st);
+			if (devnum == NoMdDev)
+				devname = NULL;
+			else
+				devname = devnum2devname(devnum);
+		}
 
-	if (!devname) {
-		fprintf(stderr, "mdmon: %s is not a valid md device name\n",
-			container_name);
-		exit(1);
+		if (!devname) {
+			fprintf(stderr, "mdmon: %s is not a valid md device name\n",
+				container_name);
+			exit(1);
+		}
+		if (stats)
+			return show_stats(devname);
+		if (listed(containers, devnum))
+			continue;
+		*tail = new_container(devname, devnum);
+		tail = &(*tail)->next;
 	}
-	return mdmon(devname, devnum, do_fork(), takeover);
+
+	if (takeover)
+		take_all(containers);
+	return mdmon(containers, all || do_fork(), takeover);
 }
 
-static int mdmon(char *devname, int devnum, int must_fork, int takeover)
+static int load_container(struct supertype *container, int mdfd)
 {
-	int mdfd;
+	/* Check that this is a container we can look after, and
+	 * find its devices.  Returns 0, or a status to exit with.
+	 */
+	char *devname = container->devname;
 	struct mdinfo *mdi, *di;
-	struct supertype *container;
+
+	mdi = sysfs_read(mdfd, container->devnum, GET_VERSION|GET_LEVEL|GET_DEVS);
+
+	if (!mdi) {
+		fprintf(stderr, "mdmon: failed to load sysfs info for %s\n",
+			container->devname);
+		return 3;
+	}
+	if (mdi->array.level != UnSet) {
+		fprintf(stderr, "mdmon: %s is not a container - cannot monitor\n",
+			devname);
+		sysfs_free(mdi);
+		return 3;
+	}
+	if (mdi->array.major_version != -1 ||
+	    mdi->array.minor_version != -2) {
+		fprintf(stderr, "mdmon: %s does not use external metadata - cannot monitor\n",
+			devname);
+		sysfs_free(mdi);
+		return 3;
+	}
+
+	container->ss = version_to_superswitch(mdi->text_version);
+	if (container->ss == NULL) {
+		fprintf(stderr, "mdmon: %s uses unsupported metadata: %s\n",
+			devname, mdi->text_version);
+		sysfs_free(mdi);
+		return 3;
+	}
+
+	container->devs = NULL;
+	for (di = mdi->devs; di; di = di->next) {
+		struct mdinfo *cd = malloc(sizeof(*cd));
+		*cd = *di;
+		cd->next = container->devs;
+		container->devs = cd;
+		track_writes(container, cd->disk.major, cd->disk.minor);
+	}
+	sysfs_free(mdi);
+	return 0;
+}
+
+static int mdmon(struct supertype *containers, int must_fork, int takeover)
+{
+	/* Look after every container in the list with the one pair of
+	 * threads.  Each still gets its own pidfile and socket, so
+	 * mdadm needn't know whether anyone else is sharing.
+	 */
+	struct supertype *container, **cp;
+	int n, i, j;
+	int *mdfd;
 	sigset_t set;
 	struct sigaction act;
 	int pfd[2];
-	int status;
+	int status = 0;
 	int ignore;
-	pid_t victim = -1;
-	int victim_sock = -1;
-
-	dprintf("starting mdmon for %s\n", devname);
-
-	mdfd = open_dev(devnum);
-	if (mdfd < 0) {
-		fprintf(stderr, "mdmon: %s: %s\n", devname,
-			strerror(errno));
+	pid_t *victim;
+	int *victim_sock;
+
+	for (n = 0, container = containers; container; container = container->next)
+		n++;
+	mdfd = calloc(n, sizeof(*mdfd));
+	victim = calloc(n, sizeof(*victim));
+	victim_sock = calloc(n, sizeof(*victim_sock));
+	if (!mdfd || !victim || !victim_sock) {
+		fprintf(stderr, "mdmon: out of memory\n");
 		return 1;
 	}
-	if (md_get_version(mdfd) < 0) {
-		fprintf(stderr, "mdmon: %s: Not an md device\n",
-			devname);
-		return 1;
+
+	for (i = 0, cp = &containers; (container = *cp) != NULL; ) {
+		char *devname = container->devname;
+
+		dprintf("starting mdmon for %s\n", devname);
+
+		mdfd[i] = open_dev(container->devnum);
+		if (mdfd[i] < 0) {
+			fprintf(stderr, "mdmon: %s: %s\n", devname,
+				strerror(errno));
+			status = 1;
+			*cp = container->next;
+			continue;
+		}
+		if (md_get_version(mdfd[i]) < 0) {
+			fprintf(stderr, "mdmon: %s: Not an md device\n",
+				devname);
+			close(mdfd[i]);
+			status = 1;
+			*cp = container->next;
+			continue;
+		}
+		cp = &container->next;
+		i++;
 	}
+	if (!containers)
+		return status;
 
 	/* Fork, and have the child tell us when they are ready */
 	if (must_fork) {
@@ -394,98 +633,73 @@ static int mdmon(char *devname, int devnum, int must_fork, int takeover)
 	} else
 		pfd[0] = pfd[1] = -1;
 
-	container = calloc(1, sizeof(*container));
-	container->devnum = devnum;
-	container->devname = devname;
-	container->arrays = NULL;
-	container->subarray[0] = 0;
-	container->sock = -1;
-
-	if (!container->devname) {
-		fprintf(stderr, "mdmon: failed to allocate container name string\n");
-		exit(3);
-	}
-
-	mdi = sysfs_read(mdfd, container->devnum, GET_VERSION|GET_LEVEL|GET_DEVS);
-
-	if (!mdi) {
-		fprintf(stderr, "mdmon: failed to load sysfs info for %s\n",
-			container->devname);
-		exit(3);
-	}
-	if (mdi->array.level != UnSet) {
-		fprintf(stderr, "mdmon: %s is not a container - cannot monitor\n",
-			devname);
-		exit(3);
-	}
-	if (mdi->array.major_version != -1 ||
-	    mdi->array.minor_version != -2) {
-		fprintf(stderr, "mdmon: %s does not use external metadata - cannot monitor\n",
-			devname);
-		exit(3);
-	}
-
-	container->ss = version_to_superswitch(mdi->text_version);
-	if (container->ss == NULL) {
-		fprintf(stderr, "mdmon: %s uses unsupported metadata: %s\n",
-			devname, mdi->text_version);
-		exit(3);
-	}
+	safemode_conf = conf_get_safemode();
 
-	container->devs = NULL;
-	for (di = mdi->devs; di; di = di->next) {
-		struct mdinfo *cd = malloc(sizeof(*cd));
-		*cd = *di;
-		cd->next = container->devs;
-		container->devs = cd;
-	}
-	sysfs_free(mdi);
-
-	/* SIGUSR is sent between parent and child.  So both block it
-	 * and enable it only with pselect.
+	/* SIGTERM is blocked in both threads.  The manager enables it
+	 * only with pselect, the monitor collects it with a signalfd.
 	 */
 	sigemptyset(&set);
-	sigaddset(&set, SIGUSR1);
 	sigaddset(&set, SIGTERM);
 	sigprocmask(SIG_BLOCK, &set, NULL);
-	act.sa_handler = wake_me;
 	act.sa_flags = 0;
-	sigaction(SIGUSR1, &act, NULL);
 	act.sa_handler = term;
 	sigaction(SIGTERM, &act, NULL);
 	act.sa_handler = SIG_IGN;
 	sigaction(SIGPIPE, &act, NULL);
 
-	victim = mdmon_pid(container->devnum);
-	if (victim >= 0)
-		victim_sock = connect_monitor(container->devname);
-
 	ignore = chdir("/");
-	if (!takeover && victim > 0 && victim_sock >= 0) {
-		if (fping_monitor(victim_sock) == 0) {
-			fprintf(stderr, "mdmon: %s already managed\n",
-				container->devname);
-			exit(3);
+	for (i = 0, cp = &containers; (container = *cp) != NULL; i++) {
+		char *devname = container->devname;
+		int rv = load_container(container, mdfd[i]);
+
+		victim[i] = -1;
+		victim_sock[i] = -1;
+		if (rv == 0) {
+			victim[i] = mdmon_pid(container->devnum);
+			if (victim[i] >= 0)
+				victim_sock[i] = connect_monitor(devname);
+			if (!takeover && victim[i] > 0 && victim_sock[i] >= 0 &&
+			    fping_monitor(victim_sock[i]) == 0) {
+				fprintf(stderr, "mdmon: %s already managed\n",
+					devname);
+				rv = 3;
+			}
 		}
-		close(victim_sock);
-	}
-	if (container->ss->load_super(container, mdfd, devname)) {
-		fprintf(stderr, "mdmon: Cannot load metadata for %s\n",
-			devname);
-		exit(3);
-	}
-	close(mdfd);
-
-	/* Ok, this is close enough.  We can say goodbye to our parent now.
-	 */
-	if (victim > 0)
-		remove_pidfile(devname);
-	if (make_pidfile(devname) < 0) {
-		exit(3);
+		if (rv == 0 && !takeover && victim_sock[i] >= 0) {
+			close(victim_sock[i]);
+			victim_sock[i] = -1;
+		}
+		if (rv == 0 &&
+		    container->ss->load_super(container, mdfd[i], devname)) {
+			fprintf(stderr, "mdmon: Cannot load metadata for %s\n",
+				devname);
+			rv = 3;
+		}
+		close(mdfd[i]);
+
+		/* Ok, this is close enough.  We can say goodbye to our
+		 * parent once every container is ready.
+		 */
+		if (rv == 0) {
+			if (victim[i] > 0)
+				remove_pidfile(devname);
+			if (make_pidfile(devname) < 0)
+				rv = 3;
+		}
+		if (rv) {
+			status |= rv;
+			if (victim_sock[i] >= 0)
+				close(victim_sock[i]);
+			victim[i] = -1;
+			*cp = container->next;
+			continue;
+		}
+		container->sock = make_control_sock(devname);
+		cp = &container->next;
 	}
-	container->sock = make_control_sock(devname);
+	if (!containers)
+		exit(status);
 
-	status = 0;
 	if (write(pfd[1], &status, sizeof(status)) < 0)
 		fprintf(stderr, "mdmon: failed to notify our parent: %d\n",
 			getppid());
@@ -493,17 +707,49 @@ static int mdmon(char *devname, int devnum, int must_fork, int takeover)
 
 	mlockall(MCL_CURRENT | MCL_FUTURE);
 
-	if (clone_monitor(container) < 0) {
-		fprintf(stderr, "mdmon: failed to start monitor process: %s\n",
+	monitor_event = eventfd(0, 0);
+	manager_event = eventfd(0, 0);
+	if (monitor_event < 0 || manager_event < 0) {
+		fprintf(stderr, "mdmon: failed to create eventfd: %s\n",
 			strerror(errno));
 		exit(2);
 	}
+	fcntl(monitor_event, F_SETFD, FD_CLOEXEC);
+	fcntl(monitor_event, F_SETFL, O_NONBLOCK);
+	fcntl(manager_event, F_SETFD, FD_CLOEXEC);
+	fcntl(manager_event, F_SETFL, O_NONBLOCK);
+
+	/* Ask each mdmon we are replacing for its arrays, which is much
+	 * quicker than finding them all again while nothing watches
+	 * them.  One that doesn't understand is killed, as before.
+	 */
+	for (i = 0; i < n; i++) {
+		if (victim[i] <= 0 || victim_sock[i] < 0 ||
+		    take_over(containers, victim_sock[i]) != 0)
+			continue;
+		/* that one looked after all of its containers */
+		for (j = n - 1; j >= i; j--)
+			if (victim[j] == victim[i]) {
+				close(victim_sock[j]);
+				victim[j] = -1;
+			}
+	}
 
-	if (victim > 0) {
-		try_kill_monitor(victim, container->devname, victim_sock);
-		close(victim_sock);
+#ifdef USE_PTHREADS
+	metadata_writer = write_in_parallel;
+#endif
+	if (clone_monitor(containers) < 0) {
+		fprintf(stderr, "mdmon: failed to start monitor process: %s\n",
+			strerror(errno));
+		exit(2);
 	}
 
+	for (i = 0; i < n; i++)
+		if (victim[i] > 0) {
+			try_kill_monitor(victim[i], victim_sock[i]);
+			close(victim_sock[i]);
+		}
+
 	setsid();
 	close(0);
 	open("/dev/null", O_RDWR);
@@ -514,7 +760,7 @@ static int mdmon(char *devname, int devnum, int must_fork, int takeover)
 	ignore = dup(0);
 #endif
 
-	do_manager(container);
+	do_manager(containers);
 
 	exit(0);
 }
@@ -46,6 +46,19 @@ struct active_array {
 	enum sync_action prev_action, curr_action, next_action;
 
 	int check_degraded; /* flag set by mon, read by manage */
+	int watched; /* fds are in the monitor's epoll set */
+	int commit_pending; /* read_and_act() is waiting for sync_metadata */
+	int state_written; /* array_state must be read again */
+
+	/* from waking to find 'write-pending' to writing 'active' */
+	struct timespec wp_start;
+	struct latency wp_lat;
+
+	/* safe_mode_delay, if SAFEMODE asks us to adjust it */
+	int safe_mode_fd;
+	unsigned long sm_min, sm_delay; /* msecs */
+	int sm_flips; /* times write-pending seen since sm_window */
+	long sm_window;
 
 	int devnum;
 };
@@ -60,8 +73,83 @@ struct active_array {
  * Updates are created and processed by code under the
  * superswitch.  All common code sees them as opaque
  * blobs.
+ *
+ * The queue is a ring of UPDATE_SLOTS entries.  Only the manager
+ * moves 'head' and 'tail', and only the monitor moves 'done', so no
+ * locking is needed.  Entries from 'done' to 'head' are waiting for
+ * the monitor, entries from 'tail' to 'done' have been handled and
+ * are waiting to be freed.  If the ring is full, the manager keeps
+ * further updates on a list until there is room.
+ */
+#define UPDATE_SLOTS 64
+struct update_ring {
+	struct metadata_update *slot[UPDATE_SLOTS];
+	volatile unsigned int head, done, tail;
+};
+extern struct update_ring update_ring;
+
+/* Each thread wakes the other by writing to its eventfd.  To ping the
+ * monitor, the manager increments ping_req and waits for the monitor
+ * to copy it to ping_ack after a complete pass over the arrays.
+ */
+extern int monitor_event, manager_event;
+extern volatile unsigned int ping_req, ping_ack;
+
+/* For --takeover, the old mdmon hands its arrays to the new one over
+ * the control socket (MSG_HANDOFF) rather than the new one reading
+ * everything again while nothing is watching the arrays.
+ * The manager sets 'handoff' to HANDOFF_REQ, the monitor makes one
+ * more full pass and sets HANDOFF_FROZEN, then touches nothing until
+ * it is cleared, which only happens if the handoff fails.
+ * The state is a struct handoff, then for each container a struct
+ * handoff_container and its arrays, each a struct handoff_array
+ * followed by its disks.  The fds follow, and the records give their
+ * place in that list, or -1.
+ * Both sides are the same program, so the mdinfo is sent as it is;
+ * 'info_size' and 'version' guard against that not being true.
  */
-extern struct metadata_update *update_queue, *update_queue_handled;
+extern volatile int handoff;
+#define HANDOFF_REQ	1
+#define HANDOFF_FROZEN	2
+
+#define HANDOFF_MAGIC	0x6f68646d	/* "mdho" */
+#define HANDOFF_VERSION	1
+
+struct handoff {
+	__u32 magic;
+	int version;
+	int info_size;
+	int containers;
+	int fds;
+	int pad;	/* keep the records after it aligned */
+};
+
+struct handoff_container {
+	int devnum;
+	int arrays;
+	int has_generation;
+	unsigned long long generation;
+};
+
+enum { HO_STATE, HO_ACTION, HO_RESYNC_START, HO_METADATA, HO_SYNC_COMPLETED,
+       HO_SAFE_MODE, HO_FDS };
+
+struct handoff_array {
+	struct mdinfo info;
+	int devnum;
+	int disks;
+	int fd[HO_FDS];
+	unsigned long long last_checkpoint;
+	enum array_state prev_state;
+	enum sync_action prev_action;
+	int check_degraded;
+	unsigned long sm_min, sm_delay;
+};
+
+struct handoff_disk {
+	struct mdinfo info;
+	int state_fd, recovery_fd;
+};
 
 #define MD_MAJOR 9
 
@@ -72,8 +160,11 @@ extern struct md_generic_cmd *active_cmd;
 
 
 void remove_pidfile(char *devname);
-void do_monitor(struct supertype *container);
-void do_manager(struct supertype *container);
+void do_monitor(struct supertype *containers);
+void do_manager(struct supertype *containers);
+void track_writes(struct supertype *container, int major, int minor);
+int take_over(struct supertype *containers, int sock);
+extern unsigned long takeover_usecs;
 extern int sigterm;
 
 int read_dev_state(int fd);
@@ -81,9 +172,12 @@ int is_container_member(struct mdstat_ent *mdstat, char *container);
 
 struct mdstat_ent *mdstat_read(int hold, int start);
 
+extern struct safemodeinfo *safemode_conf;
+
 extern int exit_now, manager_ready;
+/* counted by the monitor, for --stats */
+extern unsigned long monitor_wakeups, monitor_reads;
 extern int mon_tid, mgr_tid;
-extern int monitor_loop_cnt;
 
 /* helper routine to determine resync completion since MaxSector is a
  * moving target
@@ -0,0 +1,730 @@
+/*
+ * mdsim - build and exercise a synthetic md sysfs/mdstat tree.
+ *
+ * Copyright (C) 2010 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * mdadm and mdmon find everything they know about running arrays in
+ * /sys/block/mdX/md, /proc/mdstat and the state files under /dev/.mdadm.
+ * If MDADM_ROOT is set they look for all of those below that directory
+ * instead.  This program populates such a directory with as many fake
+ * arrays as you like, and then changes them in the ways the kernel
+ * would so that the reaction time of "mdadm --monitor" or mdmon can be
+ * measured without needing hundreds of real devices.
+ *
+ *   mdsim -r /tmp/sim populate 200 8
+ *   MDADM_ROOT=/tmp/sim mdadm --monitor --scan -p /tmp/alert &
+ *   mdsim -r /tmp/sim bench -k fail -n 100 -i 50 -w /tmp/alert.log
+ *
+ * where /tmp/alert is a script that appends a line to /tmp/alert.log.
+ *
+ * Components are given a fake major number (SIM_MAJOR) and are named
+ * simN.  Nothing ever opens them; only their sysfs entries exist.
+ *
+ * The tree itself is the model: every command re-reads what it needs
+ * from the files and regenerates /proc/mdstat after making a change.
+ * Attributes are always rewritten in place so that anyone holding an
+ * open file descriptor sees the new value.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define SIM_MAJOR	240
+#define MAX_MEMBERS	1024
+
+static char *root;
+
+static void usage(void)
+{
+	fprintf(stderr,
+"Usage: mdsim [-r root] command ...\n"
+"  populate arrays disks [level [metadata]]\n"
+"                        create a tree with 'arrays' arrays of 'disks' members\n"
+"  fail array slot       mark a member faulty\n"
+"  recover array slot    return a member to in_sync\n"
+"  sync array action pct set sync_action and advance sync_completed\n"
+"  io array slot count ms add 'count' 4K reads taking 'ms' in all to\n"
+"                        the stat file of a member\n"
+"  state array state     write array_state\n"
+"  mdstat                regenerate /proc/mdstat from the tree\n"
+"  bench [-k fail|sync|write-pending] [-n count] [-i interval-ms]\n"
+"        [-t timeout-ms] [-w file] [-s seed]\n"
+"                        make 'count' changes and time the reaction to each,\n"
+"                        seen as growth of 'file' or array_state leaving\n"
+"                        write-pending\n"
+"The root defaults to $MDADM_ROOT.\n");
+	exit(2);
+}
+
+static void die(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "mdsim: ");
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(1);
+}
+
+static void mkpath(char *path)
+{
+	char *p;
+
+	for (p = path + 1; *p; p++)
+		if (*p == '/') {
+			*p = 0;
+			mkdir(path, 0755);
+			*p = '/';
+		}
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		die("cannot create %s: %s\n", path, strerror(errno));
+}
+
+static void put(const char *val, const char *fmt, ...)
+{
+	char path[PATH_MAX];
+	va_list ap;
+	int fd, n;
+
+	n = sprintf(path, "%s", root);
+	va_start(ap, fmt);
+	vsnprintf(path + n, sizeof(path) - n, fmt, ap);
+	va_end(ap);
+
+	/* rewrite in place - never rename - so open fds see the change */
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0)
+		die("cannot write %s: %s\n", path, strerror(errno));
+	if (write(fd, val, strlen(val)) != (ssize_t)strlen(val) ||
+	    write(fd, "\n", 1) != 1)
+		die("short write to %s\n", path);
+	close(fd);
+}
+
+static int get(char *buf, int len, const char *fmt, ...)
+{
+	char path[PATH_MAX];
+	va_list ap;
+	int fd, n;
+
+	n = sprintf(path, "%s", root);
+	va_start(ap, fmt);
+	vsnprintf(path + n, sizeof(path) - n, fmt, ap);
+	va_end(ap);
+
+	buf[0] = 0;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n < 0)
+		return -1;
+	buf[n] = 0;
+	if (n && buf[n-1] == '\n')
+		buf[--n] = 0;
+	return n;
+}
+
+static void link_to(const char *target, const char *fmt, ...)
+{
+	char path[PATH_MAX];
+	va_list ap;
+	int n;
+
+	n = sprintf(path, "%s", root);
+	va_start(ap, fmt);
+	vsnprintf(path + n, sizeof(path) - n, fmt, ap);
+	va_end(ap);
+	unlink(path);
+	if (symlink(target, path) < 0)
+		die("cannot link %s: %s\n", path, strerror(errno));
+}
+
+static void dir(const char *fmt, ...)
+{
+	char path[PATH_MAX];
+	va_list ap;
+	int n;
+
+	n = sprintf(path, "%s", root);
+	va_start(ap, fmt);
+	vsnprintf(path + n, sizeof(path) - n, fmt, ap);
+	va_end(ap);
+	mkpath(path);
+}
+
+/* One member as seen when regenerating mdstat */
+struct member {
+	char name[64];
+	int slot;
+	int faulty, in_sync;
+};
+
+static int cmp_member(const void *a, const void *b)
+{
+	const struct member *ma = a, *mb = b;
+
+	/* the kernel lists the most recently added device first */
+	if (ma->slot != mb->slot)
+		return mb->slot - ma->slot;
+	return strcmp(mb->name, ma->name);
+}
+
+static int read_members(int md, struct member *m)
+{
+	char path[PATH_MAX];
+	char buf[100];
+	DIR *d;
+	struct dirent *de;
+	int n = 0;
+
+	sprintf(path, "%s/sys/block/md%d/md", root, md);
+	d = opendir(path);
+	if (!d)
+		return -1;
+	while ((de = readdir(d)) != NULL && n < MAX_MEMBERS) {
+		if (strncmp(de->d_name, "dev-", 4) != 0)
+			continue;
+		strncpy(m[n].name, de->d_name + 4, sizeof(m[n].name) - 1);
+		m[n].name[sizeof(m[n].name) - 1] = 0;
+		get(buf, sizeof(buf), "/sys/block/md%d/md/%s/slot",
+		    md, de->d_name);
+		m[n].slot = (strcmp(buf, "none") == 0) ? -1 : atoi(buf);
+		get(buf, sizeof(buf), "/sys/block/md%d/md/%s/state",
+		    md, de->d_name);
+		m[n].faulty = strstr(buf, "faulty") != NULL;
+		m[n].in_sync = strstr(buf, "in_sync") != NULL;
+		n++;
+	}
+	closedir(d);
+	qsort(m, n, sizeof(*m), cmp_member);
+	return n;
+}
+
+static int array_list(int *mds, int max)
+{
+	char path[PATH_MAX];
+	DIR *d;
+	struct dirent *de;
+	int n = 0;
+
+	sprintf(path, "%s/sys/block", root);
+	d = opendir(path);
+	if (!d)
+		return 0;
+	while ((de = readdir(d)) != NULL && n < max) {
+		char *ep;
+		int md;
+
+		if (strncmp(de->d_name, "md", 2) != 0)
+			continue;
+		md = strtol(de->d_name + 2, &ep, 10);
+		if (ep == de->d_name + 2 || *ep)
+			continue;
+		mds[n++] = md;
+	}
+	closedir(d);
+	return n;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static void write_mdstat(void)
+{
+	static struct member m[MAX_MEMBERS];
+	static int mds[65536];
+	char path[PATH_MAX];
+	char *text;
+	size_t len;
+	FILE *f;
+	int nmd, i, fd;
+
+	nmd = array_list(mds, 65536);
+	qsort(mds, nmd, sizeof(int), cmp_int);
+
+	f = open_memstream(&text, &len);
+	if (!f)
+		die("no memory for mdstat\n");
+	fprintf(f, "Personalities : [raid1] [raid6] [raid5] [raid4]\n");
+	for (i = nmd - 1; i >= 0; i--) {
+		char level[30], meta[60], action[30], done[60], state[30];
+		char pattern[MAX_MEMBERS + 1];
+		int raid_disks, working = 0;
+		unsigned long long size, a = 0, b = 0;
+		char buf[60];
+		int n, j;
+
+		n = read_members(mds[i], m);
+		if (n < 0)
+			continue;
+		get(level, sizeof(level), "/sys/block/md%d/md/level", mds[i]);
+		get(meta, sizeof(meta), "/sys/block/md%d/md/metadata_version",
+		    mds[i]);
+		get(action, sizeof(action), "/sys/block/md%d/md/sync_action",
+		    mds[i]);
+		get(done, sizeof(done), "/sys/block/md%d/md/sync_completed",
+		    mds[i]);
+		get(state, sizeof(state), "/sys/block/md%d/md/array_state",
+		    mds[i]);
+		get(buf, sizeof(buf), "/sys/block/md%d/md/raid_disks", mds[i]);
+		raid_disks = atoi(buf);
+		get(buf, sizeof(buf), "/sys/block/md%d/md/component_size",
+		    mds[i]);
+		size = strtoull(buf, NULL, 10);
+
+		if (strcmp(state, "inactive") == 0) {
+			fprintf(f, "md%d : inactive", mds[i]);
+			for (j = 0; j < n; j++)
+				fprintf(f, " %s[%d](S)", m[j].name, j);
+			fprintf(f, "\n      0 blocks super %s\n\n", meta);
+			continue;
+		}
+		fprintf(f, "md%d : active %s", mds[i], level);
+		memset(pattern, '_', raid_disks);
+		pattern[raid_disks < MAX_MEMBERS ? raid_disks : MAX_MEMBERS] = 0;
+		for (j = 0; j < n; j++) {
+			fprintf(f, " %s[%d]%s", m[j].name,
+				m[j].slot >= 0 ? m[j].slot : raid_disks + j,
+				m[j].faulty ? "(F)" :
+				m[j].slot < 0 ? "(S)" : "");
+			if (m[j].slot >= 0 && m[j].slot < raid_disks &&
+			    m[j].in_sync && !m[j].faulty) {
+				pattern[m[j].slot] = 'U';
+				working++;
+			}
+		}
+		fprintf(f, "\n      %llu blocks super %s [%d/%d] [%s]\n",
+			size * (raid_disks > 1 ? raid_disks - 1 : 1), meta,
+			raid_disks, working, pattern);
+		if (strcmp(action, "idle") != 0 &&
+		    sscanf(done, "%llu / %llu", &a, &b) == 2 && b) {
+			unsigned long long permille = a * 1000 / b;
+			char bar[21];
+
+			memset(bar, '.', 20);
+			bar[20] = 0;
+			memset(bar, '=', permille / 50);
+			bar[permille / 50 < 20 ? permille / 50 : 19] = '>';
+			fprintf(f, "      [%s]  %s = %llu.%llu%% (%llu/%llu) "
+				"finish=1.0min speed=100000K/sec\n",
+				bar, strcmp(action, "recover") == 0 ?
+				"recovery" : action,
+				permille / 10, permille % 10, a / 2, b / 2);
+		}
+		fprintf(f, "\n");
+	}
+	fprintf(f, "unused devices: <none>\n");
+	fclose(f);
+
+	/* mdadm keeps mdstat open and re-reads from the start, so the
+	 * file must be rewritten in place.  Do it in one write so a
+	 * reader is unlikely to see half of it.
+	 */
+	sprintf(path, "%s/proc/mdstat", root);
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0 || write(fd, text, len) != (ssize_t)len)
+		die("cannot write %s: %s\n", path, strerror(errno));
+	close(fd);
+	free(text);
+}
+
+static void update_degraded(int md)
+{
+	static struct member m[MAX_MEMBERS];
+	char buf[30];
+	int raid_disks, n, j, working = 0;
+
+	get(buf, sizeof(buf), "/sys/block/md%d/md/raid_disks", md);
+	raid_disks = atoi(buf);
+	n = read_members(md, m);
+	for (j = 0; j < n; j++)
+		if (m[j].slot >= 0 && m[j].slot < raid_disks &&
+		    m[j].in_sync && !m[j].faulty)
+			working++;
+	sprintf(buf, "%d", raid_disks - working);
+	put(buf, "/sys/block/md%d/md/degraded", md);
+}
+
+static void populate(int arrays, int disks, char *level, char *metadata)
+{
+	unsigned long long size = 1048576; /* K per member */
+	char buf[100];
+	int md, d;
+
+	dir("/proc");
+	dir("/dev/.mdadm");
+	dir("/sys/dev/block");
+	put("Block devices:\n  9 md\n240 sim\n254 mdp", "/proc/devices");
+
+	for (md = 0; md < arrays; md++) {
+		dir("/sys/block/md%d/md", md);
+		dir("/sys/block/md%d/holders", md);
+		sprintf(buf, "9:%d", md);
+		put(buf, "/sys/block/md%d/dev", md);
+		put("", "/sys/block/md%d/uevent", md);
+		put("0 0 0 0 0 0 0 0 0 0 0", "/sys/block/md%d/stat", md);
+		sprintf(buf, "../../block/md%d", md);
+		link_to(buf, "/sys/dev/block/9:%d", md);
+
+		put(level, "/sys/block/md%d/md/level", md);
+		put(metadata, "/sys/block/md%d/md/metadata_version", md);
+		sprintf(buf, "%d", disks);
+		put(buf, "/sys/block/md%d/md/raid_disks", md);
+		put("0", "/sys/block/md%d/md/degraded", md);
+		put("clean", "/sys/block/md%d/md/array_state", md);
+		put("idle", "/sys/block/md%d/md/sync_action", md);
+		put("none", "/sys/block/md%d/md/sync_completed", md);
+		put("0", "/sys/block/md%d/md/sync_speed", md);
+		put("200000", "/sys/block/md%d/md/sync_speed_max", md);
+		put("1000", "/sys/block/md%d/md/sync_speed_min", md);
+		put("0", "/sys/block/md%d/md/sync_min", md);
+		put("max", "/sys/block/md%d/md/sync_max", md);
+		put("0", "/sys/block/md%d/md/mismatch_cnt", md);
+		put("none", "/sys/block/md%d/md/resync_start", md);
+		put("0.200", "/sys/block/md%d/md/safe_mode_delay", md);
+		put("65536", "/sys/block/md%d/md/chunk_size", md);
+		put("2", "/sys/block/md%d/md/layout", md);
+		sprintf(buf, "%llu", size);
+		put(buf, "/sys/block/md%d/md/component_size", md);
+
+		for (d = 0; d < disks; d++) {
+			int minor = md * disks + d;
+
+			dir("/sys/block/sim%d/device", minor);
+			dir("/sys/block/sim%d/holders", minor);
+			sprintf(buf, "%d:%d", SIM_MAJOR, minor);
+			put(buf, "/sys/block/sim%d/dev", minor);
+			put("running", "/sys/block/sim%d/device/state", minor);
+			put("0 0 0 0 0 0 0 0 0 0 0", "/sys/block/sim%d/stat",
+			    minor);
+			sprintf(buf, "%llu", size * 2 + 4096);
+			put(buf, "/sys/block/sim%d/size", minor);
+			sprintf(buf, "../../md%d", md);
+			link_to(buf, "/sys/block/sim%d/holders/md%d",
+				minor, md);
+			sprintf(buf, "../../sim%d", minor);
+			link_to(buf, "/sys/block/md%d/holders/sim%d",
+				md, minor);
+			sprintf(buf, "../../block/sim%d", minor);
+			link_to(buf, "/sys/dev/block/%d:%d", SIM_MAJOR, minor);
+
+			dir("/sys/block/md%d/md/dev-sim%d", md, minor);
+			sprintf(buf, "../../../sim%d", minor);
+			link_to(buf, "/sys/block/md%d/md/dev-sim%d/block",
+				md, minor);
+			sprintf(buf, "%d", d);
+			put(buf, "/sys/block/md%d/md/dev-sim%d/slot", md, minor);
+			sprintf(buf, "dev-sim%d", minor);
+			link_to(buf, "/sys/block/md%d/md/rd%d", md, d);
+			put("in_sync", "/sys/block/md%d/md/dev-sim%d/state",
+			    md, minor);
+			put("0", "/sys/block/md%d/md/dev-sim%d/errors",
+			    md, minor);
+			put("2048", "/sys/block/md%d/md/dev-sim%d/offset",
+			    md, minor);
+			sprintf(buf, "%llu", size);
+			put(buf, "/sys/block/md%d/md/dev-sim%d/size",
+			    md, minor);
+			put("none", "/sys/block/md%d/md/dev-sim%d/recovery_start",
+			    md, minor);
+		}
+	}
+	write_mdstat();
+}
+
+static char *member_of(int md, int slot, char *name)
+{
+	static struct member m[MAX_MEMBERS];
+	int n, j;
+
+	n = read_members(md, m);
+	for (j = 0; j < n; j++)
+		if (m[j].slot == slot) {
+			sprintf(name, "dev-%s", m[j].name);
+			return name;
+		}
+	die("md%d has no member in slot %d\n", md, slot);
+	return NULL;
+}
+
+static void set_member(int md, int slot, int faulty)
+{
+	char name[80];
+
+	member_of(md, slot, name);
+	put(faulty ? "faulty" : "in_sync", "/sys/block/md%d/md/%s/state",
+	    md, name);
+	update_degraded(md);
+	write_mdstat();
+}
+
+static void set_sync(int md, char *action, int percent)
+{
+	char buf[100];
+	unsigned long long size;
+
+	get(buf, sizeof(buf), "/sys/block/md%d/md/component_size", md);
+	size = strtoull(buf, NULL, 10) * 2;
+	if (strcmp(action, "idle") == 0 || percent >= 100) {
+		/* Like the kernel, remember where an interrupted check
+		 * got to in sync_min, and forget it when one finishes.
+		 */
+		get(buf, sizeof(buf), "/sys/block/md%d/md/sync_completed", md);
+		if (percent >= 100 || strcmp(buf, "none") == 0)
+			strcpy(buf, "0");
+		else
+			buf[strcspn(buf, " ")] = 0;
+		put(buf, "/sys/block/md%d/md/sync_min", md);
+	}
+	put(action, "/sys/block/md%d/md/sync_action", md);
+	if (strcmp(action, "idle") == 0 || percent >= 100) {
+		put("idle", "/sys/block/md%d/md/sync_action", md);
+		put("none", "/sys/block/md%d/md/sync_completed", md);
+		put("0", "/sys/block/md%d/md/sync_speed", md);
+	} else {
+		sprintf(buf, "%llu / %llu", size * percent / 100, size);
+		put(buf, "/sys/block/md%d/md/sync_completed", md);
+		put("100000", "/sys/block/md%d/md/sync_speed", md);
+	}
+	write_mdstat();
+}
+
+static void add_io(int md, int slot, unsigned long long count,
+		   unsigned long long ms)
+{
+	char name[80], buf[300];
+	unsigned long long v[11];
+	int i;
+
+	member_of(md, slot, name);
+	get(buf, sizeof(buf), "/sys/block/md%d/md/%s/block/stat", md, name);
+	memset(v, 0, sizeof(v));
+	sscanf(buf, "%llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+	       &v[0], &v[1], &v[2], &v[3], &v[4], &v[5],
+	       &v[6], &v[7], &v[8], &v[9], &v[10]);
+	v[0] += count;
+	v[2] += count * 8;
+	v[3] += ms;
+	v[9] += ms;
+	v[10] += ms;
+	for (i = 0, buf[0] = 0; i < 11; i++)
+		sprintf(buf + strlen(buf), "%s%llu", i ? " " : "", v[i]);
+	put(buf, "/sys/block/md%d/md/%s/block/stat", md, name);
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static off_t file_size(char *file)
+{
+	struct stat stb;
+
+	if (stat(file, &stb) < 0)
+		return 0;
+	return stb.st_size;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return da < db ? -1 : da > db;
+}
+
+static void bench(int argc, char *argv[])
+{
+	char *kind = "fail";
+	char *watch = NULL;
+	int count = 100, interval = 100, timeout = 10000;
+	unsigned int seed = 1;
+	static int mds[65536];
+	double *lat;
+	int nmd, i, done = 0, missed = 0;
+	int opt;
+
+	optind = 1;
+	while ((opt = getopt(argc, argv, "k:n:i:t:w:s:")) != -1)
+		switch (opt) {
+		case 'k': kind = optarg; break;
+		case 'n': count = atoi(optarg); break;
+		case 'i': interval = atoi(optarg); break;
+		case 't': timeout = atoi(optarg); break;
+		case 'w': watch = optarg; break;
+		case 's': seed = atoi(optarg); break;
+		default: usage();
+		}
+	if (strcmp(kind, "write-pending") != 0 && !watch)
+		die("bench -k %s needs -w file to see the reaction\n", kind);
+
+	nmd = array_list(mds, 65536);
+	if (nmd == 0)
+		die("no arrays found below %s\n", root);
+	lat = calloc(count, sizeof(*lat));
+	srandom(seed);
+
+	for (i = 0; i < count; i++) {
+		int md = mds[random() % nmd];
+		double start, end;
+		off_t before = watch ? file_size(watch) : 0;
+		char buf[100];
+
+		start = now_ms();
+		if (strcmp(kind, "fail") == 0) {
+			char name[80];
+			int slot;
+
+			get(buf, sizeof(buf), "/sys/block/md%d/md/raid_disks",
+			    md);
+			slot = random() % atoi(buf);
+			get(buf, sizeof(buf), "/sys/block/md%d/md/%s/state",
+			    md, member_of(md, slot, name));
+			set_member(md, slot, strstr(buf, "faulty") == NULL);
+		} else if (strcmp(kind, "sync") == 0) {
+			int pct;
+
+			get(buf, sizeof(buf),
+			    "/sys/block/md%d/md/sync_completed", md);
+			if (strcmp(buf, "none") == 0)
+				pct = 0;
+			else {
+				unsigned long long a, b;
+				sscanf(buf, "%llu / %llu", &a, &b);
+				pct = b ? (a * 100 / b) + 20 : 100;
+			}
+			set_sync(md, "recover", pct);
+		} else if (strcmp(kind, "write-pending") == 0)
+			put("write-pending", "/sys/block/md%d/md/array_state",
+			    md);
+		else
+			die("unknown event kind %s\n", kind);
+
+		/* wait for someone to notice */
+		while (1) {
+			end = now_ms();
+			if (watch) {
+				if (file_size(watch) != before)
+					break;
+			} else {
+				get(buf, sizeof(buf),
+				    "/sys/block/md%d/md/array_state", md);
+				if (strcmp(buf, "write-pending") != 0)
+					break;
+			}
+			if (end - start > timeout)
+				break;
+			usleep(200);
+		}
+		if (end - start > timeout)
+			missed++;
+		else
+			lat[done++] = end - start;
+		if (end - start < interval)
+			usleep((interval - (end - start)) * 1000);
+	}
+
+	printf("events: %d  reacted: %d  timed out: %d\n", count, done, missed);
+	if (done) {
+		double sum = 0;
+
+		qsort(lat, done, sizeof(*lat), cmp_double);
+		for (i = 0; i < done; i++)
+			sum += lat[i];
+		printf("latency ms: min %.3f  avg %.3f  p50 %.3f  p99 %.3f"
+		       "  max %.3f\n", lat[0], sum / done, lat[done / 2],
+		       lat[(done * 99) / 100 < done ? (done * 99) / 100 :
+			   done - 1], lat[done - 1]);
+	}
+	free(lat);
+}
+
+int main(int argc, char *argv[])
+{
+	char *cmd;
+	int opt;
+
+	root = getenv("MDADM_ROOT");
+	while ((opt = getopt(argc, argv, "+r:")) != -1)
+		switch (opt) {
+		case 'r': root = optarg; break;
+		default: usage();
+		}
+	if (!root || !*root || strcmp(root, "/") == 0)
+		die("refusing to work on the real root; give -r DIR\n");
+	if (optind >= argc)
+		usage();
+	cmd = argv[optind++];
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (strcmp(cmd, "populate") == 0) {
+		if (argc < 3)
+			usage();
+		mkpath(root);
+		populate(atoi(argv[1]), atoi(argv[2]),
+			 argc > 3 ? argv[3] : "raid5",
+			 argc > 4 ? argv[4] : "1.2");
+	} else if (strcmp(cmd, "fail") == 0 || strcmp(cmd, "recover") == 0) {
+		if (argc != 3)
+			usage();
+		set_member(atoi(argv[1]), atoi(argv[2]),
+			   strcmp(cmd, "fail") == 0);
+	} else if (strcmp(cmd, "sync") == 0) {
+		if (argc != 4)
+			usage();
+		set_sync(atoi(argv[1]), argv[2], atoi(argv[3]));
+	} else if (strcmp(cmd, "io") == 0) {
+		if (argc != 5)
+			usage();
+		add_io(atoi(argv[1]), atoi(argv[2]), strtoull(argv[3], NULL, 10),
+		       strtoull(argv[4], NULL, 10));
+	} else if (strcmp(cmd, "state") == 0) {
+		if (argc != 3)
+			usage();
+		put(argv[2], "/sys/block/md%d/md/array_state", atoi(argv[1]));
+		write_mdstat();
+	} else if (strcmp(cmd, "mdstat") == 0)
+		write_mdstat();
+	else if (strcmp(cmd, "bench") == 0)
+		bench(argc, argv);
+	else
+		usage();
+	return 0;
+}
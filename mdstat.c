@@ -81,6 +81,7 @@
 #include	"mdadm.h"
 #include	"dlink.h"
 #include	<sys/select.h>
+#include	<poll.h>
 #include	<ctype.h>
 
 static void free_member_devnames(struct dev_member *m)
@@ -135,8 +136,11 @@ struct mdstat_ent *mdstat_read(int hold, int start)
 	if (hold && mdstat_fd != -1) {
 		lseek(mdstat_fd, 0L, 0);
 		f = fdopen(dup(mdstat_fd), "r");
-	} else
-		f = fopen("/proc/mdstat", "r");
+	} else {
+		char path[PATH_MAX];
+		sprintf(path, "%s/proc/mdstat", mdadm_root());
+		f = fopen(path, "r");
+	}
 	if (f == NULL)
 		return NULL;
 	else
@@ -296,38 +300,30 @@ void mdstat_wait(int seconds)
 	select(maxfd + 1, NULL, NULL, &fds, &tm);
 }
 
-void mdstat_wait_fd(int fd, const sigset_t *sigmask)
+#ifndef MDASSEMBLE
+int mdstat_watch(int epfd, void *cookie)
 {
-	fd_set fds, rfds;
-	int maxfd = 0;
-
-	FD_ZERO(&fds);
-	FD_ZERO(&rfds);
-	if (mdstat_fd >= 0)
-		FD_SET(mdstat_fd, &fds);
-
-	if (fd >= 0) {
-		struct stat stb;
-		fstat(fd, &stb);
-		if ((stb.st_mode & S_IFMT) == S_IFREG)
-			/* Must be a /proc or /sys fd, so expect
-			 * POLLPRI
-			 * i.e. an 'exceptional' event.
-			 */
-			FD_SET(fd, &fds);
-		else
-			FD_SET(fd, &rfds);
-
-		if (fd > maxfd)
-			maxfd = fd;
+	/* Arrange for changes to /proc/mdstat to be reported by
+	 * sysfs_watch_wait.  mdstat_read(1, ...) must have been
+	 * called first.
+	 */
+	char path[PATH_MAX];
 
-	}
-	if (mdstat_fd > maxfd)
-		maxfd = mdstat_fd;
+	if (mdstat_fd < 0)
+		return -1;
+	sprintf(path, "%s/proc/mdstat", mdadm_root());
+	return sysfs_watch_fd(epfd, mdstat_fd, path, cookie);
+}
 
-	pselect(maxfd + 1, &rfds, NULL, &fds,
-		NULL, sigmask);
+void mdstat_pollfd(struct pollfd *pfd)
+{
+	/* Fill in 'pfd' so that poll() reports changes to
+	 * /proc/mdstat.  If it isn't open, poll() will ignore it.
+	 */
+	pfd->fd = mdstat_fd;
+	pfd->events = POLLPRI;
 }
+#endif
 
 int mddev_busy(int devnum)
 {
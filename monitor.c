@@ -20,9 +20,11 @@
 
 #include "mdadm.h"
 #include "mdmon.h"
-#include <sys/syscall.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
 #include <signal.h>
+#include <poll.h>
 
 static char *array_states[] = {
 	"clear", "inactive", "suspended", "readonly", "read-auto",
@@ -36,16 +38,75 @@ static int write_attr(char *attr, int fd)
 	return write(fd, attr, strlen(attr));
 }
 
-static void add_fd(fd_set *fds, int *maxfd, int fd)
+/* The monitor waits on one epoll set which holds the attributes of
+ * every array it knows about, the eventfd the manager uses to get our
+ * attention, and a signalfd for SIGTERM.  Arrays are added to the set when
+ * they first appear in our list and taken out when they leave it, so
+ * a wakeup costs nothing for arrays that didn't change, and there is
+ * no limit on the number of fds.
+ */
+static int epfd = -1;
+static int sigfd = -1;
+static struct timespec woke;
+
+/* Each attribute has its own cookie, so that read_and_act() need
+ * only read again what has changed.  For the array's attributes it
+ * is the address of the fd, for a device it is the device.
+ */
+static int watch_fd(struct active_array *a, struct mdinfo *mdi, char *attr,
+		    int fd, void *cookie)
 {
+	char path[PATH_MAX];
+
 	if (fd < 0)
+		return 0;
+	/* the path is only needed if this is an ordinary file (mdsim) */
+	if (mdi)
+		snprintf(path, sizeof(path), "%s/sys/block/%s/md/%s/%s",
+			 mdadm_root(), a->info.sys_name, mdi->sys_name, attr);
+	else
+		snprintf(path, sizeof(path), "%s/sys/block/%s/md/%s",
+			 mdadm_root(), a->info.sys_name, attr);
+	return sysfs_watch_read(epfd, fd, path, cookie);
+}
+
+static void unwatch_array(struct active_array *a)
+{
+	struct mdinfo *mdi;
+
+	if (!a->watched)
 		return;
-	if (fd > *maxfd)
-		*maxfd = fd;
-	FD_SET(fd, fds);
+	sysfs_unwatch_fd(epfd, a->info.state_fd);
+	sysfs_unwatch_fd(epfd, a->action_fd);
+	sysfs_unwatch_fd(epfd, a->sync_completed_fd);
+	for (mdi = a->info.devs; mdi; mdi = mdi->next)
+		sysfs_unwatch_fd(epfd, mdi->state_fd);
+	a->watched = 0;
 }
 
-static int read_attr(char *buf, int len, int fd)
+static void watch_array(struct active_array *a)
+{
+	/* If we cannot watch all of them, watch none.  The array
+	 * is then checked on every wakeup, and we try again.
+	 */
+	struct mdinfo *mdi;
+	int err = 0;
+
+	a->watched = 1;
+	err |= watch_fd(a, NULL, "array_state", a->info.state_fd,
+			&a->info.state_fd);
+	err |= watch_fd(a, NULL, "sync_action", a->action_fd, &a->action_fd);
+	err |= watch_fd(a, NULL, "sync_completed", a->sync_completed_fd,
+			&a->sync_completed_fd);
+	for (mdi = a->info.devs; mdi; mdi = mdi->next)
+		err |= watch_fd(a, mdi, "state", mdi->state_fd, mdi);
+	if (err)
+		unwatch_array(a);
+}
+
+unsigned long monitor_wakeups, monitor_reads;
+
+static int read_fd(char *buf, int len, int fd)
 {
 	int n;
 
@@ -58,7 +119,7 @@ static int read_attr(char *buf, int len, int fd)
 
 	if (n <= 0) {
 		buf[0] = 0;
-		return 0;
+		return n;
 	}
 	buf[n] = 0;
 	if (buf[n-1] == '\n')
@@ -66,6 +127,23 @@ static int read_attr(char *buf, int len, int fd)
 	return n;
 }
 
+static int read_attr(char *buf, int len, int fd)
+{
+	/* As the monitor reads what fires, sysfs_watch_wait doesn't,
+	 * so an attribute that has gone away must be unwatched here or
+	 * it will keep firing.
+	 */
+	int n;
+
+	if (fd < 0)
+		return read_fd(buf, len, fd);
+	monitor_reads++;
+	n = read_fd(buf, len, fd);
+	if (n < 0 && errno == ENODEV)
+		sysfs_unwatch_fd(epfd, fd);
+	return n < 0 ? 0 : n;
+}
+
 static unsigned long long read_resync_start(int fd)
 {
 	char buf[30];
@@ -118,16 +196,11 @@ static enum sync_action read_action( int fd)
 	return (enum sync_action) sysfs_match_word(buf, sync_actions);
 }
 
-int read_dev_state(int fd)
+static int dev_state(char *buf)
 {
-	char buf[60];
-	int n = read_attr(buf, 60, fd);
 	char *cp;
 	int rv = 0;
 
-	if (n <= 0)
-		return 0;
-
 	cp = buf;
 	while (cp) {
 		if (sysfs_attr_match(cp, "faulty"))
@@ -147,11 +220,31 @@ int read_dev_state(int fd)
 	return rv;
 }
 
+int read_dev_state(int fd)
+{
+	/* for the manager, which mustn't touch the watches */
+	char buf[60];
+
+	if (read_fd(buf, 60, fd) <= 0)
+		return 0;
+	return dev_state(buf);
+}
+
+static int changed(void *cookie, void **fired, int nfired)
+{
+	int i;
+
+	if (nfired < 0)
+		return 1;
+	for (i = 0; i < nfired; i++)
+		if (fired[i] == cookie)
+			return 1;
+	return 0;
+}
+
 static void signal_manager(void)
 {
-	/* tgkill(getpid(), mon_tid, SIGUSR1); */
-	int pid = getpid();
-	syscall(SYS_tgkill, pid, mgr_tid, SIGUSR1);
+	eventfd_write(manager_event, 1);
 }
 
 /* Monitor a set of active md arrays - all of which share the
@@ -197,13 +290,18 @@ static void signal_manager(void)
  *
  *
  *
- * We wait for a change (poll/select) on array_state, sync_action, and
- * each rd-X/state file.
- * When we get any change, we check everything.  So read each state file,
- * then decide what to do.
+ * We wait for a change (epoll) on array_state, sync_action,
+ * sync_completed and each rd-X/state file.
+ * When one of them changes we read it again, and whatever else might
+ * have changed with it, then decide what to do.  What wasn't read
+ * still holds what it said last time, as md would have told us of
+ * any change.  An array that goes write-pending with nothing else
+ * happening, the case that writes are waiting for, is marked dirty
+ * straight away.
  *
  * The core action is to write new metadata to all devices in the array.
- * This is done at most once on any wakeup.
+ * This is done at most once on any wakeup, for all arrays together, and
+ * before any of them is told to go ahead.
  * After that we might:
  *   - update the array_state
  *   - set the role of some devices.
@@ -211,27 +309,61 @@ static void signal_manager(void)
  *
  */
 
-static int read_and_act(struct active_array *a)
+static int read_and_act(struct active_array *a, void **fired, int nfired)
 {
-	unsigned long long sync_completed;
+	/* 'fired' holds the cookies (see watch_fd) of the attributes
+	 * that changed.  If nfired < 0, anything might have.
+	 */
+	unsigned long long sync_completed = 0;
 	int check_degraded = 0;
 	int deactivate = 0;
 	struct mdinfo *mdi;
 	int dirty = 0;
+	int action_changed = changed(&a->action_fd, fired, nfired);
+	int completed_changed = changed(&a->sync_completed_fd, fired, nfired);
+	int others = action_changed || completed_changed;
+	char buf[60];
 
 	a->next_state = bad_word;
 	a->next_action = bad_action;
 
-	a->curr_state = read_state(a->info.state_fd);
-	a->curr_action = read_action(a->action_fd);
+	for (mdi = a->info.devs; mdi ; mdi = mdi->next)
+		/* a failure not yet dealt with needs the slow path */
+		if ((mdi->curr_state & DS_FAULTY) ||
+		    changed(mdi, fired, nfired))
+			others = 1;
+
+	/* we can't trust what we last wrote to have been noticed */
+	if (a->state_written || changed(&a->info.state_fd, fired, nfired))
+		a->curr_state = read_state(a->info.state_fd);
+	a->state_written = 0;
+
+	if (a->curr_state == write_pending && !others) {
+		/* writes are waiting, and nothing else needs a look */
+		a->wp_start = woke;
+		if (a->prev_state != write_pending)
+			a->sm_flips++;
+		a->container->ss->set_array_state(a, 0);
+		a->next_state = active;
+		a->commit_pending = 1;
+		return 1;
+	}
+
+	if (action_changed)
+		a->curr_action = read_action(a->action_fd);
+	/* resync_start doesn't tell us when it changes */
 	a->info.resync_start = read_resync_start(a->resync_start_fd);
-	sync_completed = read_sync_completed(a->sync_completed_fd);
+	if (completed_changed)
+		sync_completed = read_sync_completed(a->sync_completed_fd);
 	for (mdi = a->info.devs; mdi ; mdi = mdi->next) {
 		mdi->next_state = 0;
-		mdi->curr_state = 0;
-		if (mdi->state_fd >= 0) {
+		if (mdi->state_fd < 0)
+			mdi->curr_state = 0;
+		else if (action_changed || changed(mdi, fired, nfired)) {
 			mdi->recovery_start = read_resync_start(mdi->recovery_fd);
-			mdi->curr_state = read_dev_state(mdi->state_fd);
+			mdi->curr_state = 0;
+			if (read_attr(buf, sizeof(buf), mdi->state_fd) > 0)
+				mdi->curr_state = dev_state(buf);
 		}
 	}
 
@@ -243,6 +375,9 @@ static int read_and_act(struct active_array *a)
 		deactivate = 1;
 	}
 	if (a->curr_state == write_pending) {
+		a->wp_start = woke;
+		if (a->prev_state != write_pending)
+			a->sm_flips++;
 		a->container->ss->set_array_state(a, 0);
 		a->next_state = active;
 		dirty = 1;
@@ -344,7 +479,22 @@ static int read_and_act(struct active_array *a)
 	} else if (sync_completed > a->last_checkpoint)
 		a->last_checkpoint = sync_completed;
 
-	a->container->ss->sync_metadata(a->container);
+	a->commit_pending = 1;
+	if (check_degraded)
+		a->check_degraded = 1;
+	if (deactivate)
+		a->container = NULL;
+
+	return dirty;
+}
+
+static void write_state(struct active_array *a)
+{
+	/* The metadata now agrees with what read_and_act() decided,
+	 * so tell the kernel.
+	 */
+	struct mdinfo *mdi;
+
 	dprintf("%s(%d): state:%s action:%s next(", __func__, a->info.container_member,
 		array_states[a->curr_state], sync_actions[a->curr_action]);
 
@@ -352,6 +502,9 @@ static int read_and_act(struct active_array *a)
 	if (a->next_state != bad_word) {
 		dprintf(" state:%s", array_states[a->next_state]);
 		write_attr(array_states[a->next_state], a->info.state_fd);
+		a->state_written = 1;
+		if (a->curr_state == write_pending && a->next_state == active)
+			latency_add(&a->wp_lat, &a->wp_start);
 	}
 	if (a->next_action != bad_action) {
 		write_attr(sync_actions[a->next_action], a->action_fd);
@@ -373,6 +526,8 @@ static int read_and_act(struct active_array *a)
 			remove_result = write_attr("remove", mdi->state_fd);
 			if (remove_result > 0) {
 				dprintf(" %d:removed", mdi->disk.raid_disk);
+				if (a->watched)
+					sysfs_unwatch_fd(epfd, mdi->state_fd);
 				close(mdi->state_fd);
 				close(mdi->recovery_fd);
 				mdi->state_fd = -1;
@@ -394,17 +549,70 @@ static int read_and_act(struct active_array *a)
 		mdi->prev_state = mdi->curr_state;
 		mdi->next_state = 0;
 	}
+	a->commit_pending = 0;
+}
 
-	if (check_degraded) {
-		/* manager will do the actual check */
-		a->check_degraded = 1;
-		signal_manager();
+/* Adaptive safe_mode_delay.
+ *
+ * Every time an array goes from clean to dirty, writes wait while we
+ * update the metadata.  An array that is written in bursts can do
+ * that many times a second.  If SAFEMODE is configured, we count the
+ * flips in each SAFEMODE_WINDOW seconds.  safe_mode_delay is doubled
+ * (up to max=) when there are too many, and halved (down to where it
+ * started, or min=) when there are hardly any, so it is only long
+ * while that saves something.
+ */
+#define SAFEMODE_WINDOW 5
+#define SAFEMODE_FLAPS 5
+
+static void set_safemode(struct active_array *a, unsigned long ms)
+{
+	char buf[30];
+
+	/* the '\n' is needed for kernels older than 2.6.28 */
+	sprintf(buf, "%lu.%03lu\n", ms / 1000, ms % 1000);
+	if (write_attr(buf, a->safe_mode_fd) > 0) {
+		dprintf("%s(%d): safe_mode_delay %lums\n", __func__,
+			a->info.container_member, ms);
+		a->sm_delay = ms;
 	}
+}
 
-	if (deactivate)
-		a->container = NULL;
+static void adjust_safemode(struct active_array *a)
+{
+	unsigned long ms = a->sm_delay;
 
-	return dirty;
+	if (a->safe_mode_fd < 0 ||
+	    woke.tv_sec < a->sm_window + SAFEMODE_WINDOW)
+		return;
+	if (a->sm_flips >= SAFEMODE_FLAPS)
+		ms *= 2;
+	else if (a->sm_flips <= 1)
+		ms /= 2;
+	if (ms > safemode_conf->max)
+		ms = safemode_conf->max;
+	if (ms < a->sm_min)
+		ms = a->sm_min;
+	a->sm_flips = 0;
+	a->sm_window = woke.tv_sec;
+	if (ms != a->sm_delay)
+		set_safemode(a, ms);
+}
+
+static int safemode_timeout(struct supertype *containers)
+{
+	/* While any array has a raised delay, we must wake to lower it
+	 * even if nothing happens.
+	 */
+	struct supertype *container;
+	struct active_array *a;
+
+	for (container = containers; container; container = container->next)
+		for (a = container->arrays; a; a = a->next)
+			if (a->container && a->safe_mode_fd >= 0 &&
+			    a->sm_delay > a->sm_min)
+				return SAFEMODE_WINDOW * 1000;
+	return -1;
 }
 
 static struct mdinfo *
@@ -436,95 +644,124 @@ static void reconcile_failed(struct active_array *aa, struct mdinfo *failed)
 	}
 }
 
-#ifdef DEBUG
-static void dprint_wake_reasons(fd_set *fds)
+static void read_signals(void)
 {
-	int i;
-	char proc_path[256];
-	char link[256];
-	char *basename;
-	int rv;
+	struct signalfd_siginfo si;
 
-	fprintf(stderr, "monitor: wake ( ");
-	for (i = 0; i < FD_SETSIZE; i++) {
-		if (FD_ISSET(i, fds)) {
-			sprintf(proc_path, "/proc/%d/fd/%d",
-				(int) getpid(), i);
-
-			rv = readlink(proc_path, link, sizeof(link) - 1);
-			if (rv < 0) {
-				fprintf(stderr, "%d:unknown ", i);
-				continue;
-			}
-			link[rv] = '\0';
-			basename = strrchr(link, '/');
-			fprintf(stderr, "%d:%s ",
-				i, basename ? ++basename : link);
+	while (read(sigfd, &si, sizeof(si)) == sizeof(si))
+		if (si.ssi_signo == SIGTERM && !sigterm) {
+			/* the manager needs to know too */
+			sigterm = 1;
+			signal_manager();
 		}
-	}
-	fprintf(stderr, ")\n");
 }
-#endif
 
-int monitor_loop_cnt;
+static int array_fired(struct active_array *a, void **fired, int nfired)
+{
+	struct mdinfo *mdi;
+
+	if (changed(&a->info.state_fd, fired, nfired) ||
+	    changed(&a->action_fd, fired, nfired) ||
+	    changed(&a->sync_completed_fd, fired, nfired))
+		return 1;
+	for (mdi = a->info.devs; mdi; mdi = mdi->next)
+		if (changed(mdi, fired, nfired))
+			return 1;
+	return 0;
+}
+
+#define MAX_FIRED 64
 
-static int wait_and_act(struct supertype *container, int nowait)
+static int finished(struct supertype *container, unsigned int dirty_arrays)
 {
-	fd_set rfds;
-	int maxfd = 0;
-	struct active_array **aap = &container->arrays;
+	/* Can we stop looking after this container?  Only if it has
+	 * no interesting arrays, or we have been told to terminate
+	 * and everything is clean.  Note that blocking here is not a
+	 * problem as there are no active arrays, there is nothing that
+	 * we need to be ready to do.
+	 */
+	int fd;
+
+	if (container->arrays && !(sigterm && !dirty_arrays))
+		return 0;
+	fd = open_dev_excl(container->devnum);
+	if (fd < 0 && errno == EBUSY)
+		return 0;
+	if (fd >= 0)
+		close(fd);
+	return 1;
+}
+
+static int wait_and_act(struct supertype *containers, int nowait)
+{
+	struct supertype *container;
 	struct active_array *a, **ap;
 	int rv;
 	struct mdinfo *mdi;
 	static unsigned int dirty_arrays = ~0; /* start at some non-zero value */
+	void *fired[MAX_FIRED];
+	int nfired = -1; /* < 0 means look at everything */
+	unsigned int ping, done, head;
+	unsigned long writes;
+	int check_degraded;
+	int freeze;
+	int live;
+	eventfd_t cnt;
+	int i;
 
-	FD_ZERO(&rfds);
-
-	for (ap = aap ; *ap ;) {
-		a = *ap;
-		/* once an array has been deactivated we want to
-		 * ask the manager to discard it.
-		 */
-		if (!a->container) {
-			if (discard_this) {
-				ap = &(*ap)->next;
+	for (container = containers; container; container = container->next)
+		for (ap = &container->arrays ; *ap ;) {
+			a = *ap;
+			/* once an array has been deactivated we want to
+			 * ask the manager to discard it.
+			 */
+			if (!a->container) {
+				unwatch_array(a);
+				if (discard_this) {
+					ap = &(*ap)->next;
+					continue;
+				}
+				*ap = a->next;
+				a->next = NULL;
+				discard_this = a;
+				signal_manager();
 				continue;
 			}
-			*ap = a->next;
-			a->next = NULL;
-			discard_this = a;
-			signal_manager();
-			continue;
-		}
 
-		add_fd(&rfds, &maxfd, a->info.state_fd);
-		add_fd(&rfds, &maxfd, a->action_fd);
-		add_fd(&rfds, &maxfd, a->sync_completed_fd);
-		for (mdi = a->info.devs ; mdi ; mdi = mdi->next)
-			add_fd(&rfds, &maxfd, mdi->state_fd);
-
-		ap = &(*ap)->next;
-	}
+			ap = &(*ap)->next;
+		}
 
-	if (manager_ready && (*aap == NULL || (sigterm && !dirty_arrays))) {
-		/* No interesting arrays, or we have been told to
-		 * terminate and everything is clean.  Lets see about
-		 * exiting.  Note that blocking at this point is not a
-		 * problem as there are no active arrays, there is
-		 * nothing that we need to be ready to do.
+	if (manager_ready) {
+		/* Each container is finished with on its own, but on
+		 * SIGTERM we wait until they are all clean.
 		 */
-		int fd = open_dev_excl(container->devnum);
-		if (fd >= 0 || errno != EBUSY) {
-			/* OK, we are safe to leave */
+		live = 0;
+		for (container = containers; container;
+		     container = container->next) {
+			if (container->stopped)
+				continue;
+			if (!finished(container, dirty_arrays)) {
+				live++;
+				continue;
+			}
 			if (sigterm && !dirty_arrays)
-				dprintf("caught sigterm, all clean... exiting\n");
+				dprintf("caught sigterm, %s all clean\n",
+					container->devname);
 			else
-				dprintf("no arrays to monitor... exiting\n");
-			if (!sigterm)
+				dprintf("no arrays to monitor in %s\n",
+					container->devname);
+			if (!sigterm) {
 				/* On SIGTERM, someone (the take-over mdmon) will
 				 * clean up
 				 */
 				remove_pidfile(container->devname);
+				container->stopped = 1;
+				signal_manager();
+			}
+		}
+		if (!live) {
+			/* OK, we are safe to leave */
+			dprintf("nothing left to monitor... exiting\n");
 			exit_now = 1;
 			signal_manager();
 			exit(0);
@@ -532,35 +769,52 @@ static int wait_and_act(struct supertype *container, int nowait)
 	}
 
 	if (!nowait) {
-		sigset_t set;
-		sigprocmask(SIG_UNBLOCK, NULL, &set);
-		sigdelset(&set, SIGUSR1);
-		monitor_loop_cnt |= 1;
-		rv = pselect(maxfd+1, NULL, NULL, &rfds, NULL, &set);
-		monitor_loop_cnt += 1;
-		if (rv == -1 && errno == EINTR)
-			rv = 0;
-		#ifdef DEBUG
-		dprint_wake_reasons(&rfds);
-		#endif
-
+		rv = sysfs_watch_wait(epfd, fired, MAX_FIRED,
+				      safemode_timeout(containers), NULL);
+		if (rv >= 0)
+			nfired = rv;
+		else if (errno == EINTR)
+			nfired = 0;
+		/* else too much happened to say what, so look at everything */
+		for (i = 0; i < nfired; i++)
+			if (fired[i] == &sigfd)
+				read_signals();
+			else if (fired[i] == &monitor_event)
+				eventfd_read(monitor_event, &cnt);
+		monitor_wakeups++;
+		dprintf("monitor: wake (%d)\n", nfired);
 	}
-
-	if (update_queue) {
-		struct metadata_update *this;
-
-		for (this = update_queue; this ; this = this->next)
-			container->ss->process_update(container, this);
-
-		update_queue_handled = update_queue;
-		update_queue = NULL;
-		signal_manager();
-		container->ss->sync_metadata(container);
+	clock_gettime(CLOCK_MONOTONIC, &woke);
+	/* When terminating, every array needs to be seen to be clean.
+	 * A ping wants every array to be looked at after it was sent,
+	 * and so does a handoff.
+	 */
+	ping = ping_req;
+	freeze = handoff == HANDOFF_REQ;
+	if (sigterm || ping != ping_ack || freeze)
+		nfired = -1;
+
+	head = update_ring.head;
+	__sync_synchronize();
+	done = update_ring.done;
+	if (done != head) {
+		for (; done != head; done++) {
+			struct metadata_update *mu;
+
+			mu = update_ring.slot[done % UPDATE_SLOTS];
+			mu->container->ss->process_update(mu->container, mu);
+		}
+		/* the metadata may now say something different about
+		 * any array
+		 */
+		nfired = -1;
 	}
 
 	rv = 0;
-	dirty_arrays = 0;
-	for (a = *aap; a ; a = a->next) {
+	/* we only know that all is clean if we looked at everything */
+	dirty_arrays = nfired >= 0;
+	for (container = containers; container; container = container->next)
+	for (a = container->arrays; a ; a = a->next) {
 		int is_dirty;
 
 		if (a->replaces && !discard_this) {
@@ -570,42 +824,133 @@ static int wait_and_act(struct supertype *container, int nowait)
 				;
 			if (*ap)
 				*ap = (*ap)->next;
+			/* 'a' shares its fds, so is watched below */
+			unwatch_array(a->replaces);
 			discard_this = a->replaces;
 			a->replaces = NULL;
 			/* FIXME check if device->state_fd need to be cleared?*/
 			signal_manager();
 		}
-		if (a->container) {
-			is_dirty = read_and_act(a);
+		if (a->container &&
+		    (nfired < 0 || !a->watched || array_fired(a, fired, nfired))) {
+			is_dirty = read_and_act(a, fired,
+						a->watched ? nfired : -1);
 			rv |= 1;
 			dirty_arrays += is_dirty;
 			/* when terminating stop manipulating the array after it
 			 * is clean, but make sure read_and_act() is given a
 			 * chance to handle 'active_idle'
 			 */
-			if (sigterm && !is_dirty)
+			if (sigterm && !is_dirty) {
+				/* and leave safe_mode_delay as we found it */
+				if (a->safe_mode_fd >= 0 &&
+				    a->sm_delay != a->sm_min)
+					set_safemode(a, a->sm_min);
 				a->container = NULL; /* stop touching this array */
+			}
+		}
+		if (a->container)
+			adjust_safemode(a);
+	}
+
+	/* Everything that changed the metadata on this pass, whether
+	 * updates or array events, is written out together, so each
+	 * device is written at most once however many arrays changed.
+	 */
+	for (container = containers; container; container = container->next) {
+		if (container->stopped)
+			continue;
+		writes = container->metadata_writes;
+		container->ss->sync_metadata(container);
+		if (container->metadata_writes != writes)
+			dprintf("monitor: metadata written to %lu devices of %s (%lu total)\n",
+				container->metadata_writes - writes,
+				container->devname, container->metadata_writes);
+	}
+	if (done != update_ring.done) {
+		__sync_synchronize();
+		update_ring.done = done;
+		signal_manager();
+	}
+
+	check_degraded = 0;
+	for (container = containers; container; container = container->next)
+	for (a = container->arrays; a ; a = a->next) {
+		if (a->commit_pending) {
+			write_state(a);
+			check_degraded |= a->check_degraded;
 		}
+		/* Start watching new arrays once they have been read,
+		 * so nothing since then is missed.
+		 */
+		if (a->container && !a->watched && !a->replaces)
+			watch_array(a);
 	}
+	if (check_degraded)
+		/* manager will do the actual check */
+		signal_manager();
 
 	/* propagate failures across container members */
-	for (a = *aap; a ; a = a->next) {
+	for (container = containers; container; container = container->next)
+	for (a = container->arrays; a ; a = a->next) {
 		if (!a->container)
 			continue;
 		for (mdi = a->info.devs ; mdi ; mdi = mdi->next)
 			if (mdi->curr_state & DS_FAULTY)
-				reconcile_failed(*aap, mdi);
+				reconcile_failed(container->arrays, mdi);
+	}
+
+	if (ping != ping_ack) {
+		__sync_synchronize();
+		ping_ack = ping;
+		signal_manager();
+	}
+	if (freeze) {
+		__sync_synchronize();
+		handoff = HANDOFF_FROZEN;
+		signal_manager();
 	}
 
 	return rv;
 }
 
-void do_monitor(struct supertype *container)
+void do_monitor(struct supertype *containers)
+
 {
 	int rv;
 	int first = 1;
+	sigset_t set;
+
+	/* SIGTERM is blocked, so we collect it here */
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	epfd = epoll_create(64);
+	sigfd = signalfd(-1, &set, 0);
+	if (epfd < 0 || sigfd < 0) {
+		fprintf(stderr, "mdmon: cannot wait for events: %s\n",
+			strerror(errno));
+		exit(2);
+	}
+	fcntl(epfd, F_SETFD, FD_CLOEXEC);
+	fcntl(sigfd, F_SETFD, FD_CLOEXEC);
+	fcntl(sigfd, F_SETFL, O_NONBLOCK);
+	if (sysfs_watch_io(epfd, sigfd, 0, &sigfd) != 0 ||
+	    sysfs_watch_io(epfd, monitor_event, 0, &monitor_event) != 0) {
+		fprintf(stderr, "mdmon: cannot wait for events: %s\n",
+			strerror(errno));
+		exit(2);
+	}
+
 	do {
-		rv = wait_and_act(container, first);
+		rv = wait_and_act(containers, first);
 		first = 0;
+		/* the manager is handing our arrays to a new mdmon */
+		while (handoff == HANDOFF_FROZEN) {
+			struct pollfd pfd = { .fd = monitor_event, .events = POLLIN };
+			eventfd_t cnt;
+
+			poll(&pfd, 1, -1);
+			eventfd_read(monitor_event, &cnt);
+		}
 	} while (rv >= 0);
 }
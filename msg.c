@@ -125,6 +125,148 @@ int receive_message(int fd, struct metadata_update *msg, int tmo)
 	return 0;
 }
 
+int decode_message(char *buf, int len, struct metadata_update *msg)
+{
+	/* For those reading a non-blocking socket into a buffer.
+	 * If 'buf' starts with a whole message, fill in 'msg' and
+	 * return the number of bytes it used.  Return 0 if more is
+	 * needed, and -1 if it isn't a message at all.
+	 */
+	__u32 magic;
+	__s32 mlen;
+	int size;
+
+	if (len < 8)
+		return 0;
+	memcpy(&magic, buf, 4);
+	memcpy(&mlen, buf + 4, 4);
+	if (magic != start_magic || mlen > MSG_MAX_LEN)
+		return -1;
+	size = 12 + (mlen > 0 ? mlen : 0);
+	if (len < size)
+		return 0;
+	memcpy(&magic, buf + size - 4, 4);
+	if (magic != end_magic)
+		return -1;
+	msg->len = mlen;
+	msg->buf = NULL;
+	if (mlen > 0) {
+		msg->buf = malloc(mlen);
+		if (!msg->buf)
+			return -1;
+		memcpy(msg->buf, buf + 8, mlen);
+	}
+	return size;
+}
+
+int encode_message(char **buf, int *len, struct metadata_update *msg)
+{
+	/* Append 'msg' to the malloced buffer '*buf' which already
+	 * holds '*len' bytes.
+	 */
+	__s32 mlen = msg->len;
+	int size = 12 + (mlen > 0 ? mlen : 0);
+	char *b = realloc(*buf, *len + size);
+
+	if (!b)
+		return -1;
+	memcpy(b + *len, &start_magic, 4);
+	memcpy(b + *len + 4, &mlen, 4);
+	if (mlen > 0)
+		memcpy(b + *len + 8, msg->buf, mlen);
+	memcpy(b + *len + size - 4, &end_magic, 4);
+	*buf = b;
+	*len += size;
+	return 0;
+}
+
+int send_fds(int fd, int *fds, int n)
+{
+	/* Pass 'n' open fds over the socket 'fd', each with a byte of
+	 * data so that they cannot be lost.  The kernel limits how many
+	 * go in one message, so use several.
+	 */
+	char buf[CMSG_SPACE(FDS_PER_MSG * sizeof(int))];
+	char data[FDS_PER_MSG];
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	int cnt;
+
+	memset(data, 0, sizeof(data));
+	while (n > 0) {
+		cnt = n < FDS_PER_MSG ? n : FDS_PER_MSG;
+		memset(&mh, 0, sizeof(mh));
+		iov.iov_base = data;
+		iov.iov_len = cnt;
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = buf;
+		mh.msg_controllen = CMSG_SPACE(cnt * sizeof(int));
+		cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(cnt * sizeof(int));
+		memcpy(CMSG_DATA(cm), fds, cnt * sizeof(int));
+		if (sendmsg(fd, &mh, 0) != cnt)
+			return -1;
+		fds += cnt;
+		n -= cnt;
+	}
+	return 0;
+}
+
+int receive_fds(int fd, int *fds, int n, int tmo)
+{
+	/* Collect 'n' fds sent by send_fds.  On error, any that did
+	 * arrive are closed again.
+	 */
+	char buf[CMSG_SPACE(FDS_PER_MSG * sizeof(int))];
+	char data[FDS_PER_MSG];
+	struct timeval timeout = {tmo, 0};
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	fd_set set;
+	int got = 0;
+	int rv, cnt, i;
+
+	while (got < n) {
+		FD_ZERO(&set);
+		FD_SET(fd, &set);
+		if (select(fd+1, &set, NULL, NULL, &timeout) <= 0)
+			goto abort;
+		memset(&mh, 0, sizeof(mh));
+		iov.iov_base = data;
+		iov.iov_len = n - got < FDS_PER_MSG ? n - got : FDS_PER_MSG;
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = buf;
+		mh.msg_controllen = sizeof(buf);
+		rv = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+		if (rv <= 0)
+			goto abort;
+		cnt = 0;
+		for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm))
+			if (cm->cmsg_level == SOL_SOCKET &&
+			    cm->cmsg_type == SCM_RIGHTS) {
+				cnt = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				if (got + cnt > n)
+					cnt = n - got;
+				memcpy(fds + got, CMSG_DATA(cm),
+				       cnt * sizeof(int));
+			}
+		got += cnt;
+		if (cnt != rv || (mh.msg_flags & MSG_CTRUNC))
+			goto abort;
+	}
+	return 0;
+ abort:
+	for (i = 0; i < got; i++)
+		close(fds[i]);
+	return -1;
+}
+
 int ack(int fd, int tmo)
 {
 	struct metadata_update msg = { .len = 0 };
@@ -135,19 +277,23 @@ int ack(int fd, int tmo)
 int wait_reply(int fd, int tmo)
 {
 	struct metadata_update msg;
-	return receive_message(fd, &msg, tmo);
+	int rv = receive_message(fd, &msg, tmo);
+
+	if (rv == 0)
+		free(msg.buf);
+	return rv;
 }
 
 int connect_monitor(char *devname)
 {
-	char path[100];
+	char path[PATH_MAX];
 	int sfd;
 	long fl;
 	struct sockaddr_un addr;
 	int pos;
 	char *c;
 
-	pos = sprintf(path, "%s/", MDMON_DIR);
+	pos = sprintf(path, "%s%s/", mdadm_root(), MDMON_DIR);
 	if (is_subarray(devname)) {
 		devname++;
 		c = strchr(devname, '/');
@@ -158,6 +304,8 @@ int connect_monitor(char *devname)
 	} else
 		pos += sprintf(&path[pos], "%s", devname);
 	sprintf(&path[pos], ".sock");
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
 
 	sfd = socket(PF_LOCAL, SOCK_STREAM, 0);
 	if (sfd < 0)
@@ -229,3 +377,48 @@ int ping_manager(char *devname)
 	close(sfd);
 	return err;
 }
+
+/* ping, and return what the mdmon says it can do (MDMON_CAP_*), which
+ * is nothing for one that just acks.
+ */
+int monitor_caps(int sfd)
+{
+	struct metadata_update msg;
+	__u32 caps = 0;
+
+	if (sfd < 0 || ack(sfd, 20) != 0 ||
+	    receive_message(sfd, &msg, 20) != 0)
+		return -1;
+	if (msg.len == sizeof(caps))
+		memcpy(&caps, msg.buf, sizeof(caps));
+	free(msg.buf);
+	return caps;
+}
+
+/* fetch the write-pending and metadata write times that mdmon has
+ * seen, as text.
+ */
+char *query_stats(char *devname)
+{
+	int sfd = connect_monitor(devname);
+	struct metadata_update msg = { .len = MSG_STATS };
+	char *text = NULL;
+	int caps;
+
+	if (sfd < 0)
+		return NULL;
+
+	caps = monitor_caps(sfd);
+	if (caps > 0 && (caps & MDMON_CAP_STATS) &&
+	    send_message(sfd, &msg, 20) == 0 &&
+	    receive_message(sfd, &msg, 20) == 0 && msg.len > 0) {
+		text = realloc(msg.buf, msg.len + 1);
+		if (text)
+			text[msg.len] = 0;
+		else
+			free(msg.buf);
+	}
+
+	close(sfd);
+	return text;
+}
@@ -23,11 +23,38 @@ struct metadata_update;
 
 extern int receive_message(int fd, struct metadata_update *msg, int tmo);
 extern int send_message(int fd, struct metadata_update *msg, int tmo);
+extern int decode_message(char *buf, int len, struct metadata_update *msg);
+extern int encode_message(char **buf, int *len, struct metadata_update *msg);
+extern int send_fds(int fd, int *fds, int n);
+extern int receive_fds(int fd, int *fds, int n, int tmo);
 extern int ack(int fd, int tmo);
 extern int wait_reply(int fd, int tmo);
 extern int connect_monitor(char *devname);
 extern int ping_monitor(char *devname);
 extern int fping_monitor(int sock);
 extern int ping_manager(char *devname);
+extern int monitor_caps(int sfd);
+extern char *query_stats(char *devname);
 
 #define MSG_MAX_LEN (4*1024*1024)
+
+/* mdmon answers a ping (length 0) with a __u32 of these.  One from
+ * before they existed sends an empty ack, and takes any length other
+ * than 0 or -1 as a metadata update, so nothing else may be sent to an
+ * mdmon that hasn't said it understands it.
+ */
+#define MDMON_CAP_STATS		1
+#define MDMON_CAP_HANDOFF	2
+
+/* A message with this length asks mdmon for its latency statistics.
+ * The reply is text rather than an ack.
+ */
+#define MSG_STATS (-2)
+
+/* A new mdmon sends this to one it is taking over from, which replies
+ * with its state (struct handoff) followed by its fds (send_fds), then
+ * exits when the new one acks.  See mdmon.h.
+ */
+#define MSG_HANDOFF (-3)
+
+#define FDS_PER_MSG 64
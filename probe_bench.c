@@ -0,0 +1,213 @@
+/*
+ * probe_bench - time reading the superblocks of many devices.
+ *
+ * Copyright (C) 2010 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * "mdadm --examine --scan" and "mdadm --assemble --scan" look at every
+ * device there is.  When each read has to wait for a disk, looking at
+ * one device after another takes most of the time.  This makes a
+ * number of image files, with v1.2 metadata on every other one, and
+ * looks at them all the way Examine does: first one at a time, then
+ * after probe_prefetch has read them all at once.
+ * Every read is made to take 'delay' usecs longer, like a seek.
+ * The first pass fills the superblock cache, which the second then
+ * uses, though it reads just as much:
+ *
+ *   probe_bench -n 64 -d 8000 /var/tmp/images
+ */
+
+#include	<sys/syscall.h>
+#include	<sys/time.h>
+#include "mdadm.h"
+
+static long delay;
+
+/* Interpose on the reads that the metadata handlers make */
+ssize_t read(int fd, void *buf, size_t len)
+{
+	if (delay)
+		usleep(delay);
+	return syscall(SYS_read, fd, buf, len);
+}
+
+ssize_t pread64(int fd, void *buf, size_t len, off64_t off)
+{
+	if (delay)
+		usleep(delay);
+	return syscall(SYS_pread64, fd, buf, len, off);
+}
+
+static int make_images(char *dir, int n, mddev_dev_t *list)
+{
+	char name[PATH_MAX];
+	mddev_dev_t dv;
+	int i, fd;
+
+	for (i = n; i-- > 0; ) {
+		snprintf(name, sizeof(name), "%s/img%d", dir, i);
+		fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0600);
+		if (fd < 0 || ftruncate(fd, 64*1024*1024) != 0) {
+			perror(name);
+			return -1;
+		}
+		close(fd);
+		dv = calloc(1, sizeof(*dv));
+		dv->devname = strdup(name);
+		dv->next = *list;
+		*list = dv;
+	}
+	return 0;
+}
+
+static int make_arrays(mddev_dev_t list)
+{
+	/* A two-device raid1 on every other pair of images */
+	mdu_array_info_t info;
+	mdu_disk_info_t disk;
+	mddev_dev_t dv;
+	struct supertype *st;
+	int uuid[4];
+	int i, fd;
+	int pair = 0;
+
+	for (dv = list; dv && dv->next; dv = dv->next->next) {
+		if (pair++ % 2)
+			continue;
+		st = super1.match_metadata_desc("1.2");
+		if (!st)
+			return -1;
+		memset(&info, 0, sizeof(info));
+		info.level = 1;
+		info.raid_disks = info.nr_disks = 2;
+		info.major_version = 1;
+		info.state = 1;
+		memset(uuid, 0, sizeof(uuid));
+		uuid[0] = random();
+		if (!st->ss->init_super(st, &info, 0, "bench", NULL, uuid))
+			return -1;
+		for (i = 0; i < 2; i++) {
+			char *name = i ? dv->next->devname : dv->devname;
+
+			fd = open(name, O_RDWR);
+			if (fd < 0)
+				return -1;
+			memset(&disk, 0, sizeof(disk));
+			disk.number = disk.raid_disk = i;
+			disk.state = (1<<MD_DISK_ACTIVE)|(1<<MD_DISK_SYNC);
+			st->ss->add_to_super(st, &disk, fd, name);
+		}
+		if (st->ss->write_init_super(st) != 0)
+			return -1;
+		st->ss->free_super(st);
+		free(st);
+	}
+	return 0;
+}
+
+static int examine(mddev_dev_t list)
+{
+	/* what Examine does with each device, less the printing */
+	mddev_dev_t dv;
+	struct supertype *st;
+	int found = 0;
+	int fd;
+
+	for (dv = list; dv; dv = dv->next) {
+		fd = dev_open(dv->devname, O_RDONLY);
+		if (fd < 0)
+			continue;
+		st = guess_super(fd);
+		if (st && (st->sb || st->ss->load_super(st, fd, NULL) == 0)) {
+			found++;
+			st->ss->free_super(st);
+		}
+		free(st);
+		close(fd);
+	}
+	return found;
+}
+
+static long msecs_since(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_usec - start->tv_usec) / 1000;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: probe_bench [-n images] [-d usecs] dir\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	mddev_dev_t list = NULL;
+	struct timeval start;
+	int n = 64;
+	long d = 8000;
+	long serial, parallel;
+	int found1, found2;
+	char cache[PATH_MAX];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:d:")) != -1)
+		switch (opt) {
+		case 'n': n = atoi(optarg); break;
+		case 'd': d = atol(optarg); break;
+		default: usage();
+		}
+	if (optind != argc - 1 || n < 2)
+		usage();
+
+	/* Keep the superblock cache with the images */
+	setenv("MDADM_ROOT", argv[optind], 1);
+	mkdir(argv[optind], 0755);
+	snprintf(cache, sizeof(cache), "%s/dev", argv[optind]);
+	mkdir(cache, 0755);
+	snprintf(cache, sizeof(cache), "%s%s/%s", argv[optind], MAP_DIR,
+		 SUPER_CACHE);
+	unlink(cache);
+
+	if (make_images(argv[optind], n, &list) != 0 ||
+	    make_arrays(list) != 0) {
+		fprintf(stderr, "probe_bench: cannot make images in %s\n",
+			argv[optind]);
+		exit(1);
+	}
+
+	delay = d;
+	gettimeofday(&start, NULL);
+	found1 = examine(list);
+	serial = msecs_since(&start);
+
+	gettimeofday(&start, NULL);
+	probe_prefetch(list);
+	found2 = examine(list);
+	probe_forget();
+	parallel = msecs_since(&start);
+	delay = 0;
+
+	printf("serial   %d devices %d superblocks %ldms\n", n, found1, serial);
+	printf("parallel %d devices %d superblocks %ldms\n", n, found2, parallel);
+	return found1 != found2;
+}
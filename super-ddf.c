@@ -473,7 +473,7 @@ static int load_ddf_header(int fd, unsigned long long lba,
 	if (lseek64(fd, lba<<9, 0) < 0)
 		return 0;
 
-	if (read(fd, hdr, 512) != 512)
+	if (probe_read(fd, hdr, 512) != 512)
 		return 0;
 
 	if (hdr->magic != DDF_HEADER_MAGIC)
@@ -527,7 +527,7 @@ static void *load_section(int fd, struct ddf_super *super, void *buf,
 			free(buf);
 		return NULL;
 	}
-	if ((unsigned long long)read(fd, buf, len<<9) != (len<<9)) {
+	if ((unsigned long long)probe_read(fd, buf, len<<9) != (len<<9)) {
 		if (dofree)
 			free(buf);
 		return NULL;
@@ -548,7 +548,7 @@ static int load_ddf_headers(int fd, struct ddf_super *super, char *devname)
 				devname, strerror(errno));
 		return 1;
 	}
-	if (read(fd, &super->anchor, 512) != 512) {
+	if (probe_read(fd, &super->anchor, 512) != 512) {
 		if (devname)
 			fprintf(stderr,
 				Name ": Cannot read anchor block on %s: %s\n",
@@ -2323,6 +2323,80 @@ static int remove_from_super_ddf(struct supertype *st, mdu_disk_info_t *dk)
 
 static unsigned char null_conf[4096+512];
 
+/* What is written to each device.  The headers differ as they
+ * depend on the size of the device; the rest is shared.
+ */
+struct ddf_write {
+	struct ddf_header anchor, primary;
+	union {
+		char space[512];
+		struct {
+			struct ddf_super *ddf;
+			struct dl *d;
+			unsigned long long size; /* sectors */
+		};
+	};
+};
+
+static int ddf_write_disk(struct metadata_write *w)
+{
+	struct ddf_write *dw = w->arg;
+	struct ddf_super *ddf = dw->ddf;
+	struct dl *d = dw->d;
+	int fd = w->fd;
+	unsigned long long sector;
+	int n_config;
+	int conf_size;
+	int i;
+
+	sector = dw->size - 16*1024*2;
+	lseek64(fd, sector<<9, 0);
+	if (write(fd, &dw->primary, 512) < 0)
+		return -1;
+
+	if (write(fd, &ddf->controller, 512) < 0)
+		return -1;
+
+	if (write(fd, ddf->phys, ddf->pdsize) < 0)
+		return -1;
+
+	if (write(fd, ddf->virt, ddf->vdsize) < 0)
+		return -1;
+
+	/* Now write lots of config records. */
+	n_config = ddf->max_part;
+	conf_size = ddf->conf_rec_len * 512;
+	for (i = 0 ; i <= n_config ; i++) {
+		struct vcl *c = d->vlist[i];
+		if (i == n_config)
+			c = (struct vcl*)d->spare;
+
+		if (c) {
+			if (write(fd, &c->conf, conf_size) < 0)
+				return -1;
+		} else {
+			char *null_aligned = (char*)((((unsigned long)null_conf)+511)&~511UL);
+			unsigned int togo = conf_size;
+			while (togo > sizeof(null_conf)-512) {
+				if (write(fd, null_aligned, sizeof(null_conf)-512) < 0)
+					return -1;
+				togo -= sizeof(null_conf)-512;
+			}
+			if (write(fd, null_aligned, togo) < 0)
+				return -1;
+		}
+	}
+	if (write(fd, &d->disk, 512) < 0)
+		return -1;
+
+	/* Maybe do the same for secondary */
+
+	lseek64(fd, (dw->size-1)*512, SEEK_SET);
+	if (write(fd, &dw->anchor, 512) < 0)
+		return -1;
+	return 0;
+}
+
 static int __write_init_super_ddf(struct supertype *st, int do_close)
 {
 
@@ -2331,20 +2405,37 @@ static int __write_init_super_ddf(struct supertype *st, int do_close)
 	struct dl *d;
 	int n_config;
 	int conf_size;
-	int attempts = 0;
-	int successes = 0;
-	unsigned long long size, sector;
+	int n = 0;
+	int failed = 0;
+	unsigned long long size;
+	struct ddf_write *dw = NULL;
+	struct metadata_write *w;
 
-	/* try to write updated metadata,
-	 * if we catch a failure move on to the next disk
+	/* Everything is made ready here, so that the devices can all
+	 * be written at once.  If one fails, the others carry on.
 	 */
+	for (d = ddf->dlist; d; d=d->next)
+		if (d->fd >= 0)
+			n++;
+	w = calloc(n ? n : 1, sizeof(*w));
+	if (!w || (n && posix_memalign((void**)&dw, 512, n * sizeof(*dw)) != 0)) {
+		free(w);
+		return 1;
+	}
+
+	ddf->controller.crc = calc_crc(&ddf->controller, 512);
+	ddf->phys->crc = calc_crc(ddf->phys, ddf->pdsize);
+	ddf->virt->crc = calc_crc(ddf->virt, ddf->vdsize);
+	if (null_conf[0] != 0xff)
+		memset(null_conf, 0xff, sizeof(null_conf));
+
+	n = 0;
 	for (d = ddf->dlist; d; d=d->next) {
 		int fd = d->fd;
 
 		if (fd < 0)
 			continue;
 
-		attempts++;
 		/* We need to fill in the primary, (secondary) and workspace
 		 * lba's in the headers, set their checksums,
 		 * Also checksum phys, virt....
@@ -2372,63 +2463,33 @@ static int __write_init_super_ddf(struct supertype *st, int do_close)
 		ddf->primary.crc = calc_crc(&ddf->primary, 512);
 		ddf->secondary.crc = calc_crc(&ddf->secondary, 512);
 
-		sector = size - 16*1024*2;
-		lseek64(fd, sector<<9, 0);
-		if (write(fd, &ddf->primary, 512) < 0)
-			continue;
-
-		ddf->controller.crc = calc_crc(&ddf->controller, 512);
-		if (write(fd, &ddf->controller, 512) < 0)
-			continue;
-
-		ddf->phys->crc = calc_crc(ddf->phys, ddf->pdsize);
-
-		if (write(fd, ddf->phys, ddf->pdsize) < 0)
-			continue;
-
-		ddf->virt->crc = calc_crc(ddf->virt, ddf->vdsize);
-		if (write(fd, ddf->virt, ddf->vdsize) < 0)
-			continue;
-
-		/* Now write lots of config records. */
 		n_config = ddf->max_part;
 		conf_size = ddf->conf_rec_len * 512;
 		for (i = 0 ; i <= n_config ; i++) {
 			struct vcl *c = d->vlist[i];
 			if (i == n_config)
 				c = (struct vcl*)d->spare;
-
-			if (c) {
+			if (c)
 				c->conf.crc = calc_crc(&c->conf, conf_size);
-				if (write(fd, &c->conf, conf_size) < 0)
-					break;
-			} else {
-				char *null_aligned = (char*)((((unsigned long)null_conf)+511)&~511UL);
-				if (null_conf[0] != 0xff)
-					memset(null_conf, 0xff, sizeof(null_conf));
-				unsigned int togo = conf_size;
-				while (togo > sizeof(null_conf)-512) {
-					if (write(fd, null_aligned, sizeof(null_conf)-512) < 0)
-						break;
-					togo -= sizeof(null_conf)-512;
-				}
-				if (write(fd, null_aligned, togo) < 0)
-					break;
-			}
 		}
-		if (i <= n_config)
-			continue;
 		d->disk.crc = calc_crc(&d->disk, 512);
-		if (write(fd, &d->disk, 512) < 0)
-			continue;
 
-		/* Maybe do the same for secondary */
-
-		lseek64(fd, (size-1)*512, SEEK_SET);
-		if (write(fd, &ddf->anchor, 512) < 0)
-			continue;
-		successes++;
+		dw[n].anchor = ddf->anchor;
+		dw[n].primary = ddf->primary;
+		dw[n].ddf = ddf;
+		dw[n].d = d;
+		dw[n].size = size;
+		w[n].fd = fd;
+		w[n].major = d->major;
+		w[n].minor = d->minor;
+		w[n].write = ddf_write_disk;
+		w[n].arg = &dw[n];
+		n++;
 	}
+	if (n)
+		failed = write_metadata(st, w, n);
+	free(dw);
+	free(w);
 
 	if (do_close)
 		for (d = ddf->dlist; d; d=d->next) {
@@ -2436,7 +2497,7 @@ static int __write_init_super_ddf(struct supertype *st, int do_close)
 			d->fd = -1;
 		}
 
-	return attempts != successes;
+	return failed != 0;
 }
 
 static int write_init_super_ddf(struct supertype *st)
@@ -3334,6 +3395,22 @@ static void ddf_sync_metadata(struct supertype *st)
 	dprintf("ddf: sync_metadata\n");
 }
 
+static unsigned long long ddf_generation(struct supertype *st)
+{
+	/* There is no count of writes in ddf that covers everything
+	 * (the anchor's seq is never changed), so use the crcs.
+	 */
+	struct ddf_super *ddf = st->sb;
+	struct vcl *vcl;
+	unsigned long long gen;
+
+	gen = calc_crc(ddf->phys, ddf->pdsize);
+	gen = (gen << 32) | calc_crc(ddf->virt, ddf->vdsize);
+	for (vcl = ddf->conflist; vcl; vcl = vcl->next)
+		gen = gen * 31 + calc_crc(&vcl->conf, ddf->conf_rec_len * 512);
+	return gen;
+}
+
 static void ddf_process_update(struct supertype *st,
 			       struct metadata_update *update)
 {
@@ -3867,6 +3944,7 @@ struct superswitch super_ddf = {
 	.set_array_state= ddf_set_array_state,
 	.set_disk       = ddf_set_disk,
 	.sync_metadata  = ddf_sync_metadata,
+	.generation	= ddf_generation,
 	.process_update	= ddf_process_update,
 	.prepare_update	= ddf_prepare_update,
 	.activate_spare = ddf_activate_spare,
@@ -2221,7 +2221,7 @@ static int load_imsm_mpb(int fd, struct intel_super *super, char *devname)
 				" on %s\n", devname);
 		return 1;
 	}
-	if (read(fd, anchor, 512) != 512) {
+	if (probe_read(fd, anchor, 512) != 512) {
 		if (devname)
 			fprintf(stderr,
 				Name ": Cannot read anchor block on %s: %s\n",
@@ -2276,7 +2276,7 @@ static int load_imsm_mpb(int fd, struct intel_super *super, char *devname)
 		return 1;
 	}
 
-	if ((unsigned)read(fd, super->buf + 512, super->len - 512) != super->len - 512) {
+	if ((unsigned)probe_read(fd, super->buf + 512, super->len - 512) != super->len - 512) {
 		if (devname)
 			fprintf(stderr,
 				Name ": Cannot read extended mpb on %s: %s\n",
@@ -3404,21 +3404,16 @@ static int remove_from_super_imsm(struct supertype *st, mdu_disk_info_t *dk)
 
 static int store_imsm_mpb(int fd, struct imsm_super *mpb);
 
-static union {
-	char buf[512];
-	struct imsm_super anchor;
-} spare_record __attribute__ ((aligned(512)));
-
 /* spare records have their own family number and do not have any defined raid
  * devices
  */
-static int write_super_imsm_spares(struct intel_super *super, int doclose)
+static void imsm_spare_record(struct intel_super *super, struct dl *d,
+			      struct imsm_super *spare)
 {
 	struct imsm_super *mpb = super->anchor;
-	struct imsm_super *spare = &spare_record.anchor;
 	__u32 sum;
-	struct dl *d;
 
+	memset(spare, 0, 512);
 	spare->mpb_size = __cpu_to_le32(sizeof(struct imsm_super)),
 	spare->generation_num = __cpu_to_le32(1UL),
 	spare->attributes = MPB_ATTRIB_CHECKSUM_VERIFY;
@@ -3430,40 +3425,32 @@ static int write_super_imsm_spares(struct intel_super *super, int doclose)
 	snprintf((char *) spare->sig, MAX_SIGNATURE_LENGTH,
 		 MPB_SIGNATURE MPB_VERSION_RAID0);
 
-	for (d = super->disks; d; d = d->next) {
-		if (d->index != -1)
-			continue;
-
-		spare->disk[0] = d->disk;
-		sum = __gen_imsm_checksum(spare);
-		spare->family_num = __cpu_to_le32(sum);
-		spare->orig_family_num = 0;
-		sum = __gen_imsm_checksum(spare);
-		spare->check_sum = __cpu_to_le32(sum);
-
-		if (store_imsm_mpb(d->fd, spare)) {
-			fprintf(stderr, "%s: failed for device %d:%d %s\n",
-				__func__, d->major, d->minor, strerror(errno));
-			return 1;
-		}
-		if (doclose) {
-			close(d->fd);
-			d->fd = -1;
-		}
-	}
+	spare->disk[0] = d->disk;
+	sum = __gen_imsm_checksum(spare);
+	spare->family_num = __cpu_to_le32(sum);
+	spare->orig_family_num = 0;
+	sum = __gen_imsm_checksum(spare);
+	spare->check_sum = __cpu_to_le32(sum);
+}
 
-	return 0;
+static int imsm_write_mpb(struct metadata_write *w)
+{
+	return store_imsm_mpb(w->fd, w->arg) ? -1 : 0;
 }
 
-static int write_super_imsm(struct intel_super *super, int doclose)
+static int write_super_imsm(struct supertype *st, int doclose)
 {
+	struct intel_super *super = st->sb;
 	struct imsm_super *mpb = super->anchor;
 	struct dl *d;
 	__u32 generation;
 	__u32 sum;
 	int spares = 0;
-	int i;
+	int i, n;
 	__u32 mpb_size = sizeof(struct imsm_super) - sizeof(struct imsm_disk);
+	struct metadata_write *w;
+	char *spare_buf = NULL;
+	int rv = 0;
 
 	/* 'generation' is incremented everytime the metadata is written */
 	generation = __le32_to_cpu(mpb->generation_num);
@@ -3499,23 +3486,56 @@ static int write_super_imsm(struct intel_super *super, int doclose)
 	sum = __gen_imsm_checksum(mpb);
 	mpb->check_sum = __cpu_to_le32(sum);
 
-	/* write the mpb for disks that compose raid devices */
-	for (d = super->disks; d ; d = d->next) {
-		if (d->index < 0)
+	/* write the mpb to the disks that compose raid devices, and a
+	 * spare record to each spare, all at once
+	 */
+	for (n = 0, d = super->disks; d; d = d->next)
+		n++;
+	w = calloc(n ? n : 1, sizeof(*w));
+	if (!w || (spares &&
+		   posix_memalign((void**)&spare_buf, 512, spares * 512) != 0)) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		free(w);
+		return 1;
+	}
+	/* other negative indexes (failed disks) get nothing */
+	for (n = 0, i = 0, d = super->disks; d; d = d->next) {
+		if (d->index < 0 && d->index != -1)
 			continue;
-		if (store_imsm_mpb(d->fd, mpb))
+		w[n].fd = d->fd;
+		w[n].major = d->major;
+		w[n].minor = d->minor;
+		w[n].write = imsm_write_mpb;
+		w[n].arg = mpb;
+		if (d->index == -1) {
+			w[n].arg = spare_buf + 512 * i++;
+			imsm_spare_record(super, d, w[n].arg);
+		}
+		n++;
+	}
+	write_metadata(st, w, n);
+
+	for (n = 0, d = super->disks; d; d = d->next) {
+		if (d->index < 0 && d->index != -1)
+			continue;
+		if (w[n].err) {
 			fprintf(stderr, "%s: failed for device %d:%d %s\n",
-				__func__, d->major, d->minor, strerror(errno));
+				__func__, d->major, d->minor,
+				strerror(w[n].err));
+			/* only a spare failing has ever been an error */
+			if (d->index == -1)
+				rv = 1;
+		}
 		if (doclose) {
 			close(d->fd);
 			d->fd = -1;
 		}
+		n++;
 	}
+	free(spare_buf);
+	free(w);
 
-	if (spares)
-		return write_super_imsm_spares(super, doclose);
-
-	return 0;
+	return rv;
 }
 
 
@@ -3608,9 +3628,11 @@ static int write_init_super_imsm(struct supertype *st)
 		return rv;
 	} else {
 		struct dl *d;
-		for (d = super->disks; d; d = d->next)
+		for (d = super->disks; d; d = d->next) {
 			Kill(d->devname, NULL, 0, 1, 1);
-		return write_super_imsm(st->sb, 1);
+			super_cache_forget(d->fd);
+		}
+		return write_super_imsm(st, 1);
 	}
 }
 #endif
@@ -4841,11 +4863,18 @@ static void imsm_sync_metadata(struct supertype *container)
 	if (!super->updates_pending)
 		return;
 
-	write_super_imsm(super, 0);
+	write_super_imsm(container, 0);
 
 	super->updates_pending = 0;
 }
 
+static unsigned long long imsm_generation(struct supertype *container)
+{
+	struct intel_super *super = container->sb;
+
+	return __le32_to_cpu(super->anchor->generation_num);
+}
+
 static struct dl *imsm_readd(struct intel_super *super, int idx, struct active_array *a)
 {
 	struct imsm_dev *dev = get_imsm_dev(super, a->info.container_member);
@@ -5541,10 +5570,10 @@ static void imsm_prepare_update(struct supertype *st,
 {
 	/**
 	 * Allocate space to hold new disk entries, raid-device entries or a new
-	 * mpb if necessary.  The manager synchronously waits for updates to
-	 * complete in the monitor, so new mpb buffers allocated here can be
-	 * integrated by the monitor thread without worrying about live pointers
-	 * in the manager thread.
+	 * mpb if necessary.  The manager only prepares an update once the
+	 * monitor has finished with every earlier one, so new mpb buffers
+	 * allocated here can be integrated by the monitor thread without
+	 * worrying about live pointers in the manager thread.
 	 */
 	enum imsm_update_type type = *(enum imsm_update_type *) update->buf;
 	struct intel_super *super = st->sb;
@@ -5715,6 +5744,7 @@ struct superswitch super_imsm = {
 	.set_array_state= imsm_set_array_state,
 	.set_disk	= imsm_set_disk,
 	.sync_metadata	= imsm_sync_metadata,
+	.generation	= imsm_generation,
 	.activate_spare = imsm_activate_spare,
 	.process_update = imsm_process_update,
 	.prepare_update = imsm_prepare_update,
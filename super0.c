@@ -712,6 +712,7 @@ static int store_super0(struct supertype *st, int fd)
 
 	offset *= 512;
 
+	super_cache_forget(fd);
 	if (lseek64(fd, offset, 0)< 0LL)
 		return 3;
 
@@ -865,7 +866,7 @@ static int load_super0(struct supertype *st, int fd, char *devname)
 		return 1;
 	}
 
-	if (read(fd, super, sizeof(*super)) != MD_SB_BYTES) {
+	if (probe_read(fd, super, sizeof(*super)) != MD_SB_BYTES) {
 		if (devname)
 			fprintf(stderr, Name ": Cannot read superblock on %s\n",
 				devname);
@@ -907,7 +908,7 @@ static int load_super0(struct supertype *st, int fd, char *devname)
 	 * valid.  If it doesn't clear the bit.  An --assemble --force
 	 * should get that written out.
 	 */
-	if (read(fd, super+1, ROUND_UP(sizeof(struct bitmap_super_s),4096))
+	if (probe_read(fd, super+1, ROUND_UP(sizeof(struct bitmap_super_s),4096))
 	    != ROUND_UP(sizeof(struct bitmap_super_s),4096))
 		goto no_bitmap;
 
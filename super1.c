@@ -149,12 +149,12 @@ static int aread(int fd, void *buf, int len)
 	int n;
 	if (ioctl(fd, BLKSSZGET, &bsize) != 0 ||
 	    bsize <= len)
-		return read(fd, buf, len);
+		return probe_read(fd, buf, len);
 	if (bsize > 4096)
 		return -1;
 	b = (char*)(((long)(abuf+4096))&~4095UL);
 
-	n = read(fd, b, bsize);
+	n = probe_read(fd, b, bsize);
 	if (n <= 0)
 		return n;
 	lseek(fd, len - n, 1);
@@ -982,6 +982,7 @@ static int store_super1(struct supertype *st, int fd)
 		abort();
 	}
 
+	super_cache_forget(fd);
 	if (lseek64(fd, sb_offset << 9, 0)< 0LL)
 		return 3;
 
@@ -26,6 +26,10 @@
 #include	"mdadm.h"
 #include	<dirent.h>
 #include	<ctype.h>
+#ifndef MDASSEMBLE
+#include	<sys/epoll.h>
+#include	<sys/inotify.h>
+#endif
 
 int load_sys(char *path, char *buf)
 {
@@ -59,14 +63,14 @@ void sysfs_free(struct mdinfo *sra)
 
 int sysfs_open(int devnum, char *devname, char *attr)
 {
-	char fname[50];
+	char fname[PATH_MAX];
 	int fd;
 	char *mdname = devnum2devname(devnum);
 
 	if (!mdname)
 		return -1;
 
-	sprintf(fname, "/sys/block/%s/md/", mdname);
+	sprintf(fname, "%s/sys/block/%s/md/", mdadm_root(), mdname);
 	if (devname) {
 		strcat(fname, devname);
 		strcat(fname, "/");
@@ -119,7 +123,7 @@ struct mdinfo *sysfs_read(int fd, int devnum, unsigned long options)
 		return NULL;
 	}
 
-	sprintf(fname, "/sys/block/%s/md/", sra->sys_name);
+	sprintf(fname, "%s/sys/block/%s/md/", mdadm_root(), sra->sys_name);
 	base = fname + strlen(fname);
 
 	sra->devs = NULL;
@@ -318,7 +322,7 @@ struct mdinfo *sysfs_read(int fd, int devnum, unsigned long options)
 				sra->array.spare_disks++;
 		}
 		if (options & GET_ERROR) {
-			strcpy(buf, "errors");
+			strcpy(dbase, "errors");
 			if (load_sys(fname, buf))
 				goto abort;
 			dev->errors = strtoul(buf, NULL, 0);
@@ -369,21 +373,21 @@ unsigned long long get_component_size(int fd)
 	 * This returns in units of sectors.
 	 */
 	struct stat stb;
-	char fname[50];
+	char fname[PATH_MAX];
 	int n;
 	if (fstat(fd, &stb)) return 0;
 	if (major(stb.st_rdev) != (unsigned)get_mdp_major())
-		sprintf(fname, "/sys/block/md%d/md/component_size",
-			(int)minor(stb.st_rdev));
+		sprintf(fname, "%s/sys/block/md%d/md/component_size",
+			mdadm_root(), (int)minor(stb.st_rdev));
 	else
-		sprintf(fname, "/sys/block/md_d%d/md/component_size",
-			(int)minor(stb.st_rdev)>>MdpMinorShift);
+		sprintf(fname, "%s/sys/block/md_d%d/md/component_size",
+			mdadm_root(), (int)minor(stb.st_rdev)>>MdpMinorShift);
 	fd = open(fname, O_RDONLY);
 	if (fd < 0)
 		return 0;
-	n = read(fd, fname, sizeof(fname));
+	n = read(fd, fname, 50);
 	close(fd);
-	if (n == sizeof(fname))
+	if (n <= 0 || n == 50)
 		return 0;
 	fname[n] = 0;
 	return strtoull(fname, NULL, 10) * 2;
@@ -392,11 +396,11 @@ unsigned long long get_component_size(int fd)
 int sysfs_set_str(struct mdinfo *sra, struct mdinfo *dev,
 		  char *name, char *val)
 {
-	char fname[50];
+	char fname[PATH_MAX];
 	unsigned int n;
 	int fd;
 
-	sprintf(fname, "/sys/block/%s/md/%s/%s",
+	sprintf(fname, "%s/sys/block/%s/md/%s/%s", mdadm_root(),
 		sra->sys_name, dev?dev->sys_name:"", name);
 	fd = open(fname, O_WRONLY);
 	if (fd < 0)
@@ -421,11 +425,11 @@ int sysfs_set_num(struct mdinfo *sra, struct mdinfo *dev,
 
 int sysfs_uevent(struct mdinfo *sra, char *event)
 {
-	char fname[50];
+	char fname[PATH_MAX];
 	int n;
 	int fd;
 
-	sprintf(fname, "/sys/block/%s/uevent",
+	sprintf(fname, "%s/sys/block/%s/uevent", mdadm_root(),
 		sra->sys_name);
 	fd = open(fname, O_WRONLY);
 	if (fd < 0)
@@ -438,10 +442,10 @@ int sysfs_uevent(struct mdinfo *sra, char *event)
 int sysfs_get_fd(struct mdinfo *sra, struct mdinfo *dev,
 		       char *name)
 {
-	char fname[50];
+	char fname[PATH_MAX];
 	int fd;
 
-	sprintf(fname, "/sys/block/%s/md/%s/%s",
+	sprintf(fname, "%s/sys/block/%s/md/%s/%s", mdadm_root(),
 		sra->sys_name, dev?dev->sys_name:"", name);
 	fd = open(fname, O_RDWR);
 	if (fd < 0)
@@ -578,7 +582,8 @@ int sysfs_add_disk(struct mdinfo *sra, struct mdinfo *sd, int resume)
 		return rv;
 
 	memset(nm, 0, sizeof(nm));
-	sprintf(dv, "/sys/dev/block/%d:%d", sd->disk.major, sd->disk.minor);
+	sprintf(dv, "%s/sys/dev/block/%d:%d", mdadm_root(),
+		sd->disk.major, sd->disk.minor);
 	rv = readlink(dv, nm, sizeof(nm));
 	if (rv <= 0)
 		return -1;
@@ -617,8 +622,8 @@ int sysfs_disk_to_sg(int fd)
 	 * scsi_generic interface
 	 */
 	struct stat st;
-	char path[256];
-	char sg_path[256];
+	char path[PATH_MAX];
+	char sg_path[PATH_MAX];
 	char sg_major_minor[8];
 	char *c;
 	DIR *dir;
@@ -628,8 +633,8 @@ int sysfs_disk_to_sg(int fd)
 	if (fstat(fd, &st))
 		return -1;
 
-	snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/device",
-		 major(st.st_rdev), minor(st.st_rdev));
+	snprintf(path, sizeof(path), "%s/sys/dev/block/%d:%d/device",
+		 mdadm_root(), major(st.st_rdev), minor(st.st_rdev));
 
 	dir = opendir(path);
 	if (!dir)
@@ -680,7 +685,7 @@ int sysfs_disk_to_scsi_id(int fd, __u32 *id)
 {
 	/* from an open block device, try to retrieve it scsi_id */
 	struct stat st;
-	char path[256];
+	char path[PATH_MAX];
 	char *c1, *c2;
 	DIR *dir;
 	struct dirent *de;
@@ -688,8 +693,8 @@ int sysfs_disk_to_scsi_id(int fd, __u32 *id)
 	if (fstat(fd, &st))
 		return 1;
 
-	snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/device",
-		 major(st.st_rdev), minor(st.st_rdev));
+	snprintf(path, sizeof(path), "%s/sys/dev/block/%d:%d/device",
+		 mdadm_root(), major(st.st_rdev), minor(st.st_rdev));
 
 	dir = opendir(path);
 	if (!dir)
@@ -736,11 +741,11 @@ int sysfs_unique_holder(int devnum, long rdev)
 	 */
 	DIR *dir;
 	struct dirent *de;
-	char dirname[100];
-	char l;
+	char dirname[PATH_MAX];
+	int l;
 	int found = 0;
-	sprintf(dirname, "/sys/dev/block/%d:%d/holders",
-		major(rdev), minor(rdev));
+	sprintf(dirname, "%s/sys/dev/block/%d:%d/holders",
+		mdadm_root(), major(rdev), minor(rdev));
 	dir = opendir(dirname);
 	errno = ENOENT;
 	if (!dir)
@@ -890,4 +895,346 @@ int WaitClean(char *dev, int sock, int verbose)
 
 	return rv;
 }
+/* Waiting for md to change something.
+ *
+ * md reports changes to many sysfs attributes, and to /proc/mdstat,
+ * with POLLPRI.  epoll lets us wait for any number of them at a cost
+ * that doesn't depend on how many there are, and tells us which one
+ * fired.  Ordinary files, such as those found below MDADM_ROOT when
+ * testing, cannot be polled (epoll_ctl reports EPERM) so they are
+ * watched with inotify instead.  The one inotify fd is itself in the
+ * epoll set and its events are translated back into the caller's
+ * cookie, so the caller cannot tell the difference.  inotify sees
+ * any writable fd being closed as a change, so anything reading
+ * watched attributes should open them read-only.
+ *
+ * An attribute that has fired keeps firing until it is read again, so
+ * sysfs_watch_wait re-reads it before reporting, unless it was watched
+ * with sysfs_watch_read by a caller that will read it anyway.
+ * md also reports a change made between the caller's last read and
+ * the watch starting, where inotify would say nothing, so a new
+ * inotify watch is reported once straight away in case.
+ */
+struct sysfs_watch {
+	int fd;
+	int wd;		/* inotify watch, or -1 if polled directly */
+	int io;		/* don't re-read: not an attribute, or the caller will */
+	int fresh;	/* inotify watch not yet reported */
+	void *cookie;
+	struct sysfs_watch *next;
+};
+static struct sysfs_watch *watches;
+static int watch_inotify = -1;
+static int watch_fresh;
+
+static int watch_attr_fd(int epfd, int fd, char *path, int io, void *cookie)
+{
+	struct sysfs_watch *w = malloc(sizeof(*w));
+	struct epoll_event ev;
+
+	if (!w)
+		return -1;
+	w->fd = fd;
+	w->wd = -1;
+	w->io = io;
+	w->fresh = 0;
+	w->cookie = cookie;
+	ev.events = EPOLLPRI;
+	ev.data.ptr = w;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		if (errno != EPERM || !path)
+			goto abort;
+		if (watch_inotify < 0) {
+			watch_inotify = inotify_init();
+			if (watch_inotify < 0)
+				goto abort;
+			fcntl(watch_inotify, F_SETFD, FD_CLOEXEC);
+			fcntl(watch_inotify, F_SETFL, O_NONBLOCK);
+			ev.events = EPOLLIN;
+			ev.data.ptr = &watch_inotify;
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, watch_inotify,
+				      &ev) != 0) {
+				close(watch_inotify);
+				watch_inotify = -1;
+				goto abort;
+			}
+		}
+		w->wd = inotify_add_watch(watch_inotify, path,
+					  IN_CLOSE_WRITE);
+		if (w->wd < 0)
+			goto abort;
+		w->fresh = watch_fresh = 1;
+	}
+	w->next = watches;
+	watches = w;
+	return 0;
+ abort:
+	free(w);
+	return -1;
+}
+
+int sysfs_watch_fd(int epfd, int fd, char *path, void *cookie)
+{
+	return watch_attr_fd(epfd, fd, path, 0, cookie);
+}
+
+int sysfs_watch_read(int epfd, int fd, char *path, void *cookie)
+{
+	/* As sysfs_watch_fd, but the caller reads the attribute every
+	 * time it fires, so we needn't.  If the read fails with ENODEV
+	 * the caller should sysfs_unwatch_fd it.
+	 */
+	return watch_attr_fd(epfd, fd, path, 1, cookie);
+}
+
+int sysfs_watch_io(int epfd, int fd, int out, void *cookie)
+{
+	/* Watch some other fd, such as a socket, for input or (if
+	 * 'out') for output, so that sysfs_watch_wait can report it
+	 * along with everything else.
+	 */
+	struct sysfs_watch *w = malloc(sizeof(*w));
+	struct epoll_event ev;
+
+	if (!w)
+		return -1;
+	w->fd = fd;
+	w->wd = -1;
+	w->io = 1;
+	w->fresh = 0;
+	w->cookie = cookie;
+	ev.events = out ? EPOLLOUT : EPOLLIN;
+	ev.data.ptr = w;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		free(w);
+		return -1;
+	}
+	w->next = watches;
+	watches = w;
+	return 0;
+}
+
+int sysfs_watch_attr(int epfd, int devnum, char *devname, char *attr,
+		     void *cookie)
+{
+	/* Open and watch an attribute of an md array, or of one
+	 * of its members if devname is given.
+	 * Returns the fd, which must be passed to sysfs_unwatch_fd
+	 * before it is closed.
+	 */
+	char path[PATH_MAX];
+	char *mdname = devnum2devname(devnum);
+	int fd;
+
+	if (!mdname)
+		return -1;
+	if (devname)
+		snprintf(path, sizeof(path), "%s/sys/block/%s/md/%s/%s",
+			 mdadm_root(), mdname, devname, attr);
+	else
+		snprintf(path, sizeof(path), "%s/sys/block/%s/md/%s",
+			 mdadm_root(), mdname, attr);
+	free(mdname);
+	/* read-only, as closing a writable fd looks like a change */
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if (sysfs_watch_fd(epfd, fd, path, cookie) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void sysfs_unwatch_fd(int epfd, int fd)
+{
+	struct sysfs_watch **wp, *w;
+
+	for (wp = &watches; (w = *wp) != NULL; wp = &w->next)
+		if (w->fd == fd)
+			break;
+	if (!w)
+		return;
+	*wp = w->next;
+	if (w->wd >= 0)
+		inotify_rm_watch(watch_inotify, w->wd);
+	else
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	free(w);
+}
+
+static int add_cookie(void **cookies, int cnt, int max, void *cookie)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		if (cookies[i] == cookie)
+			return cnt;
+	if (cnt >= max)
+		return -1;
+	cookies[cnt] = cookie;
+	return cnt + 1;
+}
+
+int sysfs_watch_wait(int epfd, void **cookies, int max, int timeout,
+		     const sigset_t *sigmask)
+{
+	/* Wait up to 'timeout' msecs for any watched fd to fire and
+	 * fill 'cookies' with the cookies of those that did, each once.
+	 * Returns the number found, or 0 on timeout.
+	 * Returns -1 on error, including when more than 'max' cookies
+	 * fired or inotify dropped some events (errno is EOVERFLOW),
+	 * in which case the caller had better assume that everything
+	 * changed.
+	 */
+	struct epoll_event ev[32];
+	char buf[64];
+	int n, i;
+	int cnt = 0;
+
+	if (watch_fresh) {
+		struct sysfs_watch *w;
+
+		for (w = watches; w && cnt >= 0; w = w->next)
+			if (w->fresh) {
+				w->fresh = 0;
+				cnt = add_cookie(cookies, cnt, max, w->cookie);
+			}
+		watch_fresh = 0;
+		timeout = 0;
+	}
+	n = epoll_pwait(epfd, ev, 32, timeout, sigmask);
+	for (i = 0; i < n && cnt >= 0; i++) {
+		struct sysfs_watch *w = ev[i].data.ptr;
+
+		if (ev[i].data.ptr == &watch_inotify) {
+			char ibuf[4096]
+				__attribute__ ((aligned(__alignof__(struct inotify_event))));
+			struct inotify_event *ie;
+			int len;
+			char *p;
+
+			while (cnt >= 0 &&
+			       (len = read(watch_inotify, ibuf,
+					   sizeof(ibuf))) > 0)
+				for (p = ibuf; p < ibuf + len && cnt >= 0;
+				     p += sizeof(*ie) + ie->len) {
+					ie = (struct inotify_event *)p;
+					if (ie->mask & IN_Q_OVERFLOW)
+						cnt = -1;
+					for (w = watches; w && cnt >= 0;
+					     w = w->next)
+						if (w->wd == ie->wd)
+							cnt = add_cookie(cookies,
+									 cnt, max,
+									 w->cookie);
+				}
+			continue;
+		}
+		if (!w->io) {
+			/* re-arm */
+			lseek(w->fd, 0, SEEK_SET);
+			if (read(w->fd, buf, sizeof(buf)) < 0 &&
+			    errno == ENODEV)
+				/* attribute has gone away; don't spin on it */
+				epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, NULL);
+		}
+		cnt = add_cookie(cookies, cnt, max, w->cookie);
+	}
+	if (n < 0)
+		return -1;
+	if (cnt < 0) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	return cnt;
+}
+
+int sysfs_disk_stat(int major, int minor, struct disk_stat *ds)
+{
+	/* Read the I/O counters of a block device from its stat file.
+	 * The fields we want are reads, read sectors and read ticks
+	 * (1, 3 and 4) and the same for writes (5, 7 and 8).
+	 */
+	char path[PATH_MAX];
+	char buf[1024];
+	unsigned long long v[8];
+
+	sprintf(path, "%s/sys/dev/block/%d:%d/stat", mdadm_root(),
+		major, minor);
+	if (load_sys(path, buf) != 0)
+		return -1;
+	if (sscanf(buf, "%llu %llu %llu %llu %llu %llu %llu %llu",
+		   &v[0], &v[1], &v[2], &v[3],
+		   &v[4], &v[5], &v[6], &v[7]) != 8)
+		return -1;
+	ds->ios = v[0] + v[4];
+	ds->sectors = v[2] + v[6];
+	ds->ticks = v[3] + v[7];
+	return 0;
+}
+
+static int cmp_ul(const void *a, const void *b)
+{
+	unsigned long x = *(unsigned long *)a;
+	unsigned long y = *(unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int disk_stat_slow(struct disk_stat *ds, int n, int *slow)
+{
+	/* Given the I/O done by each member of an array over the same
+	 * time, set slow[i] for the members that take much longer over
+	 * each request than the others.  "Much longer" means more than
+	 * twice the median, and well outside the usual spread (the
+	 * median absolute deviation), and at least SLOW_MIN_MS.
+	 * Members doing too little I/O to judge are never slow, and
+	 * we need at least three to judge any.
+	 * Returns the number of slow members.
+	 */
+	unsigned long *await, *sorted;
+	unsigned long med, mad, limit;
+	int i, cnt = 0, nslow = 0;
+
+	for (i = 0; i < n; i++)
+		slow[i] = 0;
+	if (n < 3)
+		return 0;
+	await = malloc(2 * n * sizeof(*await));
+	if (!await)
+		return 0;
+	sorted = await + n;
+	for (i = 0; i < n; i++) {
+		if (ds[i].ios < SLOW_MIN_IOS)
+			continue;
+		/* usecs, to keep some precision */
+		await[i] = ds[i].ticks * 1000 / ds[i].ios;
+		sorted[cnt++] = await[i];
+	}
+	if (cnt < 3) {
+		free(await);
+		return 0;
+	}
+	qsort(sorted, cnt, sizeof(*sorted), cmp_ul);
+	med = sorted[cnt/2];
+	for (i = 0; i < cnt; i++)
+		sorted[i] = sorted[i] > med ? sorted[i] - med : med - sorted[i];
+	qsort(sorted, cnt, sizeof(*sorted), cmp_ul);
+	mad = sorted[cnt/2];
+
+	limit = med * 2;
+	if (limit < med + 5 * mad)
+		limit = med + 5 * mad;
+	if (limit < SLOW_MIN_MS * 1000)
+		limit = SLOW_MIN_MS * 1000;
+	for (i = 0; i < n; i++)
+		if (ds[i].ios >= SLOW_MIN_IOS && await[i] > limit) {
+			slow[i] = 1;
+			nslow++;
+		}
+	free(await);
+	return nslow;
+}
 #endif /* MDASSEMBLE */
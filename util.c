@@ -552,7 +552,8 @@ int check_raid(int fd, char *name)
 	struct supertype *st = guess_super(fd);
 
 	if (!st) return 0;
-	st->ss->load_super(st, fd, name);
+	if (!st->sb)
+		st->ss->load_super(st, fd, name);
 	/* Looks like a raid array .. */
 	fprintf(stderr, Name ": %s appears to be part of a raid array:\n",
 		name);
@@ -879,9 +880,12 @@ static int mdp_major = -1;
 	int have_devices = 0;
 	int last_num = -1;
 
+	char path[PATH_MAX];
+
 	if (mdp_major != -1)
 		return mdp_major;
-	fl = fopen("/proc/devices", "r");
+	sprintf(path, "%s/proc/devices", mdadm_root());
+	fl = fopen(path, "r");
 	if (!fl)
 		return -1;
 	while ((w = conf_word(fl, 1))) {
@@ -934,6 +938,16 @@ char *get_md_name(int dev)
 	dn = map_dev(major(rdev), minor(rdev), 0);
 	if (dn)
 		return dn;
+	if (*mdadm_root()) {
+		/* Not looking at the real /sys, so there probably
+		 * isn't a real device to make a node for.
+		 */
+		if (dev < 0)
+			snprintf(devname, sizeof(devname), "/dev/md_d%d", -1-dev);
+		else
+			snprintf(devname, sizeof(devname), "/dev/md%d", dev);
+		return devname;
+	}
 	snprintf(devname, sizeof(devname), "/dev/.tmp.md%d", dev);
 	if (mknod(devname, S_IFBLK | 0600, rdev) == -1)
 		if (errno != EEXIST)
@@ -960,10 +974,23 @@ int find_free_devnum(int use_partitions)
 	     devnum = devnum ? devnum-1 : (1<<20)-1) {
 		char *dn;
 		int _devnum;
+		char path[PATH_MAX];
+		struct stat stb;
 
 		_devnum = use_partitions ? (-1-devnum) : devnum;
 		if (mddev_busy(_devnum))
 			continue;
+		/* Someone may have just opened it to assemble an
+		 * array, which won't be in /proc/mdstat yet.
+		 */
+		if (use_partitions)
+			sprintf(path, "%s/sys/block/md_d%d", mdadm_root(),
+				devnum);
+		else
+			sprintf(path, "%s/sys/block/md%d", mdadm_root(),
+				devnum);
+		if (stat(path, &stb) == 0)
+			continue;
 		/* make sure it is new to /dev too, at least as a
 		 * non-standard */
 		dn = map_dev(dev2major(_devnum), dev2minor(_devnum), 0);
@@ -1168,43 +1195,715 @@ struct supertype *dup_super(struct supertype *orig)
 	return st;
 }
 
+/* Every metadata handler looks for its superblock near the start or
+ * the end of a device, so while guess_super asks them all, those
+ * parts are read just once and the handlers' reads (through
+ * probe_read) are answered from memory.  The same copy serves to
+ * check the superblock cache, and then to load what it names.
+ * probe_prefetch makes such copies of many devices at once, for the
+ * benefit of a loop that will then look at each in turn.  They are
+ * only used until probe_forget (or probe_scan(0)), which must come
+ * before anything that might write to those devices.
+ */
+#define PROBE_HEAD (64*1024)
+#define PROBE_TAIL (128*1024)
+#define PROBE_THREADS 32
+struct probe_copy {
+	dev_t dev;		/* st_rdev, or st_dev of a file */
+	ino_t ino;		/* 0 for a device */
+	char *devname;		/* for probe_prefetch */
+	unsigned long long size;
+	char *head, *tail;
+	unsigned long long headlen, taillen;
+	int valid;
+};
+static struct probe_copy probe_own;
+static struct probe_copy *probe;	/* what guess_super is looking at */
+static int probe_fd = -1;
+static struct probe_copy *prefetched;
+static int nprefetched;
+static int probe_held;
+static int probe_scanning;	/* prefetched copies may be used */
+
+static int probe_key(int fd, dev_t *dev, ino_t *ino)
+{
+	struct stat stb;
+
+	if (fstat(fd, &stb) != 0)
+		return -1;
+	if (S_ISBLK(stb.st_mode)) {
+		*dev = stb.st_rdev;
+		*ino = 0;
+	} else {
+		*dev = stb.st_dev;
+		*ino = stb.st_ino;
+	}
+	return 0;
+}
+
+static void probe_fill(struct probe_copy *p, int fd)
+{
+	unsigned long long size;
+
+	if (probe_key(fd, &p->dev, &p->ino) != 0 ||
+	    !get_dev_size(fd, NULL, &size) || size < 512)
+		return;
+	p->size = size;
+	p->headlen = size < PROBE_HEAD ? size : PROBE_HEAD;
+	p->taillen = size < PROBE_TAIL ? size : PROBE_TAIL;
+	if (posix_memalign((void**)&p->head, 4096, p->headlen) != 0)
+		p->head = NULL;
+	if (posix_memalign((void**)&p->tail, 4096, p->taillen) != 0)
+		p->tail = NULL;
+	ioctl(fd, BLKFLSBUF, 0); /* make sure we read current data */
+	if (p->head && p->tail &&
+	    pread64(fd, p->head, p->headlen, 0) == (ssize_t)p->headlen &&
+	    pread64(fd, p->tail, p->taillen, size - p->taillen)
+	    == (ssize_t)p->taillen)
+		p->valid = 1;
+}
+
+static void probe_free(struct probe_copy *p)
+{
+	free(p->head);
+	free(p->tail);
+	p->head = p->tail = NULL;
+	p->valid = 0;
+}
+
+static struct probe_copy *probe_lookup(int fd)
+{
+	dev_t dev;
+	ino_t ino;
+	int i;
+
+	if (!nprefetched || probe_key(fd, &dev, &ino) != 0)
+		return NULL;
+	for (i = 0; i < nprefetched; i++)
+		if (prefetched[i].valid && prefetched[i].dev == dev &&
+		    prefetched[i].ino == ino)
+			return &prefetched[i];
+	return NULL;
+}
+
+static struct probe_copy *probe_find(int fd)
+{
+	return probe_scanning ? probe_lookup(fd) : NULL;
+}
+
+static void probe_fill_anchors(struct probe_copy *p, int fd);
+
+static void probe_start(int fd)
+{
+	probe = probe_find(fd);
+	if (!probe) {
+		probe_fill_anchors(&probe_own, fd);
+		probe = &probe_own;
+	}
+	if (probe->valid)
+		probe_fd = fd;
+}
+
+static void probe_end(void)
+{
+	probe_free(&probe_own);
+	probe = NULL;
+	probe_fd = -1;
+}
+
+static char *probe_at(struct probe_copy *p, unsigned long long pos, int len)
+{
+	/* where 'len' bytes at 'pos' are in the copy, if they are */
+	unsigned long long end = pos + len;
+
+	if (end <= p->headlen)
+		return p->head + pos;
+	if (pos >= p->size - p->taillen && end <= p->size)
+		return p->tail + (pos - (p->size - p->taillen));
+	return NULL;
+}
+
+int probe_read(int fd, void *buf, int len)
+{
+	/* read() for metadata handlers */
+	struct probe_copy *p = NULL;
+	char *from = NULL;
+	off64_t o;
+
+	if (len > 0)
+		p = fd == probe_fd ? probe : probe_find(fd);
+	if (!p || (o = lseek64(fd, 0, SEEK_CUR)) < 0)
+		return read(fd, buf, len);
+	from = probe_at(p, o, len);
+	if (!from)
+		return read(fd, buf, len);
+	memcpy(buf, from, len);
+	lseek64(fd, o + len, SEEK_SET);
+	return len;
+}
+
+/* The superblock cache.
+ * What guess_super finds rarely changes from one run of mdadm to the
+ * next, so the metadata type and a summary of the superblock on each
+ * device are kept in MAP_DIR/SUPER_CACHE.  An entry is only believed
+ * once every block where any handler looks for a superblock (imsm and
+ * ddf for their anchors) has been read again and found unchanged.
+ * The event count or generation number in the winner's changes
+ * whenever its metadata does, and anything that writes another type
+ * of superblock - an older mdadm, another tool, a 1.x create over a
+ * leftover 0.90 - changes one of the others, where guess_super might
+ * now find a newer one.  DDF itself isn't cached as its anchor never
+ * changes.
+ * mdadm drops a device's entry whenever it writes a superblock there.
+ */
+struct sb_cache {
+	struct sb_summary sum;
+	ino_t ino;			/* as for probe_copy */
+	unsigned long crc;		/* of all the anchors */
+	int checked;			/* 1 still there, -1 not */
+	struct sb_cache *next;
+};
+
+/* Everywhere guess_super might find something */
+static struct sb_place {
+	struct superswitch *ss;
+	int minor;
+} sb_places[] = {
+	{ &super0, 90 },
+	{ &super1, 0 },
+	{ &super1, 1 },
+	{ &super1, 2 },
+	{ &super_imsm, 0 },
+	{ &super_ddf, 0 },
+	{ NULL, 0 }
+};
+static struct sb_cache *sb_cache;
+static int sb_cache_loaded, sb_cache_dirty;
+
+unsigned long crc32(
+	unsigned long crc,
+	const unsigned char *buf,
+	unsigned len);
+
+static int sb_anchor(struct superswitch *ss, int minor,
+		     unsigned long long size,
+		     unsigned long long *pos, int *len)
+{
+	if (ss == &super0 && size >= MD_RESERVED_SECTORS*512) {
+		*pos = MD_NEW_SIZE_SECTORS(size >> 9) * 512;
+		*len = MD_SB_BYTES;
+	} else if (ss == &super1 && size >= 24*512) {
+		switch (minor) {
+		case 0: *pos = (((size >> 9) - 8*2) & ~(4*2-1ULL)) * 512;
+			break;
+		case 1: *pos = 0;
+			break;
+		case 2: *pos = 4096;
+			break;
+		default: return -1;
+		}
+		*len = 1024;
+	} else if (ss == &super_imsm && size >= 1024) {
+		*pos = size - 1024;
+		*len = 512;
+	} else if (ss == &super_ddf && size >= 512) {
+		*pos = size - 512;
+		*len = 512;
+	} else
+		return -1;
+	return 0;
+}
+
+static void probe_fill_anchors(struct probe_copy *p, int fd)
+{
+	/* Like probe_fill, but only as much of each end as holds the
+	 * anchors in sb_places.  That is all the cache needs to check,
+	 * and all most handlers read.
+	 */
+	struct sb_place *sp;
+	unsigned long long size, pos;
+	int len;
+
+	if (probe_key(fd, &p->dev, &p->ino) != 0 ||
+	    !get_dev_size(fd, NULL, &size) || size < 512)
+		return;
+	p->size = size;
+	p->headlen = p->taillen = 0;
+	for (sp = sb_places; sp->ss; sp++) {
+		if (sb_anchor(sp->ss, sp->minor, size, &pos, &len) != 0)
+			continue;
+		if (pos + len <= PROBE_HEAD) {
+			if (pos + len > p->headlen)
+				p->headlen = pos + len;
+		} else if (size - pos > p->taillen)
+			p->taillen = size - pos;
+	}
+	if (posix_memalign((void**)&p->head, 4096, p->headlen ?: 512) != 0)
+		p->head = NULL;
+	if (posix_memalign((void**)&p->tail, 4096, p->taillen ?: 512) != 0)
+		p->tail = NULL;
+	ioctl(fd, BLKFLSBUF, 0);
+	if (p->head && p->tail &&
+	    pread64(fd, p->head, p->headlen, 0) == (ssize_t)p->headlen &&
+	    pread64(fd, p->tail, p->taillen, size - p->taillen)
+	    == (ssize_t)p->taillen)
+		p->valid = 1;
+}
+
+static int sb_anchors_crc(int fd, struct probe_copy *p,
+			  unsigned long long size, unsigned long *crcp)
+{
+	/* crc every anchor in sb_places on a device of 'size', from
+	 * the copy 'p' or, if it doesn't have them all, from 'fd'
+	 * with one read near each end.
+	 */
+	struct probe_copy own;
+	struct sb_place *sp;
+	unsigned long long pos;
+	unsigned long crc = 0;
+	char *from;
+	int len, rv = -1;
+
+	memset(&own, 0, sizeof(own));
+	if (p) {
+		for (sp = sb_places; sp->ss; sp++)
+			if (sb_anchor(sp->ss, sp->minor, size, &pos, &len) == 0 &&
+			    probe_at(p, pos, len) == NULL)
+				break;
+		if (sp->ss)
+			p = NULL;
+	}
+	if (!p && fd < 0)
+		return -1;
+	if (!p) {
+		probe_fill_anchors(&own, fd);
+		if (!own.valid || own.size != size)
+			goto out;
+		p = &own;
+	}
+	for (sp = sb_places; sp->ss; sp++) {
+		if (sb_anchor(sp->ss, sp->minor, size, &pos, &len) != 0)
+			continue;
+		from = probe_at(p, pos, len);
+		if (!from)
+			goto out;
+		crc = crc32(crc, (unsigned char *)from, len);
+	}
+	*crcp = crc;
+	rv = 0;
+ out:
+	free(own.head);
+	free(own.tail);
+	return rv;
+}
+
+static void sb_cache_name(char *path)
+{
+	sprintf(path, "%s%s/%s", mdadm_root(), MAP_DIR, SUPER_CACHE);
+}
+
+static void super_cache_load(void)
+{
+	char path[PATH_MAX];
+	char line[1024];
+	char ssname[20];
+	unsigned long long dev, ino;
+	struct sb_cache *c;
+	FILE *f;
+	int n, i;
+
+	if (sb_cache_loaded)
+		return;
+	sb_cache_loaded = 1;
+	sb_cache_name(path);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		c = calloc(1, sizeof(*c));
+		if (!c)
+			break;
+		n = 0;
+		if (sscanf(line, "%llx %llx %llu %lx %19s %d "
+			   "%x:%x:%x:%x %llu %d %ld %n",
+			   &dev, &ino, &c->sum.size,
+			   &c->crc, ssname, &c->sum.minor_version,
+			   &c->sum.uuid[0], &c->sum.uuid[1], &c->sum.uuid[2],
+			   &c->sum.uuid[3], &c->sum.events, &c->sum.role,
+			   &c->sum.ctime, &n) != 13 || n == 0) {
+			free(c);
+			continue;
+		}
+		for (i = 0; superlist[i]; i++)
+			if (strcmp(superlist[i]->name, ssname) == 0)
+				c->sum.ss = superlist[i];
+		if (!c->sum.ss) {
+			free(c);
+			continue;
+		}
+		c->sum.dev = dev;
+		c->ino = ino;
+		strncpy(c->sum.name, line + n, sizeof(c->sum.name) - 1);
+		c->sum.name[strcspn(c->sum.name, "\n")] = 0;
+		c->next = sb_cache;
+		sb_cache = c;
+	}
+	fclose(f);
+}
+
+static void super_cache_save(void)
+{
+	/* Replace the file in one go, so readers never see half of it.
+	 * If two of us race, one set of changes is lost, which only
+	 * means more reading next time.
+	 */
+	char path[PATH_MAX], tmp[PATH_MAX+20];
+	struct sb_cache *c;
+	FILE *f;
+	int fd;
+
+	if (!sb_cache_dirty)
+		return;
+	sb_cache_dirty = 0;
+	sprintf(path, "%s%s", mdadm_root(), MAP_DIR);
+	mkdir(path, 0755);
+	sb_cache_name(path);
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0)
+		return;
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	for (c = sb_cache; c; c = c->next)
+		if (c->checked >= 0)
+			fprintf(f, "%llx %llx %llu %lx %s %d "
+				"%08x:%08x:%08x:%08x %llu %d %ld %s\n",
+				(unsigned long long)c->sum.dev,
+				(unsigned long long)c->ino, c->sum.size,
+				c->crc, c->sum.ss->name,
+				c->sum.minor_version, c->sum.uuid[0],
+				c->sum.uuid[1], c->sum.uuid[2], c->sum.uuid[3],
+				c->sum.events, c->sum.role, c->sum.ctime,
+				c->sum.name);
+	if (fclose(f) != 0 || rename(tmp, path) != 0)
+		unlink(tmp);
+}
+
+void super_cache_reset(void)
+{
+	/* Something that runs for a long time must look at the cache
+	 * afresh now and then, as others may have written superblocks.
+	 */
+	struct sb_cache *c;
+
+	super_cache_save();
+	while ((c = sb_cache) != NULL) {
+		sb_cache = c->next;
+		free(c);
+	}
+	sb_cache_loaded = 0;
+}
+
+static struct sb_cache *sb_cache_entry(dev_t dev, ino_t ino)
+{
+	struct sb_cache *c;
+
+	for (c = sb_cache; c; c = c->next)
+		if (c->sum.dev == dev && c->ino == ino)
+			return c;
+	return NULL;
+}
+
+struct sb_summary *super_cache_find(int fd)
+{
+	/* What the cache says is on 'fd', if it is still there.
+	 * That costs two small reads the first time, unless we already
+	 * have a copy of those parts of the device.
+	 */
+	struct sb_cache *c;
+	unsigned long long size;
+	unsigned long crc;
+	dev_t dev;
+	ino_t ino;
+
+	super_cache_load();
+	if (!sb_cache || probe_key(fd, &dev, &ino) != 0)
+		return NULL;
+	c = sb_cache_entry(dev, ino);
+	if (!c || c->checked < 0)
+		return NULL;
+	if (c->checked)
+		return &c->sum;
+	c->checked = -1;
+	if (!get_dev_size(fd, NULL, &size) || size != c->sum.size)
+		goto stale;
+	if (sb_anchors_crc(fd, fd == probe_fd ? probe : probe_find(fd),
+			   size, &crc) == 0 && crc == c->crc) {
+		c->checked = 1;
+		return &c->sum;
+	}
+ stale:
+	sb_cache_dirty = 1;
+	return NULL;
+}
+
+static void super_cache_note(struct supertype *st, struct mdinfo *info)
+{
+	/* guess_super found 'st' on the device 'probe' is a copy of */
+	unsigned long long pos;
+	unsigned long crc;
+	struct sb_cache *c;
+	int len;
+
+	if (!probe || !probe->valid || st->ss == &super_ddf ||
+	    sb_anchor(st->ss, st->minor_version, probe->size, &pos, &len) != 0 ||
+	    sb_anchors_crc(-1, probe, probe->size, &crc) != 0)
+		return;
+	super_cache_load();
+	c = sb_cache_entry(probe->dev, probe->ino);
+	if (!c) {
+		c = calloc(1, sizeof(*c));
+		if (!c)
+			return;
+		c->sum.dev = probe->dev;
+		c->ino = probe->ino;
+		c->next = sb_cache;
+		sb_cache = c;
+	}
+	c->sum.ss = st->ss;
+	c->sum.minor_version = st->minor_version;
+	memcpy(c->sum.uuid, info->uuid, sizeof(c->sum.uuid));
+	strncpy(c->sum.name, info->name, sizeof(c->sum.name) - 1);
+	c->sum.name[strcspn(c->sum.name, "\n")] = 0;
+	c->sum.events = info->events;
+	c->sum.role = info->disk.raid_disk;
+	c->sum.size = probe->size;
+	c->sum.ctime = info->array.ctime;
+	c->crc = crc;
+	c->checked = 1;
+	sb_cache_dirty = 1;
+}
+
+void super_cache_forget(int fd)
+{
+	/* We are about to write a superblock to 'fd' */
+	struct probe_copy *p;
+	struct sb_cache *c;
+	dev_t dev;
+	ino_t ino;
+
+	p = probe_lookup(fd);
+	if (p)
+		probe_free(p);
+	super_cache_load();
+	if (probe_key(fd, &dev, &ino) != 0 ||
+	    (c = sb_cache_entry(dev, ino)) == NULL || c->checked < 0)
+		return;
+	c->checked = -1;
+	sb_cache_dirty = 1;
+	super_cache_save();
+}
+
+#if defined(USE_PTHREADS) && !defined(MDASSEMBLE)
+#include	<pthread.h>
+static pthread_mutex_t pf_lock = PTHREAD_MUTEX_INITIALIZER;
+#define pf_lock()	pthread_mutex_lock(&pf_lock)
+#define pf_unlock()	pthread_mutex_unlock(&pf_lock)
+#else
+#define pf_lock()
+#define pf_unlock()
+#endif
+static int pf_next;
+
+static void *prefetcher(void *v)
+{
+	struct probe_copy *p;
+	int fd;
+
+	for (;;) {
+		/* dev_open may have to make a device node, so one
+		 * at a time there.
+		 */
+		pf_lock();
+		if (pf_next >= nprefetched) {
+			pf_unlock();
+			return NULL;
+		}
+		p = &prefetched[pf_next++];
+		fd = dev_open(p->devname, O_RDONLY);
+		pf_unlock();
+		if (fd >= 0) {
+			probe_fill(p, fd);
+			close(fd);
+		}
+	}
+}
+
+void probe_prefetch(mddev_dev_t devlist)
+{
+	/* Read what guess_super and load_super will want from every
+	 * device on the list that isn't already finished with, with
+	 * up to PROBE_THREADS reads at a time rather than waiting for
+	 * each device in turn.  The copies are used until probe_forget
+	 * or probe_scan(0), so nothing may be written to these devices
+	 * until then.
+	 */
+	mddev_dev_t dv;
+	int n = 0;
+#if defined(USE_PTHREADS) && !defined(MDASSEMBLE)
+	pthread_t tid[PROBE_THREADS];
+	pthread_attr_t attr;
+	int started = 0;
+#endif
+
+	if (probe_held) {
+		probe_scanning = 1;
+		return;
+	}
+	probe_forget();
+	probe_scanning = 1;
+	for (dv = devlist; dv; dv = dv->next)
+		if (dv->used < 2)
+			n++;
+	if (n < 2)
+		return;
+	prefetched = calloc(n, sizeof(*prefetched));
+	if (!prefetched)
+		return;
+	for (dv = devlist; dv; dv = dv->next)
+		if (dv->used < 2)
+			prefetched[nprefetched++].devname = dv->devname;
+	pf_next = 0;
+
+#if defined(USE_PTHREADS) && !defined(MDASSEMBLE)
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 64*1024);
+	while (started < PROBE_THREADS - 1 && started < n - 1 &&
+	       pthread_create(&tid[started], &attr, prefetcher, NULL) == 0)
+		started++;
+	pthread_attr_destroy(&attr);
+	prefetcher(NULL);
+	while (started)
+		pthread_join(tid[--started], NULL);
+#else
+	prefetcher(NULL);
+#endif
+}
+
+void probe_forget(void)
+{
+	probe_scanning = 0;
+	if (probe_held)
+		return;
+	while (nprefetched)
+		probe_free(&prefetched[--nprefetched]);
+	free(prefetched);
+	prefetched = NULL;
+	super_cache_save();
+}
+
+void probe_scan(int on)
+{
+	/* Start or stop using the copies, for a caller that reads
+	 * more than one device's superblocks in between.
+	 */
+	probe_scanning = on;
+}
+
+void probe_drop(char *devname)
+{
+	/* We are going to write to 'devname' (or the kernel will),
+	 * so a copy of it can't be kept for later scans.
+	 */
+	struct probe_copy *p;
+	int fd;
+
+	if (!nprefetched)
+		return;
+	fd = dev_open(devname, O_RDONLY);
+	if (fd < 0)
+		return;
+	p = probe_lookup(fd);
+	if (p)
+		probe_free(p);
+	close(fd);
+}
+
+void probe_hold(int hold)
+{
+	/* While held, the copies that probe_prefetch made are kept,
+	 * and probe_prefetch and probe_forget just start and stop
+	 * using them, so that a series of scans (or child processes)
+	 * can share one reading of each device.
+	 */
+	probe_held = 0;
+	if (!hold)
+		probe_forget();
+	probe_held = hold;
+}
+
 struct supertype *guess_super(int fd)
 {
 	/* try each load_super to find the best match,
-	 * and return the best superswitch
+	 * and return the best superswitch with its metadata loaded,
+	 * so the caller needn't read it again.  When the superblock
+	 * cache answers we still load, but only the one it names, and
+	 * from the same copy of the device the cache was checked
+	 * against.
 	 */
 	struct superswitch  *ss;
-	struct supertype *st;
+	struct supertype *st, tst;
+	struct sb_summary *sum;
+	struct mdinfo info, bestinfo;
 	time_t besttime = 0;
 	int bestsuper = -1;
 	int i;
 
 	st = malloc(sizeof(*st));
+	if (!st)
+		return NULL;
+	probe_start(fd);
+	sum = super_cache_find(fd);
+	if (sum) {
+		memset(st, 0, sizeof(*st));
+		st->ss = sum->ss;
+		st->minor_version = sum->minor_version;
+		if (st->ss->load_super(st, fd, NULL) == 0) {
+			probe_end();
+			return st;
+		}
+		/* Odd, but look at everything as if we didn't know */
+	}
 	for (i=0 ; superlist[i]; i++) {
 		int rv;
 		ss = superlist[i];
-		memset(st, 0, sizeof(*st));
-		rv = ss->load_super(st, fd, NULL);
+		memset(&tst, 0, sizeof(tst));
+		rv = ss->load_super(&tst, fd, NULL);
 		if (rv == 0) {
-			struct mdinfo info;
-			st->ss->getinfo_super(st, &info);
+			tst.ss->getinfo_super(&tst, &info);
 			if (bestsuper == -1 ||
 			    besttime < info.array.ctime) {
+				if (bestsuper != -1)
+					st->ss->free_super(st);
 				bestsuper = i;
 				besttime = info.array.ctime;
-			}
-			ss->free_super(st);
-		}
-	}
-	if (bestsuper != -1) {
-		int rv;
-		memset(st, 0, sizeof(*st));
-		rv = superlist[bestsuper]->load_super(st, fd, NULL);
-		if (rv == 0) {
-			superlist[bestsuper]->free_super(st);
-			return st;
+				*st = tst;
+				bestinfo = info;
+			} else
+				ss->free_super(&tst);
 		}
 	}
+	if (bestsuper != -1)
+		super_cache_note(st, &bestinfo);
+	probe_end();
+	if (!nprefetched)
+		super_cache_save();
+	if (bestsuper != -1)
+		return st;
 	free(st);
 	return NULL;
 }
@@ -1391,7 +2090,7 @@ int open_container(int fd)
 	/* 'fd' is a block device.  Find out if it is in use
 	 * by a container, and return an open fd on that container.
 	 */
-	char path[256];
+	char path[PATH_MAX];
 	char *e;
 	DIR *dir;
 	struct dirent *de;
@@ -1402,7 +2101,7 @@ int open_container(int fd)
 
 	if (fstat(fd, &st) != 0)
 		return -1;
-	sprintf(path, "/sys/dev/block/%d:%d/holders",
+	sprintf(path, "%s/sys/dev/block/%d:%d/holders", mdadm_root(),
 		(int)major(st.st_rdev), (int)minor(st.st_rdev));
 	e = path + strlen(path);
 
@@ -1671,7 +2370,7 @@ int devname2devnum(char *name)
 
 int stat2devnum(struct stat *st)
 {
-	char path[30];
+	char path[PATH_MAX];
 	char link[200];
 	char *cp;
 	int n;
@@ -1686,8 +2385,8 @@ int stat2devnum(struct stat *st)
 		 * /sys/dev/block/%d:%d link which must look like
 		 * ../../block/mdXXX/mdXXXpYY
 		 */
-		sprintf(path, "/sys/dev/block/%d:%d", major(st->st_rdev),
-			minor(st->st_rdev));
+		sprintf(path, "%s/sys/dev/block/%d:%d", mdadm_root(),
+			major(st->st_rdev), minor(st->st_rdev));
 		n = readlink(path, link, sizeof(link)-1);
 		if (n <= 0)
 			return NoMdDev;
@@ -1712,13 +2411,13 @@ int fd2devnum(int fd)
 
 int mdmon_pid(int devnum)
 {
-	char path[100];
+	char path[PATH_MAX];
 	char pid[10];
 	int fd;
 	int n;
 	char *devname = devnum2devname(devnum);
 
-	sprintf(path, "%s/%s.pid", MDMON_DIR, devname);
+	sprintf(path, "%s%s/%s.pid", mdadm_root(), MDMON_DIR, devname);
 	free(devname);
 
 	fd = open(path, O_RDONLY | O_NOATIME, 0);
@@ -1804,6 +2503,32 @@ int check_env(char *name)
 	return 0;
 }
 
+char *mdadm_root(void)
+{
+	/* Everything we look at in /sys and /proc, and the state files
+	 * we keep in MAP_DIR and MDMON_DIR, can be found below some
+	 * other root given by MDADM_ROOT.  This is only of use for
+	 * testing and benchmarking against a synthetic tree such as
+	 * the one built by mdsim.  Device nodes are never relocated.
+	 * It is limited to MDADM_ROOT_MAX so that it always fits in a
+	 * PATH_MAX buffer with whatever we add to it.
+	 */
+	static char *root = NULL;
+
+	if (!root) {
+		char *r = getenv("MDADM_ROOT");
+		if (!r || strcmp(r, "/") == 0)
+			r = "";
+		if (strlen(r) > MDADM_ROOT_MAX) {
+			fprintf(stderr, Name ": MDADM_ROOT is longer than %d "
+				"characters.\n", MDADM_ROOT_MAX);
+			exit(2);
+		}
+		root = r;
+	}
+	return root;
+}
+
 __u32 random32(void)
 {
 	__u32 rv;
@@ -1819,6 +2544,7 @@ __u32 random32(void)
 int flush_metadata_updates(struct supertype *st)
 {
 	int sfd;
+	int replies = 1;
 	if (!st->updates) {
 		st->update_tail = NULL;
 		return -1;
@@ -1828,17 +2554,21 @@ int flush_metadata_updates(struct supertype *st)
 	if (sfd < 0)
 		return -1;
 
+	/* mdmon acks each update as it queues it, so there is no
+	 * need to wait for one before sending the next.
+	 */
 	while (st->updates) {
 		struct metadata_update *mu = st->updates;
 		st->updates = mu->next;
 
-		send_message(sfd, mu, 0);
-		wait_reply(sfd, 0);
+		if (send_message(sfd, mu, 0) == 0)
+			replies++;
 		free(mu->buf);
 		free(mu);
 	}
 	ack(sfd, 0);
-	wait_reply(sfd, 0);
+	while (replies-- && wait_reply(sfd, 0) == 0)
+		;
 	close(sfd);
 	st->update_tail = NULL;
 	return 0;
@@ -1856,6 +2586,105 @@ void append_metadata_update(struct supertype *st, void *buf, int len)
 	*st->update_tail = mu;
 	st->update_tail = &mu->next;
 }
+
+static void latency_between(struct latency *lat, struct timespec *start,
+			    struct timespec *end)
+{
+	unsigned long us;
+	int b;
+
+	us = (end->tv_sec - start->tv_sec) * 1000000 +
+		(end->tv_nsec - start->tv_nsec) / 1000;
+	for (b = 0; b < LAT_BUCKETS-1 && us >= (1UL << b); b++)
+		;
+	lat->bucket[b]++;
+	lat->count++;
+	lat->total += us;
+	if (us > lat->max)
+		lat->max = us;
+}
+
+void latency_add(struct latency *lat, struct timespec *start)
+{
+	/* Record the time since 'start' */
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	latency_between(lat, start, &now);
+}
+
+unsigned long latency_percentile(struct latency *lat, int pct)
+{
+	/* The top of the bucket that the percentile falls in, which
+	 * is at most twice the real value, but never more than the
+	 * largest time seen.
+	 */
+	unsigned long long want = ((unsigned long long)lat->count * pct + 99) / 100;
+	unsigned long long seen = 0;
+	int b;
+
+	for (b = 0; b < LAT_BUCKETS-1; b++) {
+		seen += lat->bucket[b];
+		if (seen >= want)
+			break;
+	}
+	if (b < LAT_BUCKETS-1 && (1UL << b) < lat->max)
+		return 1UL << b;
+	return lat->max;
+}
+
+static void note_metadata_write(struct supertype *st,
+				struct metadata_write *w)
+{
+	/* A metadata handler has written to a device.  Count it,
+	 * and if mdmon wants to know how long it took, tell it.
+	 */
+	struct disk_latency *dl;
+
+	st->metadata_writes++;
+	for (dl = st->write_lat; dl; dl = dl->next)
+		if (dl->major == w->major && dl->minor == w->minor) {
+			latency_between(&dl->lat, &w->start, &w->end);
+			break;
+		}
+}
+
+/* mdmon sets this to something that does all the writes at once */
+void (*metadata_writer)(struct metadata_write *w, int n);
+
+void run_metadata_write(struct metadata_write *w)
+{
+	clock_gettime(CLOCK_MONOTONIC, &w->start);
+	errno = 0;
+	w->err = 0;
+	if (w->write(w) != 0)
+		w->err = errno ? errno : EIO;
+	clock_gettime(CLOCK_MONOTONIC, &w->end);
+}
+
+int write_metadata(struct supertype *st, struct metadata_write *w, int n)
+{
+	/* Write metadata to 'n' devices, each described by one of 'w'.
+	 * Nothing else may change the metadata until we return, as the
+	 * writes may happen together in other threads.
+	 * Returns the number that failed.  Each has its errno in ->err
+	 * for the caller to report.
+	 */
+	int failed = 0;
+	int i;
+
+	if (metadata_writer && n > 1)
+		metadata_writer(w, n);
+	else
+		for (i = 0; i < n; i++)
+			run_metadata_write(&w[i]);
+	for (i = 0; i < n; i++)
+		if (w[i].err)
+			failed++;
+		else
+			note_metadata_write(st, &w[i]);
+	return failed;
+}
 #endif /* MDASSEMBLE */
 
 #ifdef __TINYC__